@@ -0,0 +1,923 @@
+// Christian Dinh
+// eid: ctd487
+
+// Loader benchmark. Times every loader, exporter, the normal pass, the weld,
+// the face reordering, the level of detail chain and the meshlets over
+// the models/ directory and over generated OBJ files, and prints the results
+// as JSON so runs can be diffed.
+//
+//     ./bench_loader [--models DIR] [--dir DIR] [--sizes 1,10,50]
+//                    [--repeat N] [--threads N]
+//     ./bench_loader --check DIR [--models DIR] [--threads N]
+//
+// Sizes are in millions of triangles; generated files are kept in --dir and
+// reused while they have the expected size.
+//
+// --check times nothing. It runs the differential checks of the SIMD
+// scanner, the number decoders and the normal kernels over the OBJ files in
+// --models and in the given directory. It also parses each file from an
+// exact size buffer followed by an unreadable page, and through gzip whole
+// and cut in half, where the load must fail. It prints every mismatch and
+// exits with 1 if there was any. "make check" runs it over check/.
+
+#include <GL/gl.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <charconv>
+#include <new>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "geom.h"
+#include "loader.h"
+#include "plyloader.h"
+#include "stlloader.h"
+#include "glbloader.h"
+#include "objscan.h"
+#include "normals.h"
+#include "sidecar.h"
+#include "exporter.h"
+#include "mapfile.h"
+#include "weld.h"
+#include "reorder.h"
+#include "lod.h"
+#include "meshlet.h"
+
+// Every heap allocation in the process goes through these. They take the
+// memory from malloc, as the library's operator new does, so the library's
+// operator delete still frees it and is left alone.
+static std::atomic<size_t> allocCount{0};
+static std::atomic<size_t> allocBytes{0};
+
+void *operator new(size_t n) {
+    allocCount++;
+    allocBytes += n;
+    void *p = malloc(n ? n : 1);
+    if(p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t n) { return operator new(n); }
+
+void *operator new(size_t n, const std::nothrow_t &) noexcept {
+    allocCount++;
+    allocBytes += n;
+    return malloc(n ? n : 1);
+}
+
+void *operator new[](size_t n, const std::nothrow_t &t) noexcept { return operator new(n, t); }
+
+// One timed load
+struct BenchRun {
+    std::string file;
+    std::string loader;
+    size_t bytes;
+    size_t tris;
+    double seconds;
+    size_t peakRSS;
+    size_t allocs;
+    size_t allocMB;
+    bool ok;
+};
+
+// Peak resident set in kB since the last resetPeakRSS()
+static size_t peakRSS() {
+    FILE *f = fopen("/proc/self/status", "r");
+    if(f == NULL) return 0;
+    char line[256];
+    size_t kb = 0;
+    while(fgets(line, sizeof(line), f)) {
+        if(strncmp(line, "VmHWM:", 6) == 0) {
+            kb = strtoull(line + 6, NULL, 10);
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+static void resetPeakRSS() {
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if(f != NULL) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+static size_t fileSize(const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+static bool hasSuffix(const std::string &s, const char *suffix) {
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// Runs one load repeat times and keeps the fastest. The mesh is built from
+// scratch every time, so its allocations are part of the measurement.
+template <typename Load>
+static BenchRun measure(const std::string &file, const std::string &loader, size_t bytes, int repeat, Load load) {
+    BenchRun r = { file, loader, bytes, 0, 1e30, 0, 0, 0, true };
+    for(int i = 0; i < repeat; ++i) {
+        Trimesh *mesh = new Trimesh();
+        resetPeakRSS();
+        size_t count0 = allocCount, bytes0 = allocBytes;
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        r.ok = load(mesh) && r.ok;
+        double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        if(dt < r.seconds) {
+            r.seconds = dt;
+            r.allocs  = allocCount - count0;
+            r.allocMB = (allocBytes - bytes0) >> 20;
+            r.peakRSS = peakRSS();
+        }
+        r.tris = mesh->numFaces();
+        delete mesh;
+    }
+    return r;
+}
+
+// Times writing a loaded mesh, keeping the fastest of repeat runs. The
+// reported size is that of the written file.
+template <typename Save>
+static BenchRun measureSave(const std::string &file, const std::string &writer, const Trimesh *mesh,
+                            int repeat, Save save) {
+    BenchRun r = { file, writer, 0, (size_t)mesh->numFaces(), 1e30, 0, 0, 0, true };
+    for(int i = 0; i < repeat; ++i) {
+        resetPeakRSS();
+        size_t count0 = allocCount, bytes0 = allocBytes;
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        r.ok = save() && r.ok;
+        double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        if(dt < r.seconds) {
+            r.seconds = dt;
+            r.allocs  = allocCount - count0;
+            r.allocMB = (allocBytes - bytes0) >> 20;
+            r.peakRSS = peakRSS();
+        }
+        r.bytes = fileSize(file);
+    }
+    return r;
+}
+
+// Writes an OBJ of about ntris triangles over a grid. Rows mix triangles,
+// quads, small n-gons and long n-gons of a few hundred corners, with long
+// comment lines now and then, so every parser path is exercised.
+static bool generateOBJ(const std::string &path, size_t ntris) {
+    const int W = 1000;
+    size_t rows = ntris / (2 * W) + 1;
+    FILE *f = fopen(path.c_str(), "wb");
+    if(f == NULL) return false;
+    std::vector<char> buf(1 << 22);
+    setvbuf(f, buf.data(), _IOFBF, buf.size());
+
+    fprintf(f, "# generated by bench_loader, %zu triangles\n", ntris);
+    unsigned seed = 12345;
+    for(size_t y = 0; y <= rows; ++y) {
+        for(int x = 0; x <= W; ++x) {
+            seed = seed * 1103515245 + 12345;
+            float h = (seed >> 16 & 0x7fff) / 32768.0f * 0.01f;
+            fprintf(f, "v %.6f %.6f %.6f\n", x / (float)W, y / (float)W, h);
+        }
+    }
+
+    std::string comment(4000, 'x');
+    size_t tris = 0;
+    for(size_t y = 0; y < rows && tris < ntris; ++y) {
+        if(y % 64 == 0) {
+            fprintf(f, "# %s\n", comment.c_str());
+        }
+        // Corner (x, y) of the grid as a 1-based index
+        #define GRID(x, y) ((size_t)(y) * (W + 1) + (x) + 1)
+        for(int x = 0; x < W && tris < ntris; ) {
+            int kind = (x + y) % 16;
+            if(kind < 8) {
+                fprintf(f, "f %zu %zu %zu %zu\n", GRID(x, y), GRID(x + 1, y), GRID(x + 1, y + 1), GRID(x, y + 1));
+                tris += 2;
+                x += 1;
+            } else if(kind < 12) {
+                fprintf(f, "f %zu %zu %zu\nf %zu %zu %zu\n", GRID(x, y), GRID(x + 1, y), GRID(x + 1, y + 1),
+                        GRID(x, y), GRID(x + 1, y + 1), GRID(x, y + 1));
+                tris += 2;
+                x += 1;
+            } else {
+                // An n-gon over k cells: along the bottom row, back along the top
+                int k = kind == 15 && x + 150 <= W ? 150 : (x + 3 <= W ? 3 : 1);
+                fputs("f", f);
+                for(int i = 0; i <= k; ++i) fprintf(f, " %zu", GRID(x + i, y));
+                for(int i = k; i >= 0; --i) fprintf(f, " %zu", GRID(x + i, y + 1));
+                fputc('\n', f);
+                tris += 2 * k;
+                x += k;
+            }
+        }
+        #undef GRID
+    }
+    return fclose(f) == 0;
+}
+
+static bool gzipFile(const std::string &src, const std::string &dst) {
+    MappedFile in(src.c_str());
+    gzFile out = gzopen(dst.c_str(), "wb6");
+    if(!in.isOpen() || out == NULL) return false;
+    size_t at = 0;
+    while(at < in.size()) {
+        unsigned n = in.size() - at < (1u << 24) ? in.size() - at : 1u << 24;
+        if(gzwrite(out, in.data() + at, n) != (int)n) break;
+        at += n;
+    }
+    return gzclose(out) == Z_OK && at == in.size();
+}
+
+// Times the exporters on a parsed mesh, writing next to out, and reading
+// the PLY copy back in
+static void benchExport(const Trimesh *mesh, const std::string &out, int repeat, std::vector<BenchRun> &runs) {
+    std::string obj = out + ".export.obj";
+    std::string ply = out + ".export.ply";
+    runs.push_back(measureSave(obj, "export_obj", mesh, repeat, [&] {
+        return MeshExporter().save(obj, mesh);
+    }));
+    runs.push_back(measureSave(ply, "export_ply", mesh, repeat, [&] {
+        return MeshExporter().save(ply, mesh);
+    }));
+    runs.push_back(measure(ply, "ply", fileSize(ply), repeat, [&](Trimesh *m) {
+        return PlyLoader().loadPLY(ply.c_str(), m);
+    }));
+    remove(obj.c_str());
+    remove(ply.c_str());
+    remove((out + ".export.mtl").c_str());
+}
+
+// Times the vertex normal pass on a parsed mesh, single threaded and with
+// threads. The reported size is that of the source file.
+static void benchNormals(Trimesh *mesh, const std::string &path, int repeat, int threads,
+                         std::vector<BenchRun> &runs) {
+    runs.push_back(measureSave(path, "normals_1thread", mesh, repeat, [&] {
+        mesh->computeNormals(1);
+        return true;
+    }));
+    if(threads > 1) {
+        runs.push_back(measureSave(path, "normals_" + std::to_string(threads) + "threads", mesh, repeat, [&] {
+            mesh->computeNormals(threads);
+            return true;
+        }));
+    }
+}
+
+// Vertex and byte reduction of welding one file
+struct WeldResult {
+    std::string file;
+    WeldStats stats;
+};
+
+// Times welding a triangle soup of a parsed mesh, every face with its own
+// three vertices as an STL file would have them, single threaded and with
+// threads. Building the soup is part of the time, it is a copy.
+static void benchWeld(const Trimesh *mesh, const std::string &path, int repeat, int threads,
+                      std::vector<BenchRun> &runs, std::vector<WeldResult> &welds) {
+    size_t nfaces = mesh->numFaces();
+    std::vector<float> soup(9 * nfaces);
+    std::vector<int> ids(3 * nfaces);
+    for(size_t i = 0; i < 3 * nfaces; ++i) {
+        memcpy(&soup[3 * i], &mesh->getPositions()[3 * (size_t)mesh->getIndices()[i]], 3 * sizeof(float));
+        ids[i] = i;
+    }
+    WeldResult w = { path, WeldStats() };
+    std::vector<int> counts = { 1 };
+    if(threads > 1) counts.push_back(threads);
+    for(int nt : counts) {
+        std::string name = nt == 1 ? "weld_1thread" : "weld_" + std::to_string(nt) + "threads";
+        runs.push_back(measure(path, name, fileSize(path), repeat, [&](Trimesh *m) {
+            m->reserve(3 * nfaces, nfaces);
+            m->addVertices(soup.data(), 3 * nfaces);
+            m->addFaces(ids.data(), nfaces);
+            MeshWelder(1e-6f, nt).weld(m, &w.stats);
+            return true;
+        }));
+    }
+    welds.push_back(w);
+}
+
+// Vertex cache efficiency of one file as parsed and reordered
+struct ReorderResult {
+    std::string file;
+    double acmr[3];
+    size_t clusters;
+};
+
+// Times reordering the faces of a parsed mesh for the vertex cache, plain
+// and with the overdraw ordering, and measures the ACMR of each. The mesh
+// keeps its adjacency after the first run, so the fastest run is the
+// walk alone.
+static void benchReorder(const Trimesh *mesh, const std::string &path, int repeat,
+                         std::vector<BenchRun> &runs, std::vector<ReorderResult> &reorders) {
+    ReorderResult r = { path, { FaceReorder::acmr(mesh), 0.0, 0.0 }, 0 };
+    std::vector<uint32_t> ids;
+    for(int overdraw = 0; overdraw < 2; ++overdraw) {
+        runs.push_back(measureSave(path, overdraw ? "reorder_overdraw" : "reorder", mesh, repeat, [&] {
+            r.clusters = FaceReorder(overdraw).order(mesh, ids);
+            return true;
+        }));
+        r.acmr[1 + overdraw] = FaceReorder::acmr(ids.data(), mesh->numFaces(), mesh->numVerts());
+    }
+    reorders.push_back(r);
+}
+
+// Faces and error of every level of detail of one file
+struct LodResult {
+    std::string file;
+    std::vector<std::pair<size_t, float> > levels;
+};
+
+// Times building the level of detail chain of a parsed mesh with
+// LodChain's own steps, on one thread
+static void benchLod(const Trimesh *mesh, const std::string &path, int repeat,
+                     std::vector<BenchRun> &runs, std::vector<LodResult> &lods) {
+    LodResult r = { path, {} };
+    runs.push_back(measureSave(path, "lod_chain", mesh, repeat, [&] {
+        r.levels.clear();
+        MeshSimplifier s(mesh);
+        size_t faces = mesh->numFaces();
+        for(int i = 0; i < LOD_MAX_LEVELS; ++i) {
+            Trimesh *level = LodChain::nextLevel(s, faces);
+            if(level == NULL) break;
+            faces = level->numFaces();
+            r.levels.push_back(std::make_pair(faces, s.error()));
+            delete level;
+        }
+        return true;
+    }));
+    lods.push_back(r);
+}
+
+// Meshlets of one file and the fraction of its faces culled, looking at
+// the middle from 3 and from 1.2 bounding radii along each axis
+struct MeshletResult {
+    std::string file;
+    size_t meshlets, cones;
+    double culled[2];
+};
+
+// Column major view of a 45 degree camera at eye looking at center
+static void lookAt(const float *eye, const float *center, float radius, float *mv, float *proj) {
+    float f[3], up[3] = { 0.0f, 1.0f, 0.0f }, side[3], u[3];
+    float len = 0.0f;
+    for(int k = 0; k < 3; ++k) {
+        f[k] = center[k] - eye[k];
+        len += f[k] * f[k];
+    }
+    len = sqrtf(len);
+    for(int k = 0; k < 3; ++k) f[k] /= len;
+    if(fabsf(f[1]) > 0.9f) {
+        up[1] = 0.0f;
+        up[2] = 1.0f;
+    }
+    side[0] = f[1] * up[2] - f[2] * up[1];
+    side[1] = f[2] * up[0] - f[0] * up[2];
+    side[2] = f[0] * up[1] - f[1] * up[0];
+    len = sqrtf(side[0] * side[0] + side[1] * side[1] + side[2] * side[2]);
+    for(int k = 0; k < 3; ++k) side[k] /= len;
+    u[0] = side[1] * f[2] - side[2] * f[1];
+    u[1] = side[2] * f[0] - side[0] * f[2];
+    u[2] = side[0] * f[1] - side[1] * f[0];
+    memset(mv, 0, 16 * sizeof(float));
+    for(int k = 0; k < 3; ++k) {
+        mv[4 * k]     = side[k];
+        mv[4 * k + 1] = u[k];
+        mv[4 * k + 2] = -f[k];
+    }
+    mv[12] = -(side[0] * eye[0] + side[1] * eye[1] + side[2] * eye[2]);
+    mv[13] = -(u[0] * eye[0] + u[1] * eye[1] + u[2] * eye[2]);
+    mv[14] = f[0] * eye[0] + f[1] * eye[1] + f[2] * eye[2];
+    mv[15] = 1.0f;
+    float n = 0.01f * radius, fa = 100.0f * radius, c = 1.0f / tanf(22.5f * (float)M_PI / 180.0f);
+    memset(proj, 0, 16 * sizeof(float));
+    proj[0]  = c;
+    proj[5]  = c;
+    proj[10] = (fa + n) / (n - fa);
+    proj[11] = -1.0f;
+    proj[14] = 2.0f * fa * n / (n - fa);
+}
+
+// Times cutting a mesh into meshlets, in the order MeshCache leaves its
+// faces, and measures how much of it the culling drops
+static void benchMeshlets(const Trimesh *mesh, const std::string &path, int repeat,
+                          std::vector<BenchRun> &runs, std::vector<MeshletResult> &results) {
+    std::vector<uint32_t> ids;
+    FaceReorder(true).order(mesh, ids);
+    std::vector<std::pair<size_t, size_t> > ranges;
+    size_t covered = 0;
+    for(const Submesh &sm : mesh->getSubmeshes()) {
+        if(covered < (size_t)sm.first) ranges.push_back(std::make_pair(covered, (size_t)sm.first));
+        ranges.push_back(std::make_pair((size_t)sm.first, (size_t)sm.first + sm.count));
+        covered = sm.first + sm.count;
+    }
+    if(covered < (size_t)mesh->numFaces()) ranges.push_back(std::make_pair(covered, (size_t)mesh->numFaces()));
+
+    // Positions are read a float past the end, as in a Trimesh
+    std::vector<float> pos(mesh->getPositions(), mesh->getPositions() + 3 * mesh->numVerts());
+    pos.push_back(0.0f);
+    std::vector<Meshlet> meshlets;
+    runs.push_back(measureSave(path, "meshlets", mesh, repeat, [&] {
+        Meshlets::build(pos.data(), ids.data(), mesh->numFaces(), mesh->numVerts(), ranges, meshlets);
+        return true;
+    }));
+
+    MeshletResult r = { path, meshlets.size(), 0, { 0.0, 0.0 } };
+    for(const Meshlet &m : meshlets) r.cones += m.cutoff < 1.0f;
+    const float *b = mesh->getBounds();
+    float center[3], radius = 0.0f;
+    for(int k = 0; k < 3; ++k) {
+        center[k] = (b[k] + b[k + 3]) / 2.0f;
+        radius = std::max(radius, (b[k + 3] - b[k]) / 2.0f);
+    }
+    for(int near = 0; near < 2; ++near) {
+        size_t faces = 0, drawn = 0;
+        for(int axis = 0; axis < 6; ++axis) {
+            float eye[3] = { center[0], center[1], center[2] }, mv[16], proj[16];
+            eye[axis / 2] += (axis % 2 ? -1.0f : 1.0f) * (near ? 1.2f : 3.0f) * radius;
+            lookAt(eye, center, radius, mv, proj);
+            MeshletView view;
+            MeshletStats stats;
+            std::vector<std::pair<size_t, size_t> > kept;
+            if(!Meshlets::view(mv, proj, view)) continue;
+            Meshlets::cull(meshlets, 0, mesh->numFaces(), view, kept, stats);
+            faces += stats.faces;
+            drawn += stats.drawn;
+        }
+        r.culled[near] = faces > 0 ? 1.0 - (double)drawn / faces : 0.0;
+    }
+    results.push_back(r);
+}
+
+// Times the OBJ loaders, the exporters and the sidecar on path. Exports go
+// to out with extensions added. A gzip copy is written to gz and timed too,
+// unless gz is empty.
+static void benchFile(const std::string &path, const std::string &out, const std::string &gz, int repeat, int threads,
+                      std::vector<BenchRun> &runs, std::vector<WeldResult> &welds,
+                      std::vector<ReorderResult> &reorders, std::vector<LodResult> &lods,
+                      std::vector<MeshletResult> &meshlets) {
+    size_t bytes = fileSize(path);
+    runs.push_back(measure(path, "obj_1thread", bytes, repeat, [&](Trimesh *m) {
+        return TrimeshLoader().loadOBJ(path.c_str(), m, 1);
+    }));
+    if(threads > 1) {
+        runs.push_back(measure(path, "obj_" + std::to_string(threads) + "threads", bytes, repeat, [&](Trimesh *m) {
+            return TrimeshLoader().loadOBJ(path.c_str(), m, threads);
+        }));
+    }
+    if(!gz.empty()) {
+        if(fileSize(gz) == 0) gzipFile(path, gz);
+        runs.push_back(measure(gz, "obj_gzip", fileSize(gz), repeat, [&](Trimesh *m) {
+            return TrimeshLoader().loadOBJ(gz.c_str(), m, threads);
+        }));
+    }
+
+    // Exports of a fresh parse, and its sidecar, removed again afterwards.
+    // The parsed mesh is gone before the sidecar is timed so it does not
+    // count towards peak RSS.
+    Trimesh *mesh = new Trimesh();
+    bool saved = TrimeshLoader().loadOBJ(path.c_str(), mesh, threads);
+    if(saved) {
+        benchExport(mesh, out, repeat, runs);
+        benchNormals(mesh, path, repeat, threads, runs);
+        benchWeld(mesh, path, repeat, threads, runs, welds);
+        benchReorder(mesh, path, repeat, runs, reorders);
+        benchLod(mesh, path, repeat, runs, lods);
+        benchMeshlets(mesh, path, repeat, runs, meshlets);
+    }
+    saved = saved && MeshSidecar::save(path, mesh);
+    delete mesh;
+    if(saved) {
+        std::string sidecar = path + SIDECAR_EXT;
+        runs.push_back(measure(sidecar, "sidecar", fileSize(sidecar), repeat, [&](Trimesh *m) {
+            return MeshSidecar::load(path, m);
+        }));
+        remove(sidecar.c_str());
+    }
+}
+
+// PLY, STL and glb files found next to the OBJ models
+static void benchOther(const std::string &path, int repeat, std::vector<BenchRun> &runs) {
+    size_t bytes = fileSize(path);
+    if(hasSuffix(path, ".ply")) {
+        runs.push_back(measure(path, "ply", bytes, repeat, [&](Trimesh *m) {
+            return PlyLoader().loadPLY(path.c_str(), m);
+        }));
+    } else if(hasSuffix(path, ".stl")) {
+        runs.push_back(measure(path, "stl", bytes, repeat, [&](Trimesh *m) {
+            return StlLoader().loadSTL(path.c_str(), m);
+        }));
+    } else if(hasSuffix(path, ".glb")) {
+        runs.push_back(measure(path, "glb", bytes, repeat, [&](Trimesh *m) {
+            GlbFile file;
+            return file.open(path.c_str()) && file.buildScene(m);
+        }));
+    }
+}
+
+// The .obj files of a directory, and the .ply, .stl and .glb ones in others
+static void listModels(const std::string &dir, std::vector<std::string> &files, std::vector<std::string> &others) {
+    DIR *d = opendir(dir.c_str());
+    for(struct dirent *e; d != NULL && (e = readdir(d)) != NULL; ) {
+        std::string name = e->d_name;
+        if(hasSuffix(name, ".obj")) {
+            files.push_back(dir + "/" + name);
+        } else if(hasSuffix(name, ".ply") || hasSuffix(name, ".stl") || hasSuffix(name, ".glb")) {
+            others.push_back(dir + "/" + name);
+        }
+    }
+    if(d != NULL) closedir(d);
+    std::sort(files.begin(), files.end());
+    std::sort(others.begin(), others.end());
+}
+
+// FNV-1a over bytes, chained through h
+static uint64_t hashBytes(uint64_t h, const void *data, size_t n) {
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    for(size_t i = 0; i < n; ++i) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Hash of everything a load produces: positions, faces, normals and texture
+// coordinates from the file, and the submeshes
+static uint64_t meshHash(const Trimesh &m) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    h = hashBytes(h, m.getPositions(), 3 * (size_t)m.numVerts() * sizeof(float));
+    h = hashBytes(h, m.getIndices(), 3 * (size_t)m.numFaces() * sizeof(uint32_t));
+    if(m.hasFileNormals()) {
+        h = hashBytes(h, m.getNormals(), 3 * (size_t)m.numVerts() * sizeof(float));
+    }
+    h = hashBytes(h, m.getTexcoords().data(), m.getTexcoords().size() * sizeof(float));
+    for(const Submesh &sm : m.getSubmeshes()) {
+        h = hashBytes(h, sm.name.data(), sm.name.size());
+        h = hashBytes(h, &sm.material, sizeof(sm.material));
+        h = hashBytes(h, &sm.first, sizeof(sm.first));
+        h = hashBytes(h, &sm.count, sizeof(sm.count));
+    }
+    return h;
+}
+
+// A copy of a buffer that ends where an inaccessible page starts, so a read
+// one byte past the end faults even where a file mapping would have slack
+struct GuardedCopy {
+    char *map = NULL;
+    size_t mapSize = 0;
+    const char *data = NULL;
+
+    GuardedCopy(const char *src, size_t size) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t body = (size + page - 1) / page * page;
+        void *m = mmap(NULL, body + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(m == MAP_FAILED) return;
+        map = static_cast<char*>(m);
+        mapSize = body + page;
+        mprotect(map + body, page, PROT_NONE);
+        memcpy(map + body - size, src, size);
+        data = map + body - size;
+    }
+
+    ~GuardedCopy() {
+        if(map != NULL) munmap(map, mapSize);
+    }
+};
+
+// What the decoders must return: std::from_chars after an optional '+',
+// and the token start with a zero value when nothing parses
+template <typename T>
+static const char *decodeReference(const char *p, const char *e, T &out) {
+    out = 0;
+    std::from_chars_result r = std::from_chars(p + (p < e && *p == '+'), e, out);
+    return r.ec == std::errc::invalid_argument ? p : r.ptr;
+}
+
+// Decodes every token of a buffer, and every part of a v/vt/vn corner, as
+// a float and as an int, against the reference. Returns the number of
+// mismatches, the first one in what.
+static size_t checkDecoders(const char *data, size_t size, size_t &tokens, std::string &what) {
+    const char *e = data + size;
+    size_t bad = 0;
+    for(const char *p = data; p < e; ) {
+        if(ObjScanner::isSep(*p) || *p == '\n') {
+            p++;
+            continue;
+        }
+        const char *tok = p;
+        while(p < e && !ObjScanner::isSep(*p) && *p != '\n') p++;
+        for(const char *q = tok; q < p; ) {
+            float f, rf;
+            int i, ri;
+            const char *a = ObjScanner::decodeFloat(q, e, f), *b = decodeReference(q, e, rf);
+            const char *c = ObjScanner::decodeInt(q, e, i),   *d = decodeReference(q, e, ri);
+            tokens++;
+            if(a != b || memcmp(&f, &rf, sizeof(f)) != 0 || c != d || i != ri) {
+                if(bad++ == 0) what = std::string(q, p);
+            }
+            q = std::find(q, p, '/');
+            q += q < p;
+        }
+    }
+    return bad;
+}
+
+// Runs the differential checks over the OBJ files of models and check.
+// Every scanner level must classify the bytes and load the mesh exactly as
+// the scalar kernel on one thread does, also on threads threads, which
+// split files of more than MIN_CHUNK_SIZE bytes. In check, files named
+// <group>_*.obj must load to the same mesh, and a first line
+// "# N triangles" gives the expected triangle count. Returns the number of
+// mismatches.
+static int runChecks(const std::string &models, const std::string &check, int threads) {
+    static const char *levels[] = { "scalar", "sse2", "avx2" };
+    std::vector<ScanLevel> vector = { SCAN_SSE2 };
+    if(ObjScanner::detectLevel() == SCAN_AVX2) {
+        vector.push_back(SCAN_AVX2);
+    }
+    ScanLevel saved = ObjScanner::level();
+    int failures = 0;
+    size_t files = 0, tokens = 0;
+    for(const std::string &dir : { models, check }) {
+        std::vector<std::string> objs, others;
+        listModels(dir, objs, others);
+        std::vector<std::pair<std::string, uint64_t> > groups;
+        for(const std::string &f : objs) {
+            std::vector<std::string> fails;
+            MappedFile m(f.c_str());
+            if(!m.isOpen()) {
+                fails.push_back("cannot open");
+            }
+            for(ScanLevel l : vector) {
+                if(m.isOpen() && !ObjScanner::agrees(l, m.data(), m.size())) {
+                    fails.push_back(std::string(levels[l]) + " masks differ from scalar");
+                }
+            }
+            std::string token;
+            size_t bad = m.isOpen() ? checkDecoders(m.data(), m.size(), tokens, token) : 0;
+            if(bad > 0) {
+                fails.push_back(std::to_string(bad) + " tokens decode differently, first \"" + token + "\"");
+            }
+
+            // Loads at every level and thread count against the scalar one
+            ObjScanner::level() = SCAN_SCALAR;
+            Trimesh ref;
+            bool ok = TrimeshLoader().loadOBJ(f.c_str(), &ref, 1);
+            uint64_t h = meshHash(ref);
+            for(ScanLevel l : vector) {
+                for(int t = 1; t <= threads; t = t < threads ? threads : t + 1) {
+                    ObjScanner::level() = l;
+                    Trimesh mesh;
+                    if(!TrimeshLoader().loadOBJ(f.c_str(), &mesh, t) || meshHash(mesh) != h) {
+                        fails.push_back(std::string(levels[l]) + " mesh on " + std::to_string(t) +
+                                        " threads differs from scalar");
+                    }
+                }
+            }
+            // The whole file as one exact size range, the way the gzip path
+            // hands lines to the parser, at every level
+            GuardedCopy copy(m.data(), m.isOpen() ? m.size() : 0);
+            for(ScanLevel l : { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 }) {
+                if(copy.data == NULL || (l == SCAN_AVX2 && ObjScanner::detectLevel() != SCAN_AVX2)) continue;
+                ObjScanner::level() = l;
+                std::vector<ObjChunk> chunks(1);
+                TrimeshLoader loader;
+                loader.setMaterialDir(f.c_str());
+                loader.parseRange(chunks[0], copy.data, copy.data + m.size());
+                Trimesh mesh;
+                loader.buildMesh(chunks, &mesh);
+                if(meshHash(mesh) != h) {
+                    fails.push_back(std::string(levels[l]) + " mesh from an exact size buffer differs");
+                }
+            }
+            // Through gzip, next to the file so its materials are found.
+            // The whole stream must give the same mesh, and one cut short
+            // must fail rather than return the lines before the cut.
+            std::string gz = f + ".XXXXXX";
+            int fd = mkstemp(&gz[0]);
+            if(fd >= 0) {
+                close(fd);
+                Trimesh whole, cut;
+                if(!gzipFile(f, gz) || !TrimeshLoader().loadOBJ(gz.c_str(), &whole) || meshHash(whole) != h) {
+                    fails.push_back("mesh through gzip differs");
+                }
+                if(truncate(gz.c_str(), fileSize(gz) / 2) != 0 || TrimeshLoader().loadOBJ(gz.c_str(), &cut)) {
+                    fails.push_back("truncated gzip loads");
+                }
+                unlink(gz.c_str());
+            }
+            if(!ok) {
+                fails.push_back("does not load");
+            }
+            if(ok && !FaceNormals::agrees(NORMAL_SSE2, ref.getPositions(), ref.getIndices(), ref.numFaces())) {
+                fails.push_back("sse2 face normals differ from scalar");
+            }
+
+            size_t expect;
+            if(dir == check && m.isOpen() && sscanf(m.data(), "# %zu triangles", &expect) == 1 && expect != (size_t)ref.numFaces()) {
+                fails.push_back(std::to_string(ref.numFaces()) + " triangles, expected " + std::to_string(expect));
+            }
+            std::string name = f.substr(f.find_last_of('/') + 1);
+            if(dir == check && name.find('_') != std::string::npos) {
+                std::string group = name.substr(0, name.find('_'));
+                auto g = std::find_if(groups.begin(), groups.end(), [&](const std::pair<std::string, uint64_t> &x) {
+                    return x.first == group;
+                });
+                if(g == groups.end()) {
+                    groups.push_back(std::make_pair(group, h));
+                } else if(g->second != h) {
+                    fails.push_back("mesh differs from the rest of group " + group);
+                }
+            }
+
+            files++;
+            failures += fails.size();
+            for(const std::string &w : fails) {
+                printf("FAIL %s: %s\n", f.c_str(), w.c_str());
+            }
+            if(fails.empty()) {
+                printf("ok   %s\n", f.c_str());
+            }
+        }
+    }
+    ObjScanner::level() = saved;
+    printf("%zu files, %zu tokens, %d mismatches\n", files, tokens, failures);
+    return failures;
+}
+
+static void printString(const std::string &s) {
+    putchar('"');
+    for(char c : s) {
+        if(c == '"' || c == '\\') putchar('\\');
+        putchar(c);
+    }
+    putchar('"');
+}
+
+int main(int argc, char **argv) {
+    std::string models = "models";
+    std::string dir    = "/tmp/bench_loader";
+    std::vector<size_t> sizes = { 1, 10, 50 };
+    int repeat  = 3;
+    std::string check;
+    int threads = TrimeshLoader::defaultThreads();
+
+    for(int i = 1; i + 1 < argc; i += 2) {
+        std::string opt = argv[i];
+        if(opt == "--models")       models  = argv[i + 1];
+        else if(opt == "--check")   check   = argv[i + 1];
+        else if(opt == "--dir")     dir     = argv[i + 1];
+        else if(opt == "--repeat")  repeat  = atoi(argv[i + 1]);
+        else if(opt == "--threads") threads = atoi(argv[i + 1]);
+        else if(opt == "--sizes") {
+            sizes.clear();
+            for(char *p = argv[i + 1]; *p; ) {
+                char *e;
+                size_t n = strtoull(p, &e, 10);
+                if(e == p) break;
+                sizes.push_back(n);
+                p = *e == ',' ? e + 1 : e;
+            }
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if(repeat < 1)  repeat  = 1;
+    if(threads < 1) threads = 1;
+    if(!check.empty()) {
+        return runChecks(models, check, threads) == 0 ? 0 : 1;
+    }
+
+    std::vector<std::string> files, others;
+    listModels(models, files, others);
+
+    // Differential check of the SIMD byte classifiers before timing them
+    std::vector<std::pair<std::string, bool> > agree;
+    for(const std::string &f : files) {
+        MappedFile m(f.c_str());
+        bool ok = m.isOpen() && ObjScanner::agrees(SCAN_SSE2, m.data(), m.size());
+        if(ObjScanner::detectLevel() == SCAN_AVX2) {
+            ok = ok && ObjScanner::agrees(SCAN_AVX2, m.data(), m.size());
+        }
+        agree.push_back(std::make_pair(f, ok));
+    }
+
+    // And of the face normal kernels
+    std::vector<std::pair<std::string, bool> > normalsAgree;
+    for(const std::string &f : files) {
+        Trimesh mesh;
+        bool ok = TrimeshLoader().loadOBJ(f.c_str(), &mesh, 1);
+        const float *pos = mesh.getPositions();
+        const uint32_t *ids = mesh.getIndices();
+        ok = ok && FaceNormals::agrees(NORMAL_SSE2, pos, ids, mesh.numFaces());
+        normalsAgree.push_back(std::make_pair(f, ok));
+    }
+
+    mkdir(dir.c_str(), 0755);
+    std::vector<BenchRun> runs;
+    std::vector<WeldResult> welds;
+    std::vector<ReorderResult> reorders;
+    std::vector<LodResult> lods;
+    std::vector<MeshletResult> meshlets;
+    for(const std::string &f : files) {
+        std::string out = dir + f.substr(f.find_last_of('/'));
+        benchFile(f, out, out + ".gz", repeat, threads, runs, welds, reorders, lods, meshlets);
+    }
+    for(const std::string &f : others) {
+        benchOther(f, repeat, runs);
+    }
+
+    for(size_t millions : sizes) {
+        std::string path = dir + "/synthetic_" + std::to_string(millions) + "M.obj";
+        std::string mark = path + ".done";
+        if(fileSize(mark) == 0 || fileSize(path) == 0) {
+            fprintf(stderr, "generating %s\n", path.c_str());
+            if(!generateOBJ(path, millions * 1000000)) {
+                fprintf(stderr, "could not write %s\n", path.c_str());
+                continue;
+            }
+            FILE *f = fopen(mark.c_str(), "w");
+            if(f != NULL) {
+                fprintf(f, "%zu\n", fileSize(path));
+                fclose(f);
+            }
+        }
+        fprintf(stderr, "timing %s\n", path.c_str());
+        benchFile(path, path, millions <= 10 ? path + ".gz" : "", repeat, threads, runs, welds, reorders, lods,
+                  meshlets);
+    }
+
+    static const char *levels[] = { "scalar", "sse2", "avx2" };
+    printf("{\n  \"threads\": %d,\n  \"repeat\": %d,\n  \"scan_level\": \"%s\",\n",
+           threads, repeat, levels[ObjScanner::level()]);
+    printf("  \"scanner_agrees\": {");
+    for(size_t i = 0; i < agree.size(); ++i) {
+        printf(i ? ", " : "");
+        printString(agree[i].first);
+        printf(": %s", agree[i].second ? "true" : "false");
+    }
+    printf("},\n  \"normal_level\": \"%s\",\n  \"normals_agree\": {", levels[FaceNormals::level()]);
+    for(size_t i = 0; i < normalsAgree.size(); ++i) {
+        printf(i ? ", " : "");
+        printString(normalsAgree[i].first);
+        printf(": %s", normalsAgree[i].second ? "true" : "false");
+    }
+    printf("},\n  \"weld\": {");
+    for(size_t i = 0; i < welds.size(); ++i) {
+        const WeldStats &w = welds[i].stats;
+        printf(i ? ",\n    " : "\n    ");
+        printString(welds[i].file);
+        printf(": {\"verts\": [%zu, %zu], \"faces\": [%zu, %zu], \"bytes\": [%zu, %zu]}",
+               w.vertsBefore, w.vertsAfter, w.facesBefore, w.facesAfter, w.bytesBefore, w.bytesAfter);
+    }
+    printf("\n  },\n  \"reorder\": {");
+    for(size_t i = 0; i < reorders.size(); ++i) {
+        const ReorderResult &r = reorders[i];
+        printf(i ? ",\n    " : "\n    ");
+        printString(r.file);
+        printf(": {\"acmr\": %.3f, \"acmr_reordered\": %.3f, \"acmr_overdraw\": %.3f, \"clusters\": %zu}",
+               r.acmr[0], r.acmr[1], r.acmr[2], r.clusters);
+    }
+    printf("\n  },\n  \"lod\": {");
+    for(size_t i = 0; i < lods.size(); ++i) {
+        const LodResult &r = lods[i];
+        printf(i ? ",\n    " : "\n    ");
+        printString(r.file);
+        printf(": {\"faces\": [");
+        for(size_t k = 0; k < r.levels.size(); ++k) printf(k ? ", %zu" : "%zu", r.levels[k].first);
+        printf("], \"error\": [");
+        for(size_t k = 0; k < r.levels.size(); ++k) printf(k ? ", %.6g" : "%.6g", r.levels[k].second);
+        printf("]}");
+    }
+    printf("\n  },\n  \"meshlets\": {");
+    for(size_t i = 0; i < meshlets.size(); ++i) {
+        const MeshletResult &r = meshlets[i];
+        printf(i ? ",\n    " : "\n    ");
+        printString(r.file);
+        printf(": {\"meshlets\": %zu, \"with_cones\": %zu, \"culled_far\": %.3f, \"culled_near\": %.3f}",
+               r.meshlets, r.cones, r.culled[0], r.culled[1]);
+    }
+    printf("\n  },\n  \"runs\": [\n");
+    for(size_t i = 0; i < runs.size(); ++i) {
+        const BenchRun &r = runs[i];
+        printf("    {\"file\": ");
+        printString(r.file);
+        printf(", \"loader\": \"%s\", \"ok\": %s, \"bytes\": %zu, \"tris\": %zu, \"seconds\": %.4f, "
+               "\"mb_per_s\": %.1f, \"tris_per_s\": %.0f, \"peak_rss_mb\": %.1f, \"allocs\": %zu, \"alloc_mb\": %zu}%s\n",
+               r.loader.c_str(), r.ok ? "true" : "false", r.bytes, r.tris, r.seconds,
+               r.bytes / 1e6 / r.seconds, r.tris / r.seconds, r.peakRSS / 1024.0,
+               r.allocs, r.allocMB, i + 1 < runs.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
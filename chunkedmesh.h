@@ -0,0 +1,402 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __CHUNKEDMESH_H__
+#define __CHUNKEDMESH_H__
+
+#include <set>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "geom.h"
+#include "loadpool.h"
+
+#define CHUNK_EXT     ".tmk"
+#define CHUNK_VERSION 1
+
+// Faces per chunk at most, and the alignment of chunk data in the file
+#define CHUNK_FACES (1 << 16)
+#define CHUNK_ALIGN 4096
+
+// Default for all paged meshes together, see setBudget
+#define CHUNK_BUDGET_MB 512
+
+// Chunk reads queued per mesh at once, so turning the camera does not
+// bury the load pool under chunks that are off screen again
+#define CHUNK_MAX_INFLIGHT 8
+
+// Out-of-core mesh file. The faces are split into spatially compact chunks
+// of at most CHUNK_FACES faces, each with its own copy of the vertices it
+// uses, so a chunk can be drawn on its own:
+//
+//     ChunkFileHeader
+//     ChunkRecord     chunks[nchunks]
+//     per chunk, at its offset (a multiple of CHUNK_ALIGN):
+//         float    positions[3 * nverts]
+//         float    normals[3 * nverts]
+//         uint32_t indices[3 * nfaces]       (into the chunk's vertices)
+//
+// Files are written by MeshExporter from meshes that fit in memory, on a
+// machine that can hold them, and drawn by ChunkedMesh where they do not.
+struct ChunkFileHeader {
+    char     magic[4];
+    uint32_t version;
+    uint32_t nchunks;
+    uint32_t reserved;
+    uint64_t nverts;
+    uint64_t nfaces;
+    float    bounds[6];
+};
+
+struct ChunkRecord {
+    float    bounds[6];
+    uint64_t offset;
+    uint32_t nverts;
+    uint32_t nfaces;
+
+    size_t bytes() const {
+        return (size_t)nverts * 6 * sizeof(float) + (size_t)nfaces * 3 * sizeof(uint32_t);
+    }
+};
+
+// Draws a chunked mesh file while only part of it is in memory. Every draw
+// culls the chunks against the view frustum, queues reads of visible chunks
+// that are not resident on the load pool, and draws the ones that are. The
+// frame never waits for the disk; missing chunks pop in when they arrive.
+// Chunks are evicted least recently drawn first whenever the resident data
+// of all paged meshes together exceeds the budget.
+class ChunkedMesh {
+
+    private:
+
+        enum {
+            CHUNK_EVICTED,
+            CHUNK_LOADING,
+            CHUNK_RESIDENT,
+            CHUNK_FAILED
+        };
+
+        struct Chunk {
+            ChunkRecord rec;
+            std::atomic<int> state{CHUNK_EVICTED};
+            // Filled by the reading job, only touched by the GLUT thread
+            // once the state is resident
+            std::vector<char> data;
+            unsigned lastUsed = 0;
+        };
+
+        // Shared with the reading jobs, which may finish after the mesh is
+        // gone
+        struct Store {
+            int fd = -1;
+            std::vector<Chunk> chunks;
+
+            Store(size_t n) : chunks(n) {}
+
+            ~Store() {
+                for(Chunk &c : chunks) {
+                    if(c.state == CHUNK_RESIDENT) {
+                        residentBytes() -= c.rec.bytes();
+                    }
+                }
+                if(fd >= 0) close(fd);
+            }
+        };
+
+        ChunkFileHeader header;
+        std::shared_ptr<Store> store;
+        bool registered = false;
+
+        // Bookkeeping across all paged meshes
+        static std::atomic<size_t> &residentBytes() {
+            static std::atomic<size_t> n{0};
+            return n;
+        }
+
+        static std::atomic<size_t> &queuedBytes() {
+            static std::atomic<size_t> n{0};
+            return n;
+        }
+
+        static size_t &budget() {
+            static size_t bytes = (size_t)CHUNK_BUDGET_MB << 20;
+            return bytes;
+        }
+
+        static unsigned &frame() {
+            static unsigned n = 1;
+            return n;
+        }
+
+        static std::mutex &registryLock() {
+            static std::mutex m;
+            return m;
+        }
+
+        static std::set<ChunkedMesh*> &registry() {
+            static std::set<ChunkedMesh*> meshes;
+            return meshes;
+        }
+
+        ChunkedMesh() {}
+
+        // Frees the least recently drawn resident chunk of any paged mesh
+        // that was not drawn this frame. False if there is none.
+        static bool evictOne() {
+            std::lock_guard<std::mutex> l(registryLock());
+            Chunk *oldest = NULL;
+            for(ChunkedMesh *m : registry()) {
+                for(Chunk &c : m->store->chunks) {
+                    if(c.state == CHUNK_RESIDENT && c.lastUsed < frame() &&
+                       (oldest == NULL || c.lastUsed < oldest->lastUsed)) {
+                        oldest = &c;
+                    }
+                }
+            }
+            if(oldest == NULL) {
+                return false;
+            }
+            oldest->data = std::vector<char>();
+            oldest->state = CHUNK_EVICTED;
+            residentBytes() -= oldest->rec.bytes();
+            return true;
+        }
+
+        // Queues a read of chunk i, false if the budget has no room for it
+        bool request(size_t i) {
+            Chunk &c = store->chunks[i];
+            size_t bytes = c.rec.bytes();
+            while(residentBytes() + queuedBytes() + bytes > budget()) {
+                if(!evictOne()) return false;
+            }
+            c.state = CHUNK_LOADING;
+            queuedBytes() += bytes;
+            std::shared_ptr<Store> s = store;
+            LoadPool::instance().submit([s, i, bytes] {
+                Chunk &c = s->chunks[i];
+                c.data.resize(bytes);
+                size_t done = 0;
+                while(done < bytes) {
+                    ssize_t n = pread(s->fd, c.data.data() + done, bytes - done, c.rec.offset + done);
+                    if(n <= 0) break;
+                    done += n;
+                }
+                // Indices are checked once here instead of on every draw
+                const uint32_t *ids = (const uint32_t *)(c.data.data() + (size_t)c.rec.nverts * 6 * sizeof(float));
+                for(size_t k = 0; done == bytes && k < 3 * (size_t)c.rec.nfaces; ++k) {
+                    if(ids[k] >= c.rec.nverts) done = 0;
+                }
+                if(done == bytes) {
+                    residentBytes() += bytes;
+                    queuedBytes()   -= bytes;
+                    c.state = CHUNK_RESIDENT;
+                } else {
+                    c.data = std::vector<char>();
+                    queuedBytes() -= bytes;
+                    c.state = CHUNK_FAILED;
+                }
+            });
+            return true;
+        }
+
+        // Frustum planes of the current modelview and projection matrices,
+        // in object space, as a * x + b * y + c * z + d >= 0 for inside
+        static void frustum(float planes[6][4]) {
+            float mv[16], p[16], m[16];
+            glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+            glGetFloatv(GL_PROJECTION_MATRIX, p);
+            for(int c = 0; c < 4; ++c) {
+                for(int r = 0; r < 4; ++r) {
+                    m[c * 4 + r] = p[r] * mv[c * 4] + p[4 + r] * mv[c * 4 + 1] +
+                                   p[8 + r] * mv[c * 4 + 2] + p[12 + r] * mv[c * 4 + 3];
+                }
+            }
+            for(int k = 0; k < 3; ++k) {
+                for(int j = 0; j < 4; ++j) {
+                    planes[2 * k][j]     = m[j * 4 + 3] + m[j * 4 + k];
+                    planes[2 * k + 1][j] = m[j * 4 + 3] - m[j * 4 + k];
+                }
+            }
+        }
+
+        static bool visible(const float planes[6][4], const float *b) {
+            for(int i = 0; i < 6; ++i) {
+                const float *pl = planes[i];
+                // The box corner furthest along the plane normal
+                float x = pl[0] >= 0 ? b[3] : b[0];
+                float y = pl[1] >= 0 ? b[4] : b[1];
+                float z = pl[2] >= 0 ? b[5] : b[2];
+                if(pl[0] * x + pl[1] * y + pl[2] * z + pl[3] < 0) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Distance of a box center along the view direction, for reading
+        // the nearest chunks first
+        static float depth(const float *mv, const float *b) {
+            float x = (b[0] + b[3]) / 2, y = (b[1] + b[4]) / 2, z = (b[2] + b[5]) / 2;
+            return -(mv[2] * x + mv[6] * y + mv[10] * z + mv[14]);
+        }
+
+        void drawChunk(const Chunk &c, int mode) const {
+            const float *pos = (const float *)c.data.data();
+            const float *nrm = pos + 3 * (size_t)c.rec.nverts;
+            const uint32_t *ids = (const uint32_t *)(nrm + 3 * (size_t)c.rec.nverts);
+            glVertexPointer(3, GL_FLOAT, 0, pos);
+            glNormalPointer(GL_FLOAT, 0, nrm);
+            if(mode == MODE_POINT) {
+                glDrawArrays(GL_POINTS, 0, c.rec.nverts);
+            } else {
+                glDrawElements(GL_TRIANGLES, 3 * c.rec.nfaces, GL_UNSIGNED_INT, ids);
+            }
+        }
+
+    public:
+
+        ~ChunkedMesh() {
+            std::lock_guard<std::mutex> l(registryLock());
+            registry().erase(this);
+        }
+
+        static bool isChunked(const std::string &filename) {
+            size_t n = strlen(CHUNK_EXT);
+            return filename.size() >= n && strcasecmp(filename.c_str() + filename.size() - n, CHUNK_EXT) == 0;
+        }
+
+        // Reads the chunk table, none of the chunk data. Null if the file
+        // is missing or damaged.
+        static std::shared_ptr<ChunkedMesh> open(const std::string &filename) {
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if(fd < 0) {
+                return NULL;
+            }
+            std::shared_ptr<ChunkedMesh> m(new ChunkedMesh());
+            struct stat st;
+            ChunkFileHeader &h = m->header;
+            if(fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+               memcmp(h.magic, "TMK", 4) != 0 || h.version != CHUNK_VERSION ||
+               sizeof(h) + (uint64_t)h.nchunks * sizeof(ChunkRecord) > (uint64_t)st.st_size) {
+                ::close(fd);
+                return NULL;
+            }
+            std::vector<ChunkRecord> recs(h.nchunks);
+            size_t tableBytes = recs.size() * sizeof(ChunkRecord);
+            if(pread(fd, recs.data(), tableBytes, sizeof(h)) != (ssize_t)tableBytes) {
+                ::close(fd);
+                return NULL;
+            }
+            m->store = std::make_shared<Store>(h.nchunks);
+            m->store->fd = fd;
+            for(size_t i = 0; i < recs.size(); ++i) {
+                if(recs[i].offset + recs[i].bytes() > (uint64_t)st.st_size) {
+                    return NULL;
+                }
+                m->store->chunks[i].rec = recs[i];
+            }
+            return m;
+        }
+
+        // Shared by all paged meshes
+        static void setBudget(size_t bytes) { budget() = bytes; }
+
+        static size_t getBudget() { return budget(); }
+
+        static size_t getResidentBytes() { return residentBytes(); }
+
+        // Call once per frame before drawing, chunks drawn in earlier
+        // frames become candidates for eviction
+        static void beginFrame() { frame()++; }
+
+        size_t numVerts() const { return header.nverts; }
+
+        size_t numFaces() const { return header.nfaces; }
+
+        size_t numChunks() const { return store->chunks.size(); }
+
+        size_t numResident() const {
+            size_t n = 0;
+            for(const Chunk &c : store->chunks) n += c.state == CHUNK_RESIDENT;
+            return n;
+        }
+
+        void draw(int mode) {
+            if(!registered) {
+                std::lock_guard<std::mutex> l(registryLock());
+                registry().insert(this);
+                registered = true;
+            }
+
+            float planes[6][4], mv[16];
+            frustum(planes);
+            glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+
+            // Visible chunks, stamped so they are not evicted this frame
+            std::vector<std::pair<float, size_t> > wanted;
+            std::vector<size_t> drawn;
+            int inflight = 0;
+            for(size_t i = 0; i < store->chunks.size(); ++i) {
+                Chunk &c = store->chunks[i];
+                int state = c.state;
+                inflight += state == CHUNK_LOADING;
+                if(!visible(planes, c.rec.bounds)) continue;
+                c.lastUsed = frame();
+                if(state == CHUNK_RESIDENT) drawn.push_back(i);
+                else if(state == CHUNK_EVICTED) wanted.push_back(std::make_pair(depth(mv, c.rec.bounds), i));
+            }
+            std::sort(wanted.begin(), wanted.end());
+            for(size_t k = 0; k < wanted.size() && inflight < CHUNK_MAX_INFLIGHT; ++k, ++inflight) {
+                if(!request(wanted[k].second)) break;
+            }
+            // The budget may have been lowered
+            while(residentBytes() > budget() && evictOne());
+
+            glMatrixMode(GL_MODELVIEW);
+            glEnableClientState(GL_VERTEX_ARRAY);
+            glEnableClientState(GL_NORMAL_ARRAY);
+            switch(mode) {
+                case MODE_POINT:
+                    glColor3f(1.0f, 0.0f, 0.0f);
+                    glPointSize(3.0);
+                    break;
+                // Chunks keep no edge lists, so both outline every face
+                case MODE_WIRE:
+                case MODE_FEATURE:
+                    glColor3f(0.0f, 1.0f, 0.0f);
+                    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+                    break;
+                case MODE_SOLID:
+                    glColor3f(0.6f, 0.6f, 0.6f);
+                    glPolygonMode(GL_FRONT, GL_FILL);
+                    break;
+                case MODE_LIT:
+                    glColor3f(0.6f, 0.6f, 0.6f);
+                    glPolygonMode(GL_FRONT, GL_FILL);
+                    glEnable(GL_LIGHTING);
+                    glEnable(GL_LIGHT0);
+                    glEnable(GL_COLOR_MATERIAL);
+                    glEnable(GL_NORMALIZE);
+                    break;
+            }
+            for(size_t i : drawn) {
+                const Chunk &c = store->chunks[i];
+                if(c.state == CHUNK_RESIDENT) drawChunk(c, mode);
+            }
+            glDisable(GL_LIGHTING);
+            glDisableClientState(GL_VERTEX_ARRAY);
+            glDisableClientState(GL_NORMAL_ARRAY);
+        }
+};
+
+#endif
@@ -0,0 +1,632 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __EXPORTER_H__
+#define __EXPORTER_H__
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <charconv>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "geom.h"
+#include "chunkedmesh.h"
+#include "pmesh.h"
+
+// Output buffer size, flushed to the file in one write each time it fills
+#define EXPORT_BUFFER (4 << 20)
+
+// One mesh of an export and where it goes. A null matrix is the identity,
+// otherwise positions are multiplied by it (column major, like OpenGL).
+struct ExportItem {
+    std::string name;
+    const Trimesh *mesh;
+    const float *matrix;
+};
+
+// Writes meshes as OBJ text or binary PLY. Several meshes can go into one
+// file with their transforms baked into the vertices, which is how scenes
+// are exported. Numbers are formatted with std::to_chars straight into a
+// large buffer that is written out in big sequential blocks; floats use the
+// shortest form that reads back to the same value, so exports round trip
+// exactly. Files are written under a temporary name and renamed when done.
+class MeshExporter {
+
+    private:
+
+        int fd = -1;
+        bool ok = true;
+        std::vector<char> buf;
+        size_t used = 0;
+        size_t written = 0;
+
+        void flush() {
+            for(size_t at = 0; ok && at < used; ) {
+                ssize_t n = ::write(fd, buf.data() + at, used - at);
+                if(n <= 0) ok = false;
+                else at += n;
+            }
+            written += used;
+            used = 0;
+        }
+
+        // Room for n more bytes at the end of the buffer
+        char *room(size_t n) {
+            if(used + n > buf.size()) flush();
+            return buf.data() + used;
+        }
+
+        void put(const void *data, size_t n) {
+            if(n > buf.size()) {
+                flush();
+                for(size_t at = 0; ok && at < n; ) {
+                    ssize_t w = ::write(fd, (const char *)data + at, n - at);
+                    if(w <= 0) ok = false;
+                    else at += w;
+                }
+                written += n;
+                return;
+            }
+            memcpy(room(n), data, n);
+            used += n;
+        }
+
+        void put(const char *s) { put(s, strlen(s)); }
+
+        void put(const std::string &s) { put(s.data(), s.size()); }
+
+        // Shortest round trip forms are at most 15 characters for a float
+        void putFloat(float f) {
+            char *p = room(16);
+            *p = ' ';
+            used = std::to_chars(p + 1, p + 16, f).ptr - buf.data();
+        }
+
+        void putInt(uint64_t i) {
+            char *p = room(21);
+            *p = ' ';
+            used = std::to_chars(p + 1, p + 21, i).ptr - buf.data();
+        }
+
+        void putIndex(uint64_t i) {
+            char *p = room(20);
+            used = std::to_chars(p, p + 20, i).ptr - buf.data();
+        }
+
+        void newline() {
+            *room(1) = '\n';
+            used++;
+        }
+
+        bool open(const std::string &path) {
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            ok = fd >= 0;
+            buf.resize(EXPORT_BUFFER);
+            used = written = 0;
+            return ok;
+        }
+
+        bool close() {
+            flush();
+            ok = ::close(fd) == 0 && ok;
+            fd = -1;
+            return ok;
+        }
+
+        static bool hasExtension(const std::string &filename, const char *ext) {
+            size_t n = strlen(ext);
+            return filename.size() >= n && strcasecmp(filename.c_str() + filename.size() - n, ext) == 0;
+        }
+
+        static void transform(const float *m, const float *p, float *out) {
+            if(m == NULL) {
+                out[0] = p[0]; out[1] = p[1]; out[2] = p[2];
+                return;
+            }
+            out[0] = m[0] * p[0] + m[4] * p[1] + m[8]  * p[2] + m[12];
+            out[1] = m[1] * p[0] + m[5] * p[1] + m[9]  * p[2] + m[13];
+            out[2] = m[2] * p[0] + m[6] * p[1] + m[10] * p[2] + m[14];
+        }
+
+        // Normals go through the cofactor matrix of the upper 3x3, which is
+        // the inverse transpose up to scale. Returns the determinant, which
+        // is negative for mirroring transforms.
+        static float normalMatrix(const float *m, float *nm) {
+            nm[0] = m[5]*m[10] - m[6]*m[9]; nm[1] = m[6]*m[8] - m[4]*m[10]; nm[2] = m[4]*m[9] - m[5]*m[8];
+            nm[3] = m[2]*m[9] - m[1]*m[10]; nm[4] = m[0]*m[10] - m[2]*m[8]; nm[5] = m[1]*m[8] - m[0]*m[9];
+            nm[6] = m[1]*m[6] - m[2]*m[5];  nm[7] = m[2]*m[4] - m[0]*m[6];  nm[8] = m[0]*m[5] - m[1]*m[4];
+            return m[0]*nm[0] + m[4]*nm[3] + m[8]*nm[6];
+        }
+
+        static void transformNormal(const float *nm, const float *n, float *out) {
+            if(nm == NULL) {
+                out[0] = n[0]; out[1] = n[1]; out[2] = n[2];
+                return;
+            }
+            out[0] = nm[0] * n[0] + nm[3] * n[1] + nm[6] * n[2];
+            out[1] = nm[1] * n[0] + nm[4] * n[1] + nm[7] * n[2];
+            out[2] = nm[2] * n[0] + nm[5] * n[1] + nm[8] * n[2];
+            float len = sqrt(out[0] * out[0] + out[1] * out[1] + out[2] * out[2]);
+            if(len > 0.0f) {
+                out[0] /= len; out[1] /= len; out[2] /= len;
+            }
+        }
+
+        // Corner order of a face, reversed when the transform mirrors
+        static void corners(const uint32_t *f, bool flip, uint32_t *ids) {
+            ids[0] = f[0];
+            ids[1] = flip ? f[2] : f[1];
+            ids[2] = flip ? f[1] : f[2];
+        }
+
+        static void writeMaterial(FILE *f, const std::string &name, const Material &m) {
+            fprintf(f, "newmtl %s\n", name.c_str());
+            fprintf(f, "Ka %g %g %g\n", m.ambient[0], m.ambient[1], m.ambient[2]);
+            fprintf(f, "Kd %g %g %g\n", m.diffuse[0], m.diffuse[1], m.diffuse[2]);
+            fprintf(f, "Ks %g %g %g\n", m.specular[0], m.specular[1], m.specular[2]);
+            fprintf(f, "Ns %g\n", m.shininess);
+            fprintf(f, "d %g\n\n", m.diffuse[3]);
+        }
+
+        // Writes the materials of all items to an .mtl library and returns
+        // the name each (item, material) pair got in it. Names that clash
+        // between items get the item number appended.
+        static bool writeLibrary(const std::string &path, const std::vector<ExportItem> &items,
+                                 std::vector<std::vector<std::string> > &names) {
+            std::map<std::string, bool> used;
+            FILE *f = NULL;
+            names.resize(items.size());
+            for(size_t i = 0; i < items.size(); ++i) {
+                const std::vector<Material> &mats = items[i].mesh->materials;
+                for(size_t k = 0; k < mats.size(); ++k) {
+                    std::string name = mats[k].name.empty() ? "material" : mats[k].name;
+                    if(used.count(name)) {
+                        name += "_" + std::to_string(i);
+                    }
+                    used[name] = true;
+                    names[i].push_back(name);
+                    if(f == NULL && (f = fopen(path.c_str(), "w")) == NULL) {
+                        return false;
+                    }
+                    writeMaterial(f, name, mats[k]);
+                }
+            }
+            return f == NULL || fclose(f) == 0;
+        }
+
+        bool writeOBJ(const std::string &path, const std::vector<ExportItem> &items) {
+            std::vector<std::vector<std::string> > mtlNames;
+            std::string lib = (hasExtension(path, ".obj") ? path.substr(0, path.size() - 4) : path) + ".mtl";
+            if(!writeLibrary(lib, items, mtlNames)) {
+                return false;
+            }
+
+            put("# exported by ctd487 scene graph\n");
+            bool anyMaterials = false;
+            for(const std::vector<std::string> &n : mtlNames) anyMaterials = anyMaterials || !n.empty();
+            if(anyMaterials) {
+                put("mtllib ");
+                put(lib.substr(lib.find_last_of('/') + 1));
+                newline();
+            }
+
+            // OBJ indices count across the whole file
+            size_t base1 = 1;
+            for(size_t i = 0; i < items.size() && ok; ++i) {
+                const ExportItem &it = items[i];
+                const Trimesh *mesh = it.mesh;
+                float nm[9] = { 1,0,0, 0,1,0, 0,0,1 };
+                bool flip = it.matrix != NULL && normalMatrix(it.matrix, nm) < 0;
+                bool normals = mesh->hasFileNormals();
+                bool uvs = mesh->texcoords.size() == 2 * mesh->nverts && mesh->nverts > 0;
+
+                if(items.size() > 1 || !it.name.empty()) {
+                    put("o ");
+                    put(it.name.empty() ? "object" + std::to_string(i) : it.name);
+                    newline();
+                }
+                for(size_t k = 0; k < mesh->nverts; ++k) {
+                    float v[3];
+                    transform(it.matrix, &mesh->positions[3 * k], v);
+                    put("v", 1);
+                    putFloat(v[0]); putFloat(v[1]); putFloat(v[2]);
+                    newline();
+                }
+                for(size_t v = 0; uvs && v < mesh->nverts; ++v) {
+                    put("vt", 2);
+                    putFloat(mesh->texcoords[2 * v]); putFloat(mesh->texcoords[2 * v + 1]);
+                    newline();
+                }
+                const float *nrm = normals ? mesh->getNormals() : NULL;
+                for(size_t v = 0; normals && v < mesh->nverts; ++v) {
+                    float n[3];
+                    transformNormal(it.matrix != NULL ? nm : NULL, &nrm[3 * v], n);
+                    put("vn", 2);
+                    putFloat(n[0]); putFloat(n[1]); putFloat(n[2]);
+                    newline();
+                }
+
+                // Faces by submesh so groups and materials survive; meshes
+                // without submeshes are one run
+                std::vector<Submesh> runs = mesh->submeshes;
+                if(runs.empty()) {
+                    Submesh all = { "", -1, 0, (int)mesh->nfaces };
+                    runs.push_back(all);
+                }
+                std::string group;
+                for(const Submesh &sm : runs) {
+                    if(!sm.name.empty() && sm.name != group) {
+                        put("g ");
+                        put(sm.name);
+                        newline();
+                        group = sm.name;
+                    }
+                    if(anyMaterials) {
+                        put("usemtl ");
+                        put(sm.material >= 0 ? mtlNames[i][sm.material] : "default");
+                        newline();
+                    }
+                    for(int k = sm.first; k < sm.first + sm.count; ++k) {
+                        uint32_t ids[3];
+                        corners(&mesh->indices[3 * (size_t)k], flip, ids);
+                        put("f", 1);
+                        for(int c = 0; c < 3; ++c) {
+                            uint64_t id = base1 + ids[c];
+                            *room(1) = ' ';
+                            used++;
+                            putIndex(id);
+                            if(uvs || normals) {
+                                *room(1) = '/';
+                                used++;
+                                if(uvs) putIndex(id);
+                                if(normals) {
+                                    *room(1) = '/';
+                                    used++;
+                                    putIndex(id);
+                                }
+                            }
+                        }
+                        newline();
+                    }
+                }
+                base1 += mesh->nverts;
+            }
+            return ok;
+        }
+
+        bool writePLY(const std::vector<ExportItem> &items) {
+            // Properties present in every item are written, others dropped
+            size_t nverts = 0, nfaces = 0;
+            bool normals = true, uvs = true;
+            for(const ExportItem &it : items) {
+                nverts += it.mesh->nverts;
+                nfaces += it.mesh->nfaces;
+                normals = normals && it.mesh->hasFileNormals();
+                uvs = uvs && it.mesh->texcoords.size() == 2 * it.mesh->nverts;
+            }
+            if(nverts == 0) normals = uvs = false;
+
+            put("ply\nformat ");
+            put(__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? "binary_big_endian" : "binary_little_endian");
+            put(" 1.0\ncomment exported by ctd487 scene graph\nelement vertex");
+            putInt(nverts);
+            put("\nproperty float x\nproperty float y\nproperty float z\n");
+            if(normals) put("property float nx\nproperty float ny\nproperty float nz\n");
+            if(uvs) put("property float u\nproperty float v\n");
+            put("element face");
+            putInt(nfaces);
+            put("\nproperty list uchar int vertex_indices\nend_header\n");
+
+            // Fixed size records written in the host's byte order
+            int32_t base = 0;
+            for(const ExportItem &it : items) {
+                const Trimesh *mesh = it.mesh;
+                float nm[9] = { 1,0,0, 0,1,0, 0,0,1 };
+                if(it.matrix != NULL) normalMatrix(it.matrix, nm);
+                const size_t stride = (3 + 3 * normals + 2 * uvs) * sizeof(float);
+                const float *nrm = normals ? mesh->getNormals() : NULL;
+                for(size_t v = 0; v < mesh->nverts; ++v) {
+                    float rec[8];
+                    transform(it.matrix, &mesh->positions[3 * v], rec);
+                    float *r = rec + 3;
+                    if(normals) {
+                        transformNormal(it.matrix != NULL ? nm : NULL, &nrm[3 * v], r);
+                        r += 3;
+                    }
+                    if(uvs) {
+                        r[0] = mesh->texcoords[2 * v];
+                        r[1] = mesh->texcoords[2 * v + 1];
+                    }
+                    memcpy(room(stride), rec, stride);
+                    used += stride;
+                }
+                if(mesh->nverts > (size_t)INT32_MAX - base) {
+                    return false;
+                }
+                base += mesh->nverts;
+            }
+            base = 0;
+            for(const ExportItem &it : items) {
+                const Trimesh *mesh = it.mesh;
+                float nm[9] = { 1,0,0, 0,1,0, 0,0,1 };
+                bool flip = it.matrix != NULL && normalMatrix(it.matrix, nm) < 0;
+                for(size_t k = 0; k < mesh->nfaces; ++k) {
+                    uint32_t ids[3];
+                    corners(&mesh->indices[3 * k], flip, ids);
+                    char *p = room(13);
+                    int32_t rec[3] = { base + (int32_t)ids[0], base + (int32_t)ids[1], base + (int32_t)ids[2] };
+                    p[0] = 3;
+                    memcpy(p + 1, rec, 12);
+                    used += 13;
+                }
+                base += mesh->nverts;
+            }
+            return ok;
+        }
+
+        // Zero bytes up to the next multiple of CHUNK_ALIGN in the file
+        void align() {
+            static const char zeros[CHUNK_ALIGN] = { 0 };
+            size_t at = (written + used) % CHUNK_ALIGN;
+            if(at != 0) put(zeros, CHUNK_ALIGN - at);
+        }
+
+        // Splits the faces into chunks by the centroids, always halving the
+        // longest side of the range's centroid bounds, until each chunk has
+        // at most CHUNK_FACES faces. Returns the end of each chunk in order.
+        static std::vector<size_t> partition(const std::vector<float> &pos, const std::vector<uint32_t> &tris,
+                                             std::vector<uint32_t> &order) {
+            size_t nfaces = tris.size() / 3;
+            std::vector<float> centroids(3 * nfaces);
+            for(size_t f = 0; f < nfaces; ++f) {
+                for(int k = 0; k < 3; ++k) {
+                    centroids[3 * f + k] = (pos[3 * tris[3 * f] + k] + pos[3 * tris[3 * f + 1] + k] +
+                                            pos[3 * tris[3 * f + 2] + k]) / 3.0f;
+                }
+            }
+            order.resize(nfaces);
+            for(size_t f = 0; f < nfaces; ++f) order[f] = f;
+
+            std::vector<size_t> ends;
+            std::vector<std::pair<size_t, size_t> > todo(1, std::make_pair((size_t)0, nfaces));
+            while(!todo.empty()) {
+                size_t b = todo.back().first, e = todo.back().second;
+                todo.pop_back();
+                if(e - b <= CHUNK_FACES) {
+                    if(e > b) ends.push_back(e);
+                    continue;
+                }
+                float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+                for(size_t i = b; i < e; ++i) {
+                    for(int k = 0; k < 3; ++k) {
+                        lo[k] = std::min(lo[k], centroids[3 * order[i] + k]);
+                        hi[k] = std::max(hi[k], centroids[3 * order[i] + k]);
+                    }
+                }
+                int axis = 0;
+                for(int k = 1; k < 3; ++k) {
+                    if(hi[k] - lo[k] > hi[axis] - lo[axis]) axis = k;
+                }
+                size_t mid = b + (e - b) / 2;
+                std::nth_element(order.begin() + b, order.begin() + mid, order.begin() + e,
+                                 [&](uint32_t x, uint32_t y) {
+                                     return centroids[3 * x + axis] < centroids[3 * y + axis];
+                                 });
+                // Second half first so chunks come out in order
+                todo.push_back(std::make_pair(mid, e));
+                todo.push_back(std::make_pair(b, mid));
+            }
+            return ends;
+        }
+
+        bool writeChunked(const std::vector<ExportItem> &items) {
+            // All items in one index space, transformed
+            std::vector<float> pos, nrm;
+            std::vector<uint32_t> tris;
+            for(const ExportItem &it : items) {
+                const Trimesh *mesh = it.mesh;
+                float nm[9] = { 1,0,0, 0,1,0, 0,0,1 };
+                bool flip = it.matrix != NULL && normalMatrix(it.matrix, nm) < 0;
+                uint32_t base = pos.size() / 3;
+                if(pos.size() / 3 + mesh->nverts > UINT32_MAX) {
+                    return false;
+                }
+                pos.resize(pos.size() + 3 * mesh->nverts);
+                nrm.resize(pos.size());
+                const float *vn = mesh->getNormals();
+                for(size_t v = 0; v < mesh->nverts; ++v) {
+                    transform(it.matrix, &mesh->positions[3 * v], &pos[3 * (base + v)]);
+                    transformNormal(it.matrix != NULL ? nm : NULL, &vn[3 * v], &nrm[3 * (base + v)]);
+                }
+                for(size_t k = 0; k < mesh->nfaces; ++k) {
+                    uint32_t ids[3];
+                    corners(&mesh->indices[3 * k], flip, ids);
+                    tris.insert(tris.end(), { base + ids[0], base + ids[1], base + ids[2] });
+                }
+            }
+
+            std::vector<uint32_t> order;
+            std::vector<size_t> ends = partition(pos, tris, order);
+
+            // Local vertex numbering of each chunk, first in order of use
+            std::vector<uint32_t> local(pos.size() / 3, UINT32_MAX);
+            std::vector<uint32_t> used;
+            std::vector<ChunkRecord> recs(ends.size());
+            ChunkFileHeader h;
+            memset(&h, 0, sizeof(h));
+            memcpy(h.magic, "TMK", 4);
+            h.version = CHUNK_VERSION;
+            h.nchunks = ends.size();
+            h.nverts  = pos.size() / 3;
+            h.nfaces  = tris.size() / 3;
+            for(int k = 0; k < 3; ++k) {
+                h.bounds[k] = FLT_MAX;
+                h.bounds[3 + k] = -FLT_MAX;
+            }
+            uint64_t offset = sizeof(h) + recs.size() * sizeof(ChunkRecord);
+            for(size_t c = 0, b = 0; c < ends.size(); b = ends[c++]) {
+                ChunkRecord &r = recs[c];
+                memset(&r, 0, sizeof(r));
+                for(int k = 0; k < 3; ++k) {
+                    r.bounds[k] = FLT_MAX;
+                    r.bounds[3 + k] = -FLT_MAX;
+                }
+                for(size_t i = b; i < ends[c]; ++i) {
+                    for(int j = 0; j < 3; ++j) {
+                        uint32_t v = tris[3 * order[i] + j];
+                        if(local[v] != UINT32_MAX) continue;
+                        local[v] = r.nverts++;
+                        used.push_back(v);
+                        for(int k = 0; k < 3; ++k) {
+                            r.bounds[k]     = std::min(r.bounds[k], pos[3 * v + k]);
+                            r.bounds[3 + k] = std::max(r.bounds[3 + k], pos[3 * v + k]);
+                        }
+                    }
+                }
+                for(int k = 0; k < 3; ++k) {
+                    h.bounds[k]     = std::min(h.bounds[k], r.bounds[k]);
+                    h.bounds[3 + k] = std::max(h.bounds[3 + k], r.bounds[3 + k]);
+                }
+                r.nfaces = ends[c] - b;
+                offset = (offset + CHUNK_ALIGN - 1) / CHUNK_ALIGN * CHUNK_ALIGN;
+                r.offset = offset;
+                offset += r.bytes();
+                for(uint32_t v : used) local[v] = UINT32_MAX;
+                used.clear();
+            }
+
+            put(&h, sizeof(h));
+            put(recs.data(), recs.size() * sizeof(ChunkRecord));
+            std::vector<float> cpos, cnrm;
+            std::vector<uint32_t> cids;
+            for(size_t c = 0, b = 0; c < ends.size() && ok; b = ends[c++]) {
+                cpos.clear();
+                cnrm.clear();
+                cids.clear();
+                for(size_t i = b; i < ends[c]; ++i) {
+                    for(int j = 0; j < 3; ++j) {
+                        uint32_t v = tris[3 * order[i] + j];
+                        if(local[v] == UINT32_MAX) {
+                            local[v] = cpos.size() / 3;
+                            used.push_back(v);
+                            cpos.insert(cpos.end(), &pos[3 * v], &pos[3 * v] + 3);
+                            cnrm.insert(cnrm.end(), &nrm[3 * v], &nrm[3 * v] + 3);
+                        }
+                        cids.push_back(local[v]);
+                    }
+                }
+                for(uint32_t v : used) local[v] = UINT32_MAX;
+                used.clear();
+                align();
+                put(cpos.data(), cpos.size() * sizeof(float));
+                put(cnrm.data(), cnrm.size() * sizeof(float));
+                put(cids.data(), cids.size() * sizeof(uint32_t));
+            }
+            return ok;
+        }
+
+        void writeProgressive(const ProgressiveMesh *pm) {
+            const ProgressiveMesh::Store &s = *pm->store;
+            const ProgressiveFileHeader &h = s.header;
+            put(&h, sizeof(h));
+            put(s.positions.data(), 3 * (size_t)h.baseVerts * sizeof(float));
+            put(s.normals.data(), 3 * (size_t)h.baseVerts * sizeof(float));
+            put(s.born.data(), 3 * (size_t)h.baseFaces * sizeof(uint32_t));
+            for(size_t i = 0; i < h.nsplits && ok; ++i) {
+                size_t v = h.baseVerts + i, first = pm->faceStart(i), corner = pm->cornerStart(i);
+                SplitRecord r;
+                memcpy(r.position, &s.positions[3 * v], sizeof(r.position));
+                memcpy(r.normal, &s.normals[3 * v], sizeof(r.normal));
+                r.parent   = s.parents[i];
+                r.nfaces   = s.faceEnds[i] - first;
+                r.ncorners = s.cornerEnds[i] - corner;
+                r.error    = s.errors[i];
+                put(&r, sizeof(r));
+                put(&s.born[3 * first], 3 * (size_t)r.nfaces * sizeof(uint32_t));
+                put(&s.corners[corner], r.ncorners * sizeof(uint32_t));
+            }
+        }
+
+        bool writeProgressive(const std::vector<ExportItem> &items) {
+            // All items in one mesh, transformed
+            Trimesh merged;
+            size_t nverts = 0, nfaces = 0;
+            for(const ExportItem &it : items) {
+                nverts += it.mesh->nverts;
+                nfaces += it.mesh->nfaces;
+            }
+            merged.reserve(nverts, nfaces);
+            for(const ExportItem &it : items) {
+                const Trimesh *mesh = it.mesh;
+                float nm[9];
+                bool flip = it.matrix != NULL && normalMatrix(it.matrix, nm) < 0;
+                int base = merged.numVerts();
+                if((size_t)base + mesh->nverts > INT32_MAX) {
+                    return false;
+                }
+                for(size_t v = 0; v < mesh->nverts; ++v) {
+                    float p[3];
+                    transform(it.matrix, &mesh->positions[3 * v], p);
+                    merged.addVertex(p);
+                }
+                for(size_t k = 0; k < mesh->nfaces; ++k) {
+                    uint32_t ids[3];
+                    corners(&mesh->indices[3 * k], flip, ids);
+                    int f[3] = { base + (int)ids[0], base + (int)ids[1], base + (int)ids[2] };
+                    merged.addFaces(f, 1);
+                }
+            }
+            std::unique_ptr<ProgressiveMesh> pm(ProgressiveMesh::build(&merged));
+            if(pm == NULL) {
+                return false;
+            }
+            writeProgressive(pm.get());
+            return ok;
+        }
+
+    public:
+
+        // Saves several meshes into one file, as OBJ unless the name ends
+        // in .ply, in .tmk for a chunked file that can be paged (see
+        // ChunkedMesh), or in .tpm for a progressive mesh (see
+        // ProgressiveMesh). An OBJ file with materials gets a .mtl library next
+        // to it.
+        bool save(const std::string &path, const std::vector<ExportItem> &items) {
+            std::string tmp = path + ".tmp";
+            if(!open(tmp)) {
+                return false;
+            }
+            bool wrote = hasExtension(path, ".ply")    ? writePLY(items) :
+                         hasExtension(path, CHUNK_EXT) ? writeChunked(items) :
+                         hasExtension(path, PM_EXT)    ? writeProgressive(items) : writeOBJ(path, items);
+            bool closed = close();
+            buf = std::vector<char>();
+            if(!wrote || !closed || rename(tmp.c_str(), path.c_str()) != 0) {
+                remove(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        bool save(const std::string &path, const Trimesh *mesh) {
+            std::vector<ExportItem> items(1);
+            items[0].mesh = mesh;
+            items[0].matrix = NULL;
+            return save(path, items);
+        }
+
+        // Size of the last file saved
+        size_t bytesWritten() const { return written; }
+};
+
+#endif
@@ -4,27 +4,37 @@
 #ifndef __GEOM_H__
 #define __GEOM_H__
 
+#include <string>
 #include <vector>
 #include <iostream>
 #include <cfloat>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <memory>
+
+#include "normals.h"
+#include "meshlet.h"
+#include "loadpool.h"
 
 // Rendering modes
 enum {
     MODE_POINT,
     MODE_WIRE,
     MODE_SOLID,
-    MODE_LIT
+    MODE_LIT,
+    MODE_FEATURE
 };
 
-// A point in 3-space, includes a normal if it is a trimesh vertex
+// A point in 3-space
 struct Point {
     float x;
     float y;
     float z;
 
-    Point *normal;
-
     Point(float x = 0.0f, float y = 0.0f, float z = 0.0f) : x(x), y(y), z(z) {}
 
     Point &operator+=(const Point &other) {
@@ -74,143 +84,888 @@ struct Point {
 };
 
 
+// Surface colors of an OBJ material
+struct Material {
+    std::string name;
+    float ambient[3]  = { 0.2f, 0.2f, 0.2f };
+    float diffuse[4]  = { 0.6f, 0.6f, 0.6f, 1.0f };
+    float specular[3] = { 0.0f, 0.0f, 0.0f };
+    float shininess   = 0.0f;
+};
+
+// A contiguous range of faces from one group with one material. Material
+// -1 is the default gray.
+struct Submesh {
+    std::string name;
+    int material;
+    int first;
+    int count;
+};
+
+// Data a Trimesh derives from its arrays on first use. Each is dropped by
+// the edits that change it and computed again when next asked for. The
+// UPLOADED bits mark buffer objects that match the arrays.
+enum {
+    DERIVED_VERT_NORMALS = 1 << 0,
+    DERIVED_FACE_NORMALS = 1 << 1,
+    DERIVED_FACE_CENTERS = 1 << 2,
+    DERIVED_BOUNDS       = 1 << 3,
+    DERIVED_EDGES        = 1 << 4,
+    DERIVED_ADJACENCY    = 1 << 5,
+    DERIVED_FEATURES     = 1 << 6,
+    UPLOADED_VERTS       = 1 << 7,
+    UPLOADED_NORMALS     = 1 << 8,
+    UPLOADED_INDICES     = 1 << 9,
+    UPLOADED_EDGES       = 1 << 10,
+    DERIVED_MESHLETS     = 1 << 11
+};
+
+// Faces around each vertex: the faces of vertex v are
+// faces[offsets[v]] up to faces[offsets[v + 1]]
+struct Adjacency {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> faces;
+};
+
+// Triangle mesh stored as flat arrays in one allocation:
+//
+//     float    positions[3 * capacity]
+//     uint32_t indices[3 * face capacity]
+//
+// That is 12 bytes per vertex and 12 per face as loaded. Vertices used to
+// be Points with a pointer to a separately allocated normal Point, and
+// faces carried their own normal Point: 24 + 24 bytes plus a malloc header
+// per vertex, 40 bytes per face, and two pointer hops per corner when
+// drawing.
+//
+// A mesh can instead adopt both arrays from memory it does not own, such
+// as a mapped sidecar or .glb file, holding on to whatever keeps that
+// memory alive. The first edit copies them into a block of its own.
+//
+// Everything else is derived on first use and cached: vertex normals (12
+// bytes per vertex, only for lit drawing, normal display and export),
+// face normals and face centers (12 bytes per face each, only for the
+// face normal display), bounds, the unique edges and feature edges drawn
+// by the wireframe modes, the faces around each vertex, and the meshlets
+// solid and lit drawing culls against the view. A mesh drawn as points
+// never computes a normal.
+//
+// Vertex normals are unit length. Unless they came with the file they are
+// the normalized sum of the unit normals of the faces around the vertex.
+// Texture coordinates are rare and live in their own array.
+//
+// Derived data is computed under a lock, so a mesh can be read from
+// several threads. Edits must not race with readers.
 class Trimesh {
 
     private:
 
-        struct Face {
-            int ids[3];
-            Point normal;
+        char *block = NULL;
+        std::shared_ptr<const void> adopted;
+        size_t nverts = 0, vertCap = 0;
+        size_t nfaces = 0, faceCap = 0;
+
+        float    *positions = NULL;
+        uint32_t *indices   = NULL;
+
+        // Two per vertex, empty if the mesh has no texture coordinates
+        std::vector<float> texcoords;
+
+        // Set when vertex normals came with the file. They are kept as
+        // read and only scaled to unit length when first used.
+        bool fileNormals = false;
+
+        // Faces are sorted by material, so each material is drawn as one
+        // batch. Empty for meshes without groups or materials.
+        std::vector<Material> materials;
+        std::vector<Submesh>  submeshes;
+
+        // Derived data, valid where the DERIVED bits are set
+        mutable std::mutex derivedLock;
+        mutable unsigned valid = 0, uploaded = 0;
+        mutable std::vector<float> normals;
+        mutable std::vector<float> faceNormals;
+        mutable std::vector<float> faceCenters;
+        mutable float bounds[6];
+        mutable std::vector<uint32_t> edges;
+        mutable std::vector<uint32_t> features;
+        mutable float featureAngle = 0.0f;
+        mutable Adjacency adjacency;
+        mutable std::vector<Meshlet> meshlets;
+
+        // What culling did in the last draw, only touched by the GL thread
+        mutable MeshletStats culled;
+
+        // Buffer objects holding copies of the arrays, made on the first
+        // draw. Normals get their own buffer so unlit drawing never needs
+        // them. The edge buffer holds the edges last drawn, all of them or
+        // the features, see edgeList.
+        mutable GLuint vbo = 0, nbo = 0, ibo = 0, ebo = 0;
+        mutable const std::vector<uint32_t> *edgeList = NULL;
+        mutable std::thread::id glThread;
+
+        friend class MeshSidecar;
+        friend class MeshExporter;
+        friend class MeshWelder;
+
+        // Drops derived data after an edit. Cheap when there is nothing to
+        // drop, as while a loader adds one face at a time.
+        void invalidate(unsigned bits) {
+            if(!((valid | uploaded) & bits)) {
+                return;
+            }
+            valid &= ~bits;
+            uploaded &= ~bits;
+            if((bits & DERIVED_VERT_NORMALS) && !fileNormals) std::vector<float>().swap(normals);
+            if(bits & DERIVED_FACE_NORMALS) std::vector<float>().swap(faceNormals);
+            if(bits & DERIVED_FACE_CENTERS) std::vector<float>().swap(faceCenters);
+            if(bits & DERIVED_EDGES)        std::vector<uint32_t>().swap(edges);
+            if(bits & DERIVED_FEATURES)     std::vector<uint32_t>().swap(features);
+            if(bits & DERIVED_ADJACENCY)    adjacency = Adjacency();
+            if(bits & DERIVED_MESHLETS)     std::vector<Meshlet>().swap(meshlets);
+        }
+
+        // What moving or adding vertices changes
+        static const unsigned VERT_EDIT = DERIVED_VERT_NORMALS | DERIVED_FACE_NORMALS | DERIVED_FACE_CENTERS |
+                                          DERIVED_BOUNDS | DERIVED_FEATURES | DERIVED_MESHLETS | UPLOADED_VERTS |
+                                          UPLOADED_NORMALS | UPLOADED_EDGES;
+
+        // What adding faces changes
+        static const unsigned FACE_EDIT = DERIVED_VERT_NORMALS | DERIVED_FACE_NORMALS | DERIVED_FACE_CENTERS |
+                                          DERIVED_EDGES | DERIVED_ADJACENCY | DERIVED_FEATURES | DERIVED_MESHLETS |
+                                          UPLOADED_NORMALS | UPLOADED_INDICES | UPLOADED_EDGES;
+
+        // Buffers of meshes released on a thread other than the one that
+        // drew them, deleted by the next draw
+        static std::mutex &orphanLock() {
+            static std::mutex lock;
+            return lock;
+        }
+
+        static std::vector<GLuint> &orphans() {
+            static std::vector<GLuint> names;
+            return names;
+        }
 
-            Face(const int *ids, std::vector<Point> &verts) {
-                for(int i = 0; i < 3; ++i) {
-                    this->ids[i] = ids[i];
+        static void deleteOrphans() {
+            std::lock_guard<std::mutex> l(orphanLock());
+            if(!orphans().empty()) {
+                glDeleteBuffers(orphans().size(), orphans().data());
+                orphans().clear();
+            }
+        }
+
+        // Positions and texture coordinates go back to back into one
+        // buffer, normals, indices and edges into their own. Only what
+        // changed since the last upload is sent again. lines is the edge
+        // list to bind in place of the faces, or NULL.
+        void bindBuffers(const float *nrm, const std::vector<uint32_t> *lines) const {
+            if(vbo == 0) {
+                glGenBuffers(1, &vbo);
+                glGenBuffers(1, &nbo);
+                glGenBuffers(1, &ibo);
+                glGenBuffers(1, &ebo);
+                glThread = std::this_thread::get_id();
+            }
+            size_t vbytes = 3 * nverts * sizeof(float);
+            glBindBuffer(GL_ARRAY_BUFFER, vbo);
+            if(!(uploaded & UPLOADED_VERTS)) {
+                size_t tbytes = texcoords.size() * sizeof(float);
+                glBufferData(GL_ARRAY_BUFFER, vbytes + tbytes, NULL, GL_STATIC_DRAW);
+                glBufferSubData(GL_ARRAY_BUFFER, 0, vbytes, positions);
+                if(tbytes > 0) {
+                    glBufferSubData(GL_ARRAY_BUFFER, vbytes, tbytes, texcoords.data());
+                }
+                uploaded |= UPLOADED_VERTS;
+            }
+            glEnableClientState(GL_VERTEX_ARRAY);
+            glVertexPointer(3, GL_FLOAT, 0, (const void *)0);
+            if(!texcoords.empty()) {
+                glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+                glTexCoordPointer(2, GL_FLOAT, 0, (const void *)vbytes);
+            }
+            if(nrm != NULL) {
+                glBindBuffer(GL_ARRAY_BUFFER, nbo);
+                if(!(uploaded & UPLOADED_NORMALS)) {
+                    glBufferData(GL_ARRAY_BUFFER, vbytes, nrm, GL_STATIC_DRAW);
+                    uploaded |= UPLOADED_NORMALS;
+                }
+                glEnableClientState(GL_NORMAL_ARRAY);
+                glNormalPointer(GL_FLOAT, 0, (const void *)0);
+            }
+            if(lines != NULL) {
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+                if(!(uploaded & UPLOADED_EDGES) || edgeList != lines) {
+                    glBufferData(GL_ELEMENT_ARRAY_BUFFER, lines->size() * sizeof(uint32_t), lines->data(),
+                                 GL_STATIC_DRAW);
+                    edgeList = lines;
+                    uploaded |= UPLOADED_EDGES;
                 }
-                computeNormal(verts);    
+                return;
+            }
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+            if(!(uploaded & UPLOADED_INDICES)) {
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER, 3 * nfaces * sizeof(uint32_t), indices, GL_STATIC_DRAW);
+                uploaded |= UPLOADED_INDICES;
             }
+        }
 
-            private:
+        static void unbindBuffers() {
+            glDisableClientState(GL_VERTEX_ARRAY);
+            glDisableClientState(GL_NORMAL_ARRAY);
+            glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        }
 
-                void computeNormal(std::vector<Point> &verts) {
-                    Point a = verts[ids[0]];
-                    Point b = verts[ids[1]];
-                    Point c = verts[ids[2]];
-                    
-                    Point u(b.x - a.x, b.y - a.y, b.z - a.z);
-                    Point v(c.x - a.x, c.y - a.y, c.z - a.z);
+        // Vertex normal sums of one thread's faces, covering only the
+        // vertices [lo, hi) those faces use
+        struct NormalSpan {
+            size_t lo = 0, hi = 0;
+            std::vector<float> sum;
+        };
 
-                    // Compute cross product
-                    float nx = u.y * v.z - u.z * v.y;
-                    float ny = u.z * v.x - u.x * v.z;
-                    float nz = u.x * v.y - u.y * v.x;
+        // Splits [0, n) into nt ranges and runs fn(t, first, last) on each,
+        // a thread per range after the first
+        template<typename F>
+        static void forRanges(size_t nt, size_t n, F fn) {
+            std::vector<std::thread> workers;
+            for(size_t t = 1; t < nt; ++t) {
+                workers.push_back(std::thread(fn, t, n * t / nt, n * (t + 1) / nt));
+            }
+            fn(0, 0, n / nt);
+            for(std::thread &w : workers) {
+                w.join();
+            }
+        }
 
-                    normal = Point(nx, ny, nz).normalize();
+        // Adds the face normals of faces [first, last) to their corners.
+        // The first thread adds straight into the normals, the others into
+        // their own span, so no vertex is written by two threads.
+        void accumulateNormals(size_t first, size_t last, NormalSpan &sp, bool direct) const {
+            float *sum = normals.data();
+            if(!direct && first < last) {
+                uint32_t lo = UINT32_MAX, hi = 0;
+                for(size_t i = 3 * first; i < 3 * last; ++i) {
+                    lo = std::min(lo, indices[i]);
+                    hi = std::max(hi, indices[i]);
+                }
+                sp.lo = lo;
+                sp.hi = (size_t)hi + 1;
+                sp.sum.assign(3 * (sp.hi - sp.lo), 0.0f);
+                sum = sp.sum.data() - 3 * sp.lo;
+            }
+            float fn[3 * NORMAL_BLOCK];
+            for(size_t f = first; f < last; f += NORMAL_BLOCK) {
+                size_t n = std::min((size_t)NORMAL_BLOCK, last - f);
+                const uint32_t *ids = indices + 3 * f;
+                FaceNormals::compute(positions, ids, n, fn);
+                for(size_t i = 0; i < 3 * n; ++i) {
+                    float *vn = &sum[3 * (size_t)ids[i]];
+                    const float *nf = &fn[3 * (i / 3)];
+                    vn[0] += nf[0];
+                    vn[1] += nf[1];
+                    vn[2] += nf[2];
+                }
+            }
+        }
 
-                    // Add normal to each vertex on face
-                    for(int i = 0; i < 3; ++i) {
-                        *(verts[ids[i]].normal) += normal;
+        // Fills the vertex normals, the lock is held
+        void buildNormals(int nthreads) const {
+            size_t nt = std::max(nverts, nfaces) / NORMAL_MIN_WORK;
+            nt = std::max((size_t)1, std::min(nt, (size_t)std::max(nthreads, 1)));
+
+            std::vector<NormalSpan> spans;
+            if(!fileNormals) {
+                normals.assign(3 * nverts, 0.0f);
+                spans.resize(nt);
+                forRanges(nt, nfaces, [&](size_t t, size_t first, size_t last) {
+                    accumulateNormals(first, last, spans[t], t == 0);
+                });
+            }
+            forRanges(nt, nverts, [&](size_t, size_t first, size_t last) {
+                for(size_t t = 1; t < spans.size(); ++t) {
+                    const NormalSpan &sp = spans[t];
+                    size_t lo = std::max(first, sp.lo), hi = std::min(last, sp.hi);
+                    for(size_t i = 3 * lo; i < 3 * hi; ++i) {
+                        normals[i] += sp.sum[i - 3 * sp.lo];
                     }
                 }
-        };
+                for(size_t v = first; v < last; ++v) {
+                    float *n = &normals[3 * v];
+                    float len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                    if(len > 0.0f) {
+                        n[0] /= len; n[1] /= len; n[2] /= len;
+                    }
+                }
+            });
+            valid |= DERIVED_VERT_NORMALS;
+            uploaded &= ~UPLOADED_NORMALS;
+        }
 
-        std::vector<Point> verts;
-        std::vector<Face>  faces;
+        // Moves the arrays into a new block with room for the given counts
+        void grow(size_t vcap, size_t fcap) {
+            size_t bytes = vcap * 3 * sizeof(float) + fcap * 3 * sizeof(uint32_t);
+            char *b = static_cast<char*>(::operator new(bytes));
+            float    *pos = reinterpret_cast<float*>(b);
+            uint32_t *ids = reinterpret_cast<uint32_t*>(pos + 3 * vcap);
+            if(positions != NULL) {
+                memcpy(pos, positions, 3 * nverts * sizeof(float));
+                memcpy(ids, indices,   3 * nfaces * sizeof(uint32_t));
+                ::operator delete(block);
+            }
+            adopted.reset();
+            block     = b;
+            positions = pos;
+            indices   = ids;
+            vertCap   = vcap;
+            faceCap   = fcap;
+        }
+
+        // Room for n more vertices and m more faces, doubling when full
+        void ensure(size_t n, size_t m) {
+            if(nverts + n <= vertCap && nfaces + m <= faceCap) {
+                return;
+            }
+            size_t vcap = vertCap, fcap = faceCap;
+            if(nverts + n > vcap) vcap = std::max(nverts + n, 2 * vcap);
+            if(nfaces + m > fcap) fcap = std::max(nfaces + m, 2 * fcap);
+            grow(vcap, fcap);
+        }
 
-        void drawVerts() {
+        // Copies adopted arrays into a block of the mesh's own before they
+        // are written
+        void own() {
+            if(adopted != NULL) {
+                grow(vertCap, faceCap);
+            }
+        }
+
+        void drawVerts() const {
             glPointSize(3.0);
+            if(useBuffers()) {
+                glDrawArrays(GL_POINTS, 0, nverts);
+                return;
+            }
             glBegin(GL_POINTS);
-            for(int i = 0; i < verts.size(); ++i) {
-                Point p = verts[i];
-                glVertex3f(p.x, p.y, p.z);
+            for(size_t i = 0; i < nverts; ++i) {
+                glVertex3fv(&positions[3 * i]);
+            }
+            glEnd();
+        }
+
+        // Each edge once as a line, instead of every face outlined, which
+        // draws the edges between faces twice
+        void drawEdges(const std::vector<uint32_t> &lines) const {
+            if(useBuffers()) {
+                glDrawElements(GL_LINES, lines.size(), GL_UNSIGNED_INT, (const void *)0);
+                return;
+            }
+            glBegin(GL_LINES);
+            for(size_t i = 0; i < lines.size(); ++i) {
+                glVertex3fv(&positions[3 * (size_t)lines[i]]);
             }
             glEnd();
         }
 
-        void drawNormals(bool isVertexNormals, bool isFaceNormals) {
+        void drawNormals(bool isVertexNormals, bool isFaceNormals) const {
             if(isVertexNormals) {
                 glColor3f(0.0f, 1.0f, 1.0f);
+                const float *nrm = getNormals();
                 
-                for(int i = 0; i < verts.size(); ++i) {
-                    Point p = verts[i];
-                    Point n = (p.normal)->normalize();
+                for(size_t i = 0; i < nverts; ++i) {
+                    const float *p = &positions[3 * i];
+                    const float *n = &nrm[3 * i];
 
                     glBegin(GL_LINES);
-                    glVertex3f(p.x, p.y, p.z);
-                    glVertex3f(p.x + n.x, p.y + n.y, p.z + n.z);
+                    glVertex3f(p[0], p[1], p[2]);
+                    glVertex3f(p[0] + n[0], p[1] + n[1], p[2] + n[2]);
                     glEnd();
                 }
             }
             if(isFaceNormals) {
                 glColor3f(1.0f, 0.0f, 1.0f);
+                const float *centers = getFaceCenters();
+                const float *nrm = getFaceNormals();
                 
-                for(int i = 0; i < faces.size(); ++i) {
-                    Face f = faces[i];
-                    Point p(0.0f, 0.0f, 0.0f);
-                    
-                    // Compute center of face
-                    p += verts[f.ids[0]];
-                    p += verts[f.ids[1]];
-                    p += verts[f.ids[2]];
-                    p /= 3.0f;
-
-                    Point n = f.normal.normalize();
+                for(size_t i = 0; i < nfaces; ++i) {
+                    const float *p = &centers[3 * i];
+                    const float *n = &nrm[3 * i];
 
                     glBegin(GL_LINES);
-                    glVertex3f(p.x, p.y, p.z);
-                    glVertex3f(n.x + p.x, n.y + p.y, n.z + p.z);
+                    glVertex3f(p[0], p[1], p[2]);
+                    glVertex3f(n[0] + p[0], n[1] + p[1], n[2] + p[2]);
                     glEnd();
                 }
             }
         }
 
-        void draw() {
-            for(int i = 0; i < faces.size(); ++i) {
-                Face f = faces[i];
-            
-                glBegin(GL_TRIANGLES);
-                for(int j = 0; j < 3; ++j) { 
-                    Point p = verts[f.ids[j]];
-                    Point n = p.normal->normalize();
-                    glNormal3f(n.x, n.y, n.z);
-                    glVertex3f(p.x, p.y, p.z);
+        void applyMaterial(int id) const {
+            static const Material gray;
+            const Material &m = id >= 0 ? materials[id] : gray;
+            glColor4fv(m.diffuse);
+            glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, m.specular);
+            glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, m.shininess);
+        }
+
+        // Vertex normals are only passed in lit drawing, nrm is NULL
+        // otherwise. With a view only the meshlets that survive it are
+        // drawn, from the same index buffer.
+        void drawFaces(int first, int count, const float *nrm, const MeshletView *view) const {
+            if(view != NULL) {
+                static std::vector<std::pair<size_t, size_t> > runs;
+                runs.clear();
+                Meshlets::cull(meshlets, first, first + count, *view, runs, culled);
+                if(useBuffers() && !runs.empty()) {
+                    static std::vector<GLsizei> counts;
+                    static std::vector<const void *> offsets;
+                    counts.resize(runs.size());
+                    offsets.resize(runs.size());
+                    for(size_t i = 0; i < runs.size(); ++i) {
+                        counts[i]  = 3 * runs[i].second;
+                        offsets[i] = (const void *)(3 * runs[i].first * sizeof(uint32_t));
+                    }
+                    glMultiDrawElements(GL_TRIANGLES, counts.data(), GL_UNSIGNED_INT, offsets.data(), runs.size());
+                    return;
+                }
+                for(const std::pair<size_t, size_t> &r : runs) {
+                    drawFaces(r.first, r.second, nrm, NULL);
                 }
-                glEnd();
+                return;
             }
+            if(useBuffers()) {
+                glDrawElements(GL_TRIANGLES, 3 * count, GL_UNSIGNED_INT,
+                               (const void *)(3 * (size_t)first * sizeof(uint32_t)));
+                return;
+            }
+            glBegin(GL_TRIANGLES);
+            const uint32_t *ids = indices + 3 * (size_t)first;
+            for(size_t i = 0; i < 3 * (size_t)count; ++i) {
+                uint32_t v = ids[i];
+                if(!texcoords.empty()) {
+                    glTexCoord2fv(&texcoords[2 * v]);
+                }
+                if(nrm != NULL) {
+                    glNormal3fv(&nrm[3 * v]);
+                }
+                glVertex3fv(&positions[3 * v]);
+            }
+            glEnd();
         }
 
+        // One batch per material, or a single batch in the current color
+        void draw(bool useMaterials, const float *nrm, const MeshletView *view) const {
+            if(submeshes.empty()) {
+                drawFaces(0, nfaces, nrm, view);
+                return;
+            }
+            for(size_t i = 0; i < submeshes.size(); ) {
+                size_t j = i + 1;
+                while(j < submeshes.size() && submeshes[j].material == submeshes[i].material) {
+                    j++;
+                }
+                if(useMaterials) {
+                    applyMaterial(submeshes[i].material);
+                }
+                const Submesh &last = submeshes[j - 1];
+                drawFaces(submeshes[i].first, last.first + last.count - submeshes[i].first, nrm, view);
+                i = j;
+            }
+            if(useMaterials) {
+                applyMaterial(-1);
+            }
+        }
+
+        Trimesh(const Trimesh &) = delete;
+        Trimesh &operator=(const Trimesh &) = delete;
+
     public:
 
+        Trimesh() {}
+
+        ~Trimesh() {
+            if(vbo != 0) {
+                GLuint names[4] = { vbo, nbo, ibo, ebo };
+                if(std::this_thread::get_id() == glThread) {
+                    glDeleteBuffers(4, names);
+                } else {
+                    std::lock_guard<std::mutex> l(orphanLock());
+                    orphans().insert(orphans().end(), names, names + 4);
+                }
+            }
+            ::operator delete(block);
+        }
+
+        // Draws from buffer objects, one glDrawElements per material, when
+        // set. Otherwise every vertex goes through glBegin/glEnd as before,
+        // kept for comparison.
+        static bool &useBuffers() {
+            static bool use = true;
+            return use;
+        }
+
+        // Solid and lit drawing skips the meshlets outside the view or
+        // facing away from it when set
+        static bool &cullMeshlets() {
+            static bool cull = true;
+            return cull;
+        }
+
+        // Dihedral angle in degrees above which MODE_FEATURE draws an edge
+        static float &creaseAngle() {
+            static float angle = 30.0f;
+            return angle;
+        }
+
+        void reserve(size_t nverts, size_t nfaces) {
+            if(nverts > vertCap || nfaces > faceCap) {
+                grow(std::max(nverts, vertCap), std::max(nfaces, faceCap));
+            }
+        }
+
+        // Makes an empty mesh use pos and ids where they are instead of
+        // copying them, keeping owner alive until the mesh is freed or
+        // first edited. One float past the positions must be readable, see
+        // FaceNormals. Vertex normals from the file, if given, are copied.
+        void adopt(const float *pos, size_t nverts, const uint32_t *ids, size_t nfaces,
+                   std::shared_ptr<const void> owner, const float *fileNormals = NULL) {
+            ::operator delete(block);
+            block     = NULL;
+            adopted   = owner;
+            positions = const_cast<float*>(pos);
+            indices   = const_cast<uint32_t*>(ids);
+            this->nverts = vertCap = nverts;
+            this->nfaces = faceCap = nfaces;
+            setFileNormals(fileNormals != NULL);
+            if(fileNormals != NULL) {
+                normals.assign(fileNormals, fileNormals + 3 * nverts);
+            }
+            invalidate(VERT_EDIT | FACE_EDIT);
+        }
+
+        // True while the arrays are adopted rather than owned
+        bool isAdopted() const { return adopted != NULL; }
+
+        int numVerts() const { return nverts; }
+
+        int numFaces() const { return nfaces; }
+
+        const float *getPositions() const { return positions; }
+
+        const uint32_t *getIndices() const { return indices; }
+
+        const std::vector<float> &getTexcoords() const { return texcoords; }
+
+        // Which of the DERIVED and UPLOADED data is current
+        unsigned derived() const {
+            std::lock_guard<std::mutex> l(derivedLock);
+            return valid | uploaded;
+        }
+
+        // Computes the vertex normals now, with up to nthreads threads,
+        // instead of on first use
+        void computeNormals(int nthreads = 1) const {
+            std::lock_guard<std::mutex> l(derivedLock);
+            buildNormals(nthreads);
+        }
+
+        const float *getNormals() const {
+            std::lock_guard<std::mutex> l(derivedLock);
+            if(!(valid & DERIVED_VERT_NORMALS)) {
+                buildNormals(LoadPool::threadsPerJob());
+            }
+            return normals.data();
+        }
+
+        // Unit normal per face, zero for a degenerate face
+        const float *getFaceNormals() const {
+            std::lock_guard<std::mutex> l(derivedLock);
+            if(!(valid & DERIVED_FACE_NORMALS)) {
+                faceNormals.resize(3 * nfaces);
+                for(size_t f = 0; f < nfaces; f += NORMAL_BLOCK) {
+                    size_t n = std::min((size_t)NORMAL_BLOCK, nfaces - f);
+                    FaceNormals::compute(positions, indices + 3 * f, n, &faceNormals[3 * f]);
+                }
+                valid |= DERIVED_FACE_NORMALS;
+            }
+            return faceNormals.data();
+        }
+
+        const float *getFaceCenters() const {
+            std::lock_guard<std::mutex> l(derivedLock);
+            if(!(valid & DERIVED_FACE_CENTERS)) {
+                faceCenters.resize(3 * nfaces);
+                for(size_t f = 0; f < nfaces; ++f) {
+                    const float *a = &positions[3 * indices[3 * f]];
+                    const float *b = &positions[3 * indices[3 * f + 1]];
+                    const float *c = &positions[3 * indices[3 * f + 2]];
+                    for(int k = 0; k < 3; ++k) {
+                        faceCenters[3 * f + k] = (a[k] + b[k] + c[k]) / 3.0f;
+                    }
+                }
+                valid |= DERIVED_FACE_CENTERS;
+            }
+            return faceCenters.data();
+        }
+
+        // Smallest x, y, z then largest x, y, z over all vertices
+        const float *getBounds() const {
+            std::lock_guard<std::mutex> l(derivedLock);
+            if(!(valid & DERIVED_BOUNDS)) {
+                for(int k = 0; k < 3; ++k) {
+                    bounds[k]     = nverts > 0 ?  FLT_MAX : 0.0f;
+                    bounds[k + 3] = nverts > 0 ? -FLT_MAX : 0.0f;
+                }
+                for(size_t v = 0; v < nverts; ++v) {
+                    for(int k = 0; k < 3; ++k) {
+                        bounds[k]     = std::min(bounds[k],     positions[3 * v + k]);
+                        bounds[k + 3] = std::max(bounds[k + 3], positions[3 * v + k]);
+                    }
+                }
+                valid |= DERIVED_BOUNDS;
+            }
+            return bounds;
+        }
+
+        // Every edge once, as vertex pairs with the smaller id first,
+        // sorted
+        const std::vector<uint32_t> &getEdges() const {
+            std::lock_guard<std::mutex> l(derivedLock);
+            if(!(valid & DERIVED_EDGES)) {
+                std::vector<uint64_t> keys(3 * nfaces);
+                for(size_t f = 0; f < nfaces; ++f) {
+                    for(int j = 0; j < 3; ++j) {
+                        uint64_t a = indices[3 * f + j], b = indices[3 * f + (j + 1) % 3];
+                        keys[3 * f + j] = a < b ? a << 32 | b : b << 32 | a;
+                    }
+                }
+                std::sort(keys.begin(), keys.end());
+                keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+                edges.resize(2 * keys.size());
+                for(size_t i = 0; i < keys.size(); ++i) {
+                    edges[2 * i]     = keys[i] >> 32;
+                    edges[2 * i + 1] = (uint32_t)keys[i];
+                }
+                valid |= DERIVED_EDGES;
+            }
+            return edges;
+        }
+
+        // The edges where the faces on either side meet at more than
+        // degrees, plus the edges of fewer or more than two faces, as in
+        // getEdges. Kept for the last angle asked for.
+        const std::vector<uint32_t> &getFeatureEdges(float degrees) const {
+            const float *fn = getFaceNormals();
+            std::lock_guard<std::mutex> l(derivedLock);
+            if(!(valid & DERIVED_FEATURES) || featureAngle != degrees) {
+                // Edge keys with the face as the low bits, so the faces of
+                // an edge sort next to each other
+                std::vector<std::pair<uint64_t, uint32_t> > keys(3 * nfaces);
+                for(size_t f = 0; f < nfaces; ++f) {
+                    for(int j = 0; j < 3; ++j) {
+                        uint64_t a = indices[3 * f + j], b = indices[3 * f + (j + 1) % 3];
+                        keys[3 * f + j] = std::make_pair(a < b ? a << 32 | b : b << 32 | a, (uint32_t)f);
+                    }
+                }
+                std::sort(keys.begin(), keys.end());
+                float limit = cosf(degrees * (float)M_PI / 180.0f);
+                features.clear();
+                for(size_t i = 0, j; i < keys.size(); i = j) {
+                    for(j = i + 1; j < keys.size() && keys[j].first == keys[i].first; ++j);
+                    bool feature = j - i != 2;
+                    if(!feature) {
+                        const float *a = &fn[3 * (size_t)keys[i].second];
+                        const float *b = &fn[3 * (size_t)keys[i + 1].second];
+                        feature = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] < limit;
+                    }
+                    if(feature) {
+                        features.push_back(keys[i].first >> 32);
+                        features.push_back((uint32_t)keys[i].first);
+                    }
+                }
+                features.shrink_to_fit();
+                featureAngle = degrees;
+                valid |= DERIVED_FEATURES;
+                if(edgeList == &features) {
+                    uploaded &= ~UPLOADED_EDGES;
+                }
+            }
+            return features;
+        }
+
+        const Adjacency &getAdjacency() const {
+            std::lock_guard<std::mutex> l(derivedLock);
+            if(!(valid & DERIVED_ADJACENCY)) {
+                adjacency.offsets.assign(nverts + 1, 0);
+                for(size_t i = 0; i < 3 * nfaces; ++i) {
+                    adjacency.offsets[indices[i] + 1]++;
+                }
+                for(size_t v = 0; v < nverts; ++v) {
+                    adjacency.offsets[v + 1] += adjacency.offsets[v];
+                }
+                adjacency.faces.resize(3 * nfaces);
+                std::vector<uint32_t> at(adjacency.offsets.begin(), adjacency.offsets.end() - 1);
+                for(size_t i = 0; i < 3 * nfaces; ++i) {
+                    adjacency.faces[at[indices[i]]++] = i / 3;
+                }
+                valid |= DERIVED_ADJACENCY;
+            }
+            return adjacency;
+        }
+
+        // Meshlets in face order, none crossing a submesh
+        const std::vector<Meshlet> &getMeshlets() const {
+            std::lock_guard<std::mutex> l(derivedLock);
+            if(!(valid & DERIVED_MESHLETS)) {
+                std::vector<std::pair<size_t, size_t> > ranges;
+                size_t covered = 0;
+                for(const Submesh &sm : submeshes) {
+                    if(covered < (size_t)sm.first) ranges.push_back(std::make_pair(covered, (size_t)sm.first));
+                    ranges.push_back(std::make_pair((size_t)sm.first, (size_t)sm.first + sm.count));
+                    covered = sm.first + sm.count;
+                }
+                if(covered < nfaces) ranges.push_back(std::make_pair(covered, nfaces));
+                Meshlets::build(positions, indices, nfaces, nverts, ranges, meshlets);
+                valid |= DERIVED_MESHLETS;
+            }
+            return meshlets;
+        }
+
+        // What culling did in the last solid or lit draw
+        const MeshletStats &lastCull() const { return culled; }
+
+        bool hasFileNormals() const { return fileNormals; }
+
+        // Vertex normals are taken from addVertex instead of being
+        // accumulated from the faces
+        void setFileNormals(bool fileNormals) {
+            this->fileNormals = fileNormals;
+            normals.assign(fileNormals ? 3 * nverts : 0, 0.0f);
+            if(fileNormals) {
+                normals.reserve(3 * vertCap);
+            }
+            invalidate(DERIVED_VERT_NORMALS | UPLOADED_NORMALS);
+        }
+
         void addFace(const int *ids) {
-            Face f(ids, verts);
-            faces.push_back(f);
+            addFaces(ids, 1);
         }
 
-        void addVertex(const float *values) {
-            float x = values[0];
-            float y = values[1];
-            float z = values[2];
+        void addFaces(const int *ids, size_t n) {
+            ensure(0, n);
+            uint32_t *out = indices + 3 * nfaces;
+            for(size_t i = 0; i < 3 * n; ++i) {
+                out[i] = ids[i];
+            }
+            nfaces += n;
+            invalidate(FACE_EDIT);
+        }
 
-            Point p(x, y, z);
-            p.normal = new Point(0.0f, 0.0f, 0.0f);
-            verts.push_back(p);
+        void addVertices(const float *values, size_t n) {
+            ensure(n, 0);
+            memcpy(positions + 3 * nverts, values, 3 * n * sizeof(float));
+            nverts += n;
+            if(fileNormals) {
+                normals.resize(3 * nverts);
+            }
+            invalidate(VERT_EDIT | DERIVED_ADJACENCY);
         }
 
-        void draw(int mode, bool isVertexNormals, bool isFaceNormals) {
+        void addVertex(const float *values, const float *normal = NULL) {
+            static const float zero[3] = { 0.0f, 0.0f, 0.0f };
+            ensure(1, 0);
+            memcpy(positions + 3 * nverts, values, 3 * sizeof(float));
+            nverts++;
+            if(fileNormals) {
+                const float *n = normal != NULL ? normal : zero;
+                normals.insert(normals.end(), n, n + 3);
+            }
+            invalidate(VERT_EDIT | DERIVED_ADJACENCY);
+        }
+
+        // Moves vertex v; the edges and adjacency stay
+        void setPosition(size_t v, const float *values) {
+            own();
+            memcpy(positions + 3 * v, values, 3 * sizeof(float));
+            invalidate(VERT_EDIT);
+        }
+
+        // Replaces the faces with the same faces in another order. Vertex
+        // normals and edges stay.
+        void setIndices(const uint32_t *ids) {
+            own();
+            memcpy(indices, ids, 3 * nfaces * sizeof(uint32_t));
+            invalidate(DERIVED_FACE_NORMALS | DERIVED_FACE_CENTERS | DERIVED_ADJACENCY | DERIVED_MESHLETS |
+                       UPLOADED_INDICES);
+        }
+
+        void addTexcoord(const float *uv) {
+            texcoords.push_back(uv[0]);
+            texcoords.push_back(uv[1]);
+            invalidate(UPLOADED_VERTS);
+        }
+
+        int addMaterial(const Material &m) {
+            materials.push_back(m);
+            return materials.size() - 1;
+        }
+
+        // Submeshes must be added in face order, sorted by material
+        void addSubmesh(const std::string &name, int material, int first, int count) {
+            Submesh sm = { name, material, first, count };
+            submeshes.push_back(sm);
+        }
+
+        const std::vector<Material> &getMaterials() const { return materials; }
+
+        const std::vector<Submesh> &getSubmeshes() const { return submeshes; }
+
+        // Number of glBegin/glEnd batches a draw issues
+        int numBatches() const {
+            int n = submeshes.empty() ? 1 : 0;
+            for(size_t i = 0; i < submeshes.size(); ++i) {
+                n += i == 0 || submeshes[i].material != submeshes[i - 1].material;
+            }
+            return n;
+        }
+
+        void draw(int mode, bool isVertexNormals, bool isFaceNormals) const {
             glMatrixMode(GL_MODELVIEW);
+            const float *nrm = mode == MODE_LIT ? getNormals() : NULL;
+            const std::vector<uint32_t> *lines = NULL;
+            if(mode == MODE_WIRE)    lines = &getEdges();
+            if(mode == MODE_FEATURE) lines = &getFeatureEdges(creaseAngle());
+            // Culled in the mesh's own space
+            MeshletView view;
+            bool cull = cullMeshlets() && (mode == MODE_SOLID || mode == MODE_LIT);
+            if(cull) {
+                float mv[16], p[16];
+                glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+                glGetFloatv(GL_PROJECTION_MATRIX, p);
+                cull = Meshlets::view(mv, p, view);
+            }
+            if(cull) {
+                getMeshlets();
+            }
+            culled = MeshletStats();
+            if(useBuffers()) {
+                deleteOrphans();
+                bindBuffers(nrm, lines);
+            }
             switch(mode) {
                 case MODE_POINT:
                     glColor3f(1.0f, 0.0f, 0.0f);
                     drawVerts();
                     break;
                 case MODE_WIRE:
+                case MODE_FEATURE:
                     glColor3f(0.0f, 1.0f, 0.0f);
-                    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-                    draw();
+                    drawEdges(*lines);
                     break;
                 case MODE_SOLID:
                     glColor3f(0.6f, 0.6f, 0.6f);
                     glPolygonMode(GL_FRONT, GL_FILL);
-                    draw();
+                    draw(true, nrm, cull ? &view : NULL);
                     break;
                 case MODE_LIT:
                     glColor3f(0.6f, 0.6f, 0.6f);
@@ -218,11 +973,16 @@ class Trimesh {
                     glEnable(GL_LIGHTING);
                     glEnable(GL_LIGHT0);
                     glEnable(GL_COLOR_MATERIAL);
+                    // Normals are unit length, but a scaling node stretches them
                     glEnable(GL_NORMALIZE);
-                    draw();
+                    draw(true, nrm, cull ? &view : NULL);
+                    glDisable(GL_NORMALIZE);
                     glDisable(GL_LIGHTING);
                     break;
             }
+            if(useBuffers()) {
+                unbindBuffers();
+            }
             drawNormals(isVertexNormals, isFaceNormals);
         }
 };
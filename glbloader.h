@@ -0,0 +1,469 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __GLBLOADER_H__
+#define __GLBLOADER_H__
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+#include "geom.h"
+#include "json.h"
+#include "loader.h"
+#include "mapfile.h"
+
+#define GLB_MAGIC      0x46546c67   // "glTF"
+#define GLB_CHUNK_JSON 0x4e4f534a   // "JSON"
+#define GLB_CHUNK_BIN  0x004e4942   // "BIN\0"
+
+// Accessor component types
+enum {
+    GLB_BYTE           = 5120,
+    GLB_UNSIGNED_BYTE  = 5121,
+    GLB_SHORT          = 5122,
+    GLB_UNSIGNED_SHORT = 5123,
+    GLB_UNSIGNED_INT   = 5125,
+    GLB_FLOAT          = 5126
+};
+
+// Primitive modes that describe triangles
+enum {
+    GLB_TRIANGLES      = 4,
+    GLB_TRIANGLE_STRIP = 5,
+    GLB_TRIANGLE_FAN   = 6
+};
+
+// An accessor resolved to the bytes it covers in the mapped file
+struct GlbView {
+    const char *data = NULL;
+    size_t count  = 0;
+    size_t stride = 0;
+    int componentType = 0;
+    int ncomp = 0;
+    bool normalized = false;
+
+    static int componentSize(int type) {
+        switch(type) {
+            case GLB_BYTE: case GLB_UNSIGNED_BYTE:   return 1;
+            case GLB_SHORT: case GLB_UNSIGNED_SHORT: return 2;
+            case GLB_UNSIGNED_INT: case GLB_FLOAT:   return 4;
+            default:                                 return 0;
+        }
+    }
+
+    // True when the elements are an aligned, tightly packed array of the
+    // given type, so the bytes can be used as they are
+    bool packed(int type, int n) const {
+        int size = componentSize(type);
+        return componentType == type && ncomp == n && stride == (size_t)size * n &&
+               (uintptr_t)data % size == 0;
+    }
+
+    float get(size_t i, int k) const {
+        const char *p = data + i * stride + k * componentSize(componentType);
+        switch(componentType) {
+            case GLB_FLOAT:          { float v;    memcpy(&v, p, 4); return v; }
+            case GLB_BYTE:           return normalized ? fmaxf(*(const int8_t*)p / 127.0f, -1.0f) : *(const int8_t*)p;
+            case GLB_UNSIGNED_BYTE:  return normalized ? *(const uint8_t*)p / 255.0f : *(const uint8_t*)p;
+            case GLB_SHORT:          { int16_t v;  memcpy(&v, p, 2); return normalized ? fmaxf(v / 32767.0f, -1.0f) : v; }
+            case GLB_UNSIGNED_SHORT: { uint16_t v; memcpy(&v, p, 2); return normalized ? v / 65535.0f : v; }
+            case GLB_UNSIGNED_INT:   { uint32_t v; memcpy(&v, p, 4); return v; }
+            default:                 return 0.0f;
+        }
+    }
+
+    uint32_t index(size_t i) const {
+        const char *p = data + i * stride;
+        switch(componentType) {
+            case GLB_UNSIGNED_BYTE:  return *(const uint8_t*)p;
+            case GLB_UNSIGNED_SHORT: { uint16_t v; memcpy(&v, p, 2); return v; }
+            default:                 { uint32_t v; memcpy(&v, p, 4); return v; }
+        }
+    }
+};
+
+// A binary glTF 2.0 file mapped into memory. Accessors are resolved to views
+// into the mapping. When a mesh's float positions and uint32 indices are
+// tightly packed, the mesh adopts them where they are and keeps the file
+// mapped while it lives; any other layout is converted element by element.
+// A file replaced by a rename is safe, but one truncated in place while
+// such a mesh is alive is not.
+//
+// Only the embedded BIN chunk is supported as a buffer, external buffers
+// and sparse accessors are rejected.
+class GlbFile {
+
+    private:
+
+        std::shared_ptr<MappedFile> file;
+        JsonValue json;
+        const char *bin = NULL;
+        size_t binSize = 0;
+
+        static uint32_t u32(const char *p) {
+            uint32_t v;
+            memcpy(&v, p, 4);
+            return v;
+        }
+
+        static void identity(float *m) {
+            for(int i = 0; i < 16; ++i) {
+                m[i] = i % 5 == 0 ? 1.0f : 0.0f;
+            }
+        }
+
+        // out = a * b, column major
+        static void multiply(const float *a, const float *b, float *out) {
+            float r[16];
+            for(int c = 0; c < 4; ++c) {
+                for(int row = 0; row < 4; ++row) {
+                    float s = 0;
+                    for(int k = 0; k < 4; ++k) {
+                        s += a[k * 4 + row] * b[c * 4 + k];
+                    }
+                    r[c * 4 + row] = s;
+                }
+            }
+            memcpy(out, r, sizeof(r));
+        }
+
+        // Adds the triangles of one primitive, offset by base. Triangles
+        // with indices outside the primitive's vertices are dropped.
+        static void addTriangles(const GlbView *ids, size_t nverts, int mode, int base, bool flip,
+                                 std::vector<int> &tris) {
+            size_t n = ids != NULL ? ids->count : nverts;
+            size_t ntris = mode == GLB_TRIANGLES ? n / 3 : (n >= 3 ? n - 2 : 0);
+            tris.reserve(tris.size() + 3 * ntris);
+            for(size_t t = 0; t < ntris; ++t) {
+                size_t c[3];
+                if(mode == GLB_TRIANGLES) {
+                    c[0] = 3 * t; c[1] = 3 * t + 1; c[2] = 3 * t + 2;
+                } else if(mode == GLB_TRIANGLE_FAN) {
+                    c[0] = 0; c[1] = t + 1; c[2] = t + 2;
+                } else {
+                    // Every other strip triangle is reversed to keep the winding
+                    c[0] = t; c[1] = t % 2 ? t + 2 : t + 1; c[2] = t % 2 ? t + 1 : t + 2;
+                }
+                uint32_t v[3];
+                for(int k = 0; k < 3; ++k) {
+                    v[k] = ids != NULL ? ids->index(c[k]) : (uint32_t)c[k];
+                }
+                if(v[0] >= nverts || v[1] >= nverts || v[2] >= nverts) {
+                    continue;
+                }
+                if(flip) {
+                    std::swap(v[1], v[2]);
+                }
+                tris.insert(tris.end(), { base + (int)v[0], base + (int)v[1], base + (int)v[2] });
+            }
+        }
+
+    public:
+
+        static bool isGLB(const char *data, size_t size) {
+            return size >= 12 && u32(data) == GLB_MAGIC;
+        }
+
+        bool open(const char *path) {
+            file = std::make_shared<MappedFile>();
+            if(!file->open(path) || !isGLB(file->data(), file->size())) return false;
+            const char *p = file->data();
+            size_t size = file->size();
+            if(u32(p + 4) != 2 || u32(p + 8) > size) return false;
+            size = u32(p + 8);
+
+            // Chunks: JSON first, then an optional BIN
+            size_t at = 12;
+            bool haveJson = false;
+            bin = NULL;
+            binSize = 0;
+            while(at + 8 <= size) {
+                size_t len = u32(p + at);
+                uint32_t type = u32(p + at + 4);
+                if(len > size - at - 8) return false;
+                const char *chunk = p + at + 8;
+                if(type == GLB_CHUNK_JSON && !haveJson) {
+                    json = JsonValue();
+                    if(!JsonValue::parse(chunk, chunk + len, json)) return false;
+                    haveJson = true;
+                } else if(type == GLB_CHUNK_BIN && bin == NULL) {
+                    bin = chunk;
+                    binSize = len;
+                }
+                at += 8 + len;
+            }
+            return haveJson && json.isObject();
+        }
+
+        const JsonValue &doc() const { return json; }
+
+        size_t numMeshes() const { return json["meshes"].size(); }
+
+        std::string meshName(int mesh) const {
+            const JsonValue &name = json["meshes"][mesh]["name"];
+            return name.isString() ? name.str : "Mesh " + std::to_string(mesh);
+        }
+
+        bool accessor(int idx, GlbView &v) const {
+            const JsonValue &a = json["accessors"][idx];
+            if(!a.isObject() || a.has("sparse")) return false;
+            const JsonValue &bv = json["bufferViews"][a["bufferView"].integer()];
+            if(!bv.isObject() || bv["buffer"].integer(0) != 0 || bin == NULL) return false;
+            if(json["buffers"][0].has("uri")) return false;
+
+            static const char *types[] = { "SCALAR", "VEC2", "VEC3", "VEC4" };
+            v.ncomp = 0;
+            for(int i = 0; i < 4; ++i) {
+                if(a["type"].str == types[i]) v.ncomp = i + 1;
+            }
+            v.componentType = a["componentType"].integer(0);
+            v.normalized = a["normalized"].boolean;
+            int size = GlbView::componentSize(v.componentType);
+            if(v.ncomp == 0 || size == 0) return false;
+
+            // Sizes are checked before any arithmetic, which is arranged so
+            // it cannot wrap
+            size_t elem = (size_t)size * v.ncomp, aoff, voff, length;
+            if(!a["count"].isNumber() || !bv["byteLength"].isNumber() || !a["count"].natural(v.count) ||
+               !a["byteOffset"].natural(aoff) || !bv["byteOffset"].natural(voff) ||
+               !bv["byteLength"].natural(length) || !bv["byteStride"].natural(v.stride, elem)) {
+                return false;
+            }
+            if(v.stride < elem || voff > binSize || length > binSize - voff) return false;
+            if(v.count > 0 && (aoff > length || length - aoff < elem ||
+                               v.count - 1 > (length - aoff - elem) / v.stride)) {
+                return false;
+            }
+            v.data = bin + voff + aoff;
+            return true;
+        }
+
+        // Builds one glTF mesh, all of its triangle primitives merged, into
+        // an empty Trimesh. A transform bakes the mesh into another space,
+        // used when a whole scene goes into one mesh.
+        bool buildMesh(int mesh, Trimesh *pmesh, const float *matrix = NULL) const {
+            const JsonValue &prims = json["meshes"][mesh]["primitives"];
+            if(matrix == NULL && prims.size() == 1 && buildPacked(prims[0], pmesh)) {
+                return true;
+            }
+            std::vector<float> verts, normals, texcoords;
+            std::vector<int> tris;
+            if(!appendMesh(mesh, matrix, verts, normals, texcoords, tris)) return false;
+            fill(pmesh, verts, normals, texcoords, tris);
+            return true;
+        }
+
+        // Collects a mesh's primitives into flat arrays, see buildMesh.
+        // Normals and texture coordinates are kept only if every primitive
+        // so far has them.
+        bool appendMesh(int mesh, const float *matrix, std::vector<float> &verts,
+                        std::vector<float> &normals, std::vector<float> &texcoords,
+                        std::vector<int> &tris) const {
+            const JsonValue &prims = json["meshes"][mesh]["primitives"];
+            if(!prims.isArray()) return false;
+
+            // Normals go through the inverse transpose, computed as the
+            // cofactor matrix since they are renormalized anyway. Mirroring
+            // transforms flip the winding.
+            float nm[9] = { 1,0,0, 0,1,0, 0,0,1 };
+            bool flip = false;
+            if(matrix != NULL) {
+                const float *m = matrix;
+                nm[0] = m[5]*m[10] - m[6]*m[9]; nm[1] = m[6]*m[8] - m[4]*m[10]; nm[2] = m[4]*m[9] - m[5]*m[8];
+                nm[3] = m[2]*m[9] - m[1]*m[10]; nm[4] = m[0]*m[10] - m[2]*m[8]; nm[5] = m[1]*m[8] - m[0]*m[9];
+                nm[6] = m[1]*m[6] - m[2]*m[5];  nm[7] = m[2]*m[4] - m[0]*m[6];  nm[8] = m[0]*m[5] - m[1]*m[4];
+                float det = m[0]*nm[0] + m[4]*nm[3] + m[8]*nm[6];
+                flip = det < 0;
+            }
+
+            bool first = verts.empty();
+            for(size_t i = 0; i < prims.size(); ++i) {
+                const JsonValue &prim = prims[i];
+                int mode = prim["mode"].integer(GLB_TRIANGLES);
+                if(mode != GLB_TRIANGLES && mode != GLB_TRIANGLE_STRIP && mode != GLB_TRIANGLE_FAN) {
+                    continue;
+                }
+                const JsonValue &attrs = prim["attributes"];
+                GlbView pos, nrm, uv, ids;
+                if(!accessor(attrs["POSITION"].integer(), pos) || pos.ncomp != 3) return false;
+                bool hasNormals   = accessor(attrs["NORMAL"].integer(), nrm) && nrm.ncomp == 3 && nrm.count == pos.count;
+                bool hasTexcoords = accessor(attrs["TEXCOORD_0"].integer(), uv) && uv.ncomp == 2 && uv.count == pos.count;
+                bool indexed = prim.has("indices");
+                if(indexed && (!accessor(prim["indices"].integer(), ids) || ids.ncomp != 1)) return false;
+
+                // An attribute missing from one primitive is dropped from all
+                size_t base = verts.size() / 3;
+                if(pos.count > (size_t)INT32_MAX - base) return false;
+                if(!hasNormals || (!first && normals.size() != verts.size())) normals.clear();
+                else normals.reserve(verts.size() + 3 * pos.count);
+                if(!hasTexcoords || (!first && texcoords.size() != 2 * base)) texcoords.clear();
+
+                verts.resize(verts.size() + 3 * pos.count);
+                for(size_t v = 0; v < pos.count; ++v) {
+                    float p[3] = { pos.get(v, 0), pos.get(v, 1), pos.get(v, 2) };
+                    float *out = &verts[3 * (base + v)];
+                    if(matrix != NULL) {
+                        const float *m = matrix;
+                        out[0] = m[0]*p[0] + m[4]*p[1] + m[8]*p[2]  + m[12];
+                        out[1] = m[1]*p[0] + m[5]*p[1] + m[9]*p[2]  + m[13];
+                        out[2] = m[2]*p[0] + m[6]*p[1] + m[10]*p[2] + m[14];
+                    } else {
+                        memcpy(out, p, sizeof(p));
+                    }
+                }
+                if(hasNormals && normals.size() == 3 * base) {
+                    for(size_t v = 0; v < nrm.count; ++v) {
+                        float n[3] = { nrm.get(v, 0), nrm.get(v, 1), nrm.get(v, 2) };
+                        normals.insert(normals.end(), { nm[0]*n[0] + nm[3]*n[1] + nm[6]*n[2],
+                                                        nm[1]*n[0] + nm[4]*n[1] + nm[7]*n[2],
+                                                        nm[2]*n[0] + nm[5]*n[1] + nm[8]*n[2] });
+                    }
+                }
+                if(hasTexcoords && texcoords.size() == 2 * base) {
+                    // glTF puts the texture origin at the top left
+                    for(size_t v = 0; v < uv.count; ++v) {
+                        texcoords.insert(texcoords.end(), { uv.get(v, 0), 1.0f - uv.get(v, 1) });
+                    }
+                }
+                addTriangles(indexed ? &ids : NULL, pos.count, mode, base, flip, tris);
+                first = false;
+            }
+            return true;
+        }
+
+        static void fill(Trimesh *pmesh, const std::vector<float> &verts, const std::vector<float> &normals,
+                         const std::vector<float> &texcoords, const std::vector<int> &tris) {
+            size_t nverts = verts.size() / 3;
+            bool useNormals = normals.size() == verts.size() && nverts > 0;
+            bool useTexcoords = texcoords.size() == 2 * nverts && nverts > 0;
+            pmesh->reserve(nverts, tris.size() / 3);
+            pmesh->setFileNormals(useNormals);
+            if(!useNormals) {
+                pmesh->addVertices(verts.data(), nverts);
+            }
+            for(size_t i = 0; useNormals && i < nverts; ++i) {
+                pmesh->addVertex(&verts[3 * i], &normals[3 * i]);
+            }
+            for(size_t i = 0; useTexcoords && i < nverts; ++i) {
+                pmesh->addTexcoord(&texcoords[2 * i]);
+            }
+            pmesh->addFaces(tris.data(), tris.size() / 3);
+        }
+
+        // Local transform of a node as a column major matrix
+        void nodeMatrix(int node, float *m) const {
+            const JsonValue &n = json["nodes"][node];
+            identity(m);
+            if(n["matrix"].size() == 16) {
+                for(int i = 0; i < 16; ++i) {
+                    m[i] = n["matrix"][i].num();
+                }
+                return;
+            }
+            float r[16], s[16];
+            rotationMatrix(node, r);
+            identity(s);
+            for(int i = 0; i < 3; ++i) {
+                s[i * 5] = n["scale"][i].num(1);
+            }
+            multiply(r, s, m);
+            for(int i = 0; i < 3; ++i) {
+                m[12 + i] = n["translation"][i].num();
+            }
+        }
+
+        // Rotation of a TRS node as a column major matrix
+        void rotationMatrix(int node, float *m) const {
+            const JsonValue &q = json["nodes"][node]["rotation"];
+            float x = q[0].num(), y = q[1].num(), z = q[2].num(), w = q[3].num(1);
+            identity(m);
+            m[0] = 1 - 2*(y*y + z*z); m[4] = 2*(x*y - z*w);     m[8]  = 2*(x*z + y*w);
+            m[1] = 2*(x*y + z*w);     m[5] = 1 - 2*(x*x + z*z); m[9]  = 2*(y*z - x*w);
+            m[2] = 2*(x*z - y*w);     m[6] = 2*(y*z + x*w);     m[10] = 1 - 2*(x*x + y*y);
+        }
+
+        // Root nodes of the default scene, or of the first one
+        std::vector<int> sceneRoots() const {
+            std::vector<int> roots;
+            const JsonValue &scene = json["scenes"][json["scene"].integer(0)]["nodes"];
+            for(size_t i = 0; i < scene.size(); ++i) {
+                roots.push_back(scene[i].integer());
+            }
+            return roots;
+        }
+
+        // Flattens every mesh instance of the scene into one mesh in world
+        // space, for loading a .glb into a single geometry node
+        bool buildScene(Trimesh *pmesh) const {
+            std::vector<float> verts, normals, texcoords;
+            std::vector<int> tris;
+            std::vector<int> roots = sceneRoots();
+            float world[16];
+            identity(world);
+            for(int root : roots) {
+                if(!appendNode(root, world, verts, normals, texcoords, tris, 0)) return false;
+            }
+            fill(pmesh, verts, normals, texcoords, tris);
+            return true;
+        }
+
+    private:
+
+        // Single primitive whose float positions (and normals) and uint32
+        // triangle indices are packed: the mesh adopts the mapped positions
+        // and indices, and copies the normals. False, with the mesh
+        // untouched, for any other layout.
+        bool buildPacked(const JsonValue &prim, Trimesh *pmesh) const {
+            const JsonValue &attrs = prim["attributes"];
+            GlbView pos, nrm, ids;
+            if(prim["mode"].integer(GLB_TRIANGLES) != GLB_TRIANGLES || attrs.has("TEXCOORD_0") ||
+               !accessor(attrs["POSITION"].integer(), pos) || !pos.packed(GLB_FLOAT, 3) ||
+               !accessor(prim["indices"].integer(), ids) || !ids.packed(GLB_UNSIGNED_INT, 1) ||
+               pos.count > INT32_MAX) {
+                return false;
+            }
+            bool hasNormals = attrs.has("NORMAL");
+            if(hasNormals && (!accessor(attrs["NORMAL"].integer(), nrm) || !nrm.packed(GLB_FLOAT, 3) ||
+                              nrm.count != pos.count)) {
+                return false;
+            }
+            const uint32_t *tri = reinterpret_cast<const uint32_t*>(ids.data);
+            size_t n = ids.count / 3 * 3;
+            for(size_t i = 0; i < n; ++i) {
+                if(tri[i] >= pos.count) return false;
+            }
+
+            // Face normals read one float past the positions
+            if((size_t)(file->data() + file->size() - pos.data) < 3 * sizeof(float) * pos.count + sizeof(float)) {
+                return false;
+            }
+            pmesh->adopt(reinterpret_cast<const float*>(pos.data), pos.count, tri, n / 3, file,
+                         hasNormals ? reinterpret_cast<const float*>(nrm.data) : NULL);
+            return true;
+        }
+
+        bool appendNode(int node, const float *parent, std::vector<float> &verts, std::vector<float> &normals,
+                        std::vector<float> &texcoords, std::vector<int> &tris, int depth) const {
+            const JsonValue &n = json["nodes"][node];
+            if(!n.isObject() || depth > (int)json["nodes"].size()) return false;
+            float local[16], world[16];
+            nodeMatrix(node, local);
+            multiply(parent, local, world);
+            if(n["mesh"].isNumber() && !appendMesh(n["mesh"].integer(), world, verts, normals, texcoords, tris)) {
+                return false;
+            }
+            for(size_t i = 0; i < n["children"].size(); ++i) {
+                if(!appendNode(n["children"][i].integer(), world, verts, normals, texcoords, tris, depth + 1)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+};
+
+#endif
@@ -0,0 +1,139 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __GZRING_H__
+#define __GZRING_H__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <zlib.h>
+
+#define GZ_RING_BUFFERS 4
+#define GZ_RING_SIZE    (4 << 20)
+
+// Decompresses a gzip file on a background thread into a small ring of
+// fixed-size buffers. The consumer takes filled buffers in order with next()
+// and hands each one back with release(), so decoding runs ahead of the
+// consumer by at most the size of the ring.
+class GzBlockReader {
+
+    private:
+
+        gzFile gz = NULL;
+        std::thread worker;
+        std::mutex lock;
+        std::condition_variable cond;
+
+        std::vector<char> bufs[GZ_RING_BUFFERS];
+        size_t lens[GZ_RING_BUFFERS];
+
+        // Buffers filled and released so far, both only ever grow
+        size_t filled   = 0;
+        size_t released = 0;
+
+        bool eof    = false;
+        bool failed = false;
+        bool stop   = false;
+
+        GzBlockReader(const GzBlockReader &) = delete;
+        GzBlockReader &operator=(const GzBlockReader &) = delete;
+
+        void decode() {
+            for(size_t k = 0; ; ++k) {
+                {
+                    std::unique_lock<std::mutex> l(lock);
+                    cond.wait(l, [&] { return stop || k - released < GZ_RING_BUFFERS; });
+                    if(stop) {
+                        return;
+                    }
+                }
+                std::vector<char> &buf = bufs[k % GZ_RING_BUFFERS];
+                int n = gzread(gz, buf.data(), buf.size());
+
+                std::lock_guard<std::mutex> l(lock);
+                if(n <= 0) {
+                    // gzread also returns 0 when the file ends inside the
+                    // stream, only gzerror tells that from a clean end
+                    int err = Z_OK;
+                    if(n == 0) gzerror(gz, &err);
+                    eof    = true;
+                    failed = n < 0 || err != Z_OK;
+                } else {
+                    lens[k % GZ_RING_BUFFERS] = n;
+                    filled++;
+                }
+                cond.notify_all();
+                if(n <= 0) {
+                    return;
+                }
+            }
+        }
+
+    public:
+
+        GzBlockReader() {}
+
+        ~GzBlockReader() { close(); }
+
+        bool open(const char *path) {
+            close();
+            gz = gzopen(path, "rb");
+            if(gz == NULL) {
+                return false;
+            }
+            gzbuffer(gz, 1 << 17);
+            for(int i = 0; i < GZ_RING_BUFFERS; ++i) {
+                bufs[i].resize(GZ_RING_SIZE);
+            }
+            filled = released = 0;
+            eof = failed = stop = false;
+            worker = std::thread(&GzBlockReader::decode, this);
+            return true;
+        }
+
+        void close() {
+            if(worker.joinable()) {
+                {
+                    std::lock_guard<std::mutex> l(lock);
+                    stop = true;
+                }
+                cond.notify_all();
+                worker.join();
+            }
+            if(gz != NULL) {
+                gzclose(gz);
+                gz = NULL;
+            }
+        }
+
+        // Waits for the next filled buffer, false at the end of the stream.
+        // The buffer stays valid until release().
+        bool next(const char *&data, size_t &len) {
+            std::unique_lock<std::mutex> l(lock);
+            cond.wait(l, [&] { return filled > released || eof; });
+            if(filled == released) {
+                return false;
+            }
+            data = bufs[released % GZ_RING_BUFFERS].data();
+            len  = lens[released % GZ_RING_BUFFERS];
+            return true;
+        }
+
+        void release() {
+            {
+                std::lock_guard<std::mutex> l(lock);
+                released++;
+            }
+            cond.notify_all();
+        }
+
+        // False if the stream ended in a decompression error
+        bool ok() {
+            std::lock_guard<std::mutex> l(lock);
+            return !failed;
+        }
+};
+
+#endif
@@ -0,0 +1,241 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __JSON_H__
+#define __JSON_H__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstdint>
+#include <climits>
+#include <cmath>
+
+// A parsed JSON document. Just enough for reading asset descriptions:
+// numbers are doubles, and lookups of missing members or elements return
+// a shared null value so chains like v["a"][0]["b"] never fail.
+struct JsonValue {
+
+    enum Type {
+        JSON_NULL,
+        JSON_BOOL,
+        JSON_NUMBER,
+        JSON_STRING,
+        JSON_ARRAY,
+        JSON_OBJECT
+    };
+
+    Type type = JSON_NULL;
+    bool boolean = false;
+    double number = 0;
+    std::string str;
+    std::vector<JsonValue> items;
+    std::map<std::string, JsonValue> members;
+
+    bool isNull()   const { return type == JSON_NULL; }
+    bool isNumber() const { return type == JSON_NUMBER; }
+    bool isString() const { return type == JSON_STRING; }
+    bool isArray()  const { return type == JSON_ARRAY; }
+    bool isObject() const { return type == JSON_OBJECT; }
+
+    size_t size() const { return items.size(); }
+
+    bool has(const std::string &key) const {
+        return members.find(key) != members.end();
+    }
+
+    const JsonValue &operator[](size_t i) const {
+        return i < items.size() ? items[i] : null();
+    }
+
+    const JsonValue &operator[](const std::string &key) const {
+        std::map<std::string, JsonValue>::const_iterator it = members.find(key);
+        return it != members.end() ? it->second : null();
+    }
+
+    double num(double fallback = 0) const { return isNumber() ? number : fallback; }
+
+    // Numbers that are not whole or do not fit an int give the fallback,
+    // since casting them would be undefined
+    int integer(int fallback = -1) const {
+        return isNumber() && number == floor(number) && number >= INT_MIN && number <= INT_MAX ? (int)number
+                                                                                              : fallback;
+    }
+
+    // A whole number from 0 to 2^53 as a size, or fallback when the value
+    // is missing. False for any other value.
+    bool natural(size_t &out, size_t fallback = 0) const {
+        if(isNull()) {
+            out = fallback;
+            return true;
+        }
+        if(!isNumber() || number != floor(number) || number < 0 || number > 9007199254740992.0) {
+            return false;
+        }
+        out = (size_t)number;
+        return true;
+    }
+
+    static const JsonValue &null() {
+        static const JsonValue v;
+        return v;
+    }
+
+    // Parses a whole document, false on malformed input
+    static bool parse(const char *p, const char *end, JsonValue &out) {
+        return parseValue(p, end, out, 0) && (skip(p, end), p == end);
+    }
+
+    private:
+
+        // Deeper nesting than this is rejected rather than risking the stack
+        static const int MAX_DEPTH = 128;
+
+        static void skip(const char *&p, const char *end) {
+            while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+        }
+
+        static bool literal(const char *&p, const char *end, const char *word) {
+            for(; *word; ++word, ++p) {
+                if(p == end || *p != *word) return false;
+            }
+            return true;
+        }
+
+        static void appendUTF8(std::string &s, uint32_t c) {
+            if(c < 0x80) {
+                s += (char)c;
+            } else if(c < 0x800) {
+                s += (char)(0xc0 | c >> 6);
+                s += (char)(0x80 | (c & 0x3f));
+            } else if(c < 0x10000) {
+                s += (char)(0xe0 | c >> 12);
+                s += (char)(0x80 | (c >> 6 & 0x3f));
+                s += (char)(0x80 | (c & 0x3f));
+            } else {
+                s += (char)(0xf0 | c >> 18);
+                s += (char)(0x80 | (c >> 12 & 0x3f));
+                s += (char)(0x80 | (c >> 6 & 0x3f));
+                s += (char)(0x80 | (c & 0x3f));
+            }
+        }
+
+        static bool hex4(const char *&p, const char *end, uint32_t &c) {
+            c = 0;
+            for(int i = 0; i < 4; ++i, ++p) {
+                if(p == end) return false;
+                char h = *p;
+                int d = h >= '0' && h <= '9' ? h - '0' :
+                        (h | 0x20) >= 'a' && (h | 0x20) <= 'f' ? (h | 0x20) - 'a' + 10 : -1;
+                if(d < 0) return false;
+                c = c << 4 | d;
+            }
+            return true;
+        }
+
+        static bool parseString(const char *&p, const char *end, std::string &s) {
+            if(p == end || *p != '"') return false;
+            p++;
+            while(p < end && *p != '"') {
+                if(*p != '\\') {
+                    s += *p++;
+                    continue;
+                }
+                if(++p == end) return false;
+                char e = *p++;
+                switch(e) {
+                    case '"':  s += '"';  break;
+                    case '\\': s += '\\'; break;
+                    case '/':  s += '/';  break;
+                    case 'b':  s += '\b'; break;
+                    case 'f':  s += '\f'; break;
+                    case 'n':  s += '\n'; break;
+                    case 'r':  s += '\r'; break;
+                    case 't':  s += '\t'; break;
+                    case 'u': {
+                        uint32_t c;
+                        if(!hex4(p, end, c)) return false;
+                        // Surrogate pair
+                        if(c >= 0xd800 && c < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                            const char *q = p + 2;
+                            uint32_t lo;
+                            if(hex4(q, end, lo) && lo >= 0xdc00 && lo < 0xe000) {
+                                c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                                p = q;
+                            }
+                        }
+                        appendUTF8(s, c);
+                        break;
+                    }
+                    default: return false;
+                }
+            }
+            if(p == end) return false;
+            p++;
+            return true;
+        }
+
+        static bool parseValue(const char *&p, const char *end, JsonValue &v, int depth) {
+            skip(p, end);
+            if(p == end || depth > MAX_DEPTH) return false;
+            switch(*p) {
+                case 'n': v.type = JSON_NULL; return literal(p, end, "null");
+                case 't': v.type = JSON_BOOL; v.boolean = true;  return literal(p, end, "true");
+                case 'f': v.type = JSON_BOOL; v.boolean = false; return literal(p, end, "false");
+                case '"': v.type = JSON_STRING; return parseString(p, end, v.str);
+                case '[': {
+                    v.type = JSON_ARRAY;
+                    p++;
+                    skip(p, end);
+                    if(p < end && *p == ']') { p++; return true; }
+                    for(;;) {
+                        v.items.push_back(JsonValue());
+                        if(!parseValue(p, end, v.items.back(), depth + 1)) return false;
+                        skip(p, end);
+                        if(p == end) return false;
+                        if(*p == ']') { p++; return true; }
+                        if(*p++ != ',') return false;
+                    }
+                }
+                case '{': {
+                    v.type = JSON_OBJECT;
+                    p++;
+                    skip(p, end);
+                    if(p < end && *p == '}') { p++; return true; }
+                    for(;;) {
+                        std::string key;
+                        skip(p, end);
+                        if(!parseString(p, end, key)) return false;
+                        skip(p, end);
+                        if(p == end || *p++ != ':') return false;
+                        if(!parseValue(p, end, v.members[key], depth + 1)) return false;
+                        skip(p, end);
+                        if(p == end) return false;
+                        if(*p == '}') { p++; return true; }
+                        if(*p++ != ',') return false;
+                    }
+                }
+                default: {
+                    // strtod needs a terminated string
+                    char buf[64];
+                    size_t n = 0;
+                    while(p + n < end && n < sizeof(buf) - 1 &&
+                          ((p[n] >= '0' && p[n] <= '9') || p[n] == '-' || p[n] == '+' ||
+                           p[n] == '.' || p[n] == 'e' || p[n] == 'E')) {
+                        buf[n] = p[n];
+                        n++;
+                    }
+                    buf[n] = '\0';
+                    char *e;
+                    v.type = JSON_NUMBER;
+                    v.number = strtod(buf, &e);
+                    if(n == 0 || e != buf + n) return false;
+                    p += n;
+                    return true;
+                }
+            }
+        }
+};
+
+#endif
@@ -1,123 +1,774 @@
 #ifndef __LOADER_H__
 #define __LOADER_H__
 #include <iostream>
-#include <fstream>
+#include <vector>
+#include <thread>
+#include <atomic>
 #include <cstring>
+#include <string>
+#include <map>
+#include <unordered_map>
 #include "geom.h"
+#include "mapfile.h"
+#include "objscan.h"
+#include "gzring.h"
+#include "loadpool.h"
 
-#define LINE_SIZE    1024
-#define TOKEN_LENGTH 8
+#define MIN_CHUNK_SIZE (1 << 20)
 
-enum TokenID { T_NONE = -1, T_VERT, T_FACE}; 
+// Lines parsed between progress reports and cancellation checks
+#define PROGRESS_LINES 4096
 
-struct TokenPair 
+enum TokenID { T_NONE = -1, T_VERT, T_NORMAL, T_TEXCOORD, T_FACE, T_GROUP, T_OBJECT, T_USEMTL, T_MTLLIB};
+
+// Position, texture and normal index of one face corner, -1 when absent
+struct ObjCorner
+{
+	int v, t, n;
+
+	bool operator==(const ObjCorner &rhs) const
+	{
+		return v == rhs.v && t == rhs.t && n == rhs.n;
+	}
+};
+
+struct ObjCornerHash
 {
-	char strval[TOKEN_LENGTH];
-	TokenID  tokID;
-	bool operator==(const TokenPair & rhs)  const
+	size_t operator()(const ObjCorner &c) const
 	{
-		return strcmp(strval, rhs.strval) == 0 && tokID == rhs.tokID;
+		uint64_t h = (uint64_t)(uint32_t)c.v * 0x9e3779b97f4a7c15ULL;
+		h ^= ((uint64_t)(uint32_t)c.t << 32 | (uint32_t)c.n) * 0xc2b2ae3d27d4eb4fULL;
+		return h ^ (h >> 31);
 	}
-	bool operator!=(const TokenPair & rhs) const
+};
+
+// A g, o or usemtl record, applying to the triangles from tri on
+struct ObjSwitch
+{
+	size_t tri;
+	TokenID kind;
+	std::string name;
+};
+
+// A newline-aligned slice of an OBJ file and the records parsed from it
+struct ObjChunk
+{
+	const char *begin;
+	const char *end;
+
+	// Filled by the counting pass
+	size_t nverts     = 0;
+	size_t nnormals   = 0;
+	size_t ntexcoords = 0;
+	size_t nfaces     = 0;
+
+	// Records in all earlier chunks, needed to resolve relative indices
+	int vertBase = 0;
+	int normBase = 0;
+	int texBase  = 0;
+
+	std::vector<float> verts;
+	std::vector<float> normals;
+	std::vector<float> texcoords;
+
+	// Position index of every triangle corner. Texture and normal indices
+	// go to attrs, two per corner, once any face in the chunk has them.
+	std::vector<int>   tris;
+	std::vector<int>   attrs;
+	bool hasAttrs = false;
+
+	std::vector<ObjCorner> corners;
+
+	std::vector<ObjSwitch>   switches;
+	std::vector<std::string> mtllibs;
+};
+
+// Progress of a load running on another thread. The loader updates bytes
+// and tris as it goes and gives up soon after cancel is set.
+struct LoadProgress
+{
+	std::atomic<size_t> bytes{0};
+	std::atomic<size_t> total{0};
+	std::atomic<size_t> tris{0};
+	std::atomic<bool>   cancel{false};
+
+	void reset()
 	{
-		return !(*this==rhs);
+		bytes  = 0;
+		total  = 0;
+		tris   = 0;
+		cancel = false;
 	}
 };
 
+// Parses OBJ files in place from a read-only mapping. A counting pre-pass
+// sizes every buffer once, then every line is decoded without copying it out
+// of the mapping, so line length is unbounded. Token and line boundaries come
+// from ObjScanner, which classifies the bytes 64 at a time with SIMD.
+//
+// With more than one thread the file is split at newline boundaries and the
+// chunks are counted and parsed concurrently. Chunks are stitched together
+// in file order, so the mesh is identical to the single threaded result.
 class TrimeshLoader
 {
 	public:
 
-		static TokenPair EMPTY_PAIR;
+		TrimeshLoader(LoadProgress *progress = NULL) : progress(progress) {}
+
+		static int defaultThreads()
+		{
+			return LoadPool::cores();
+		}
+
+		TokenID tokenMatch(const char *tok, const char *tokEnd)
+		{
+			if(tokEnd - tok == 1)
+			{
+				switch(*tok)
+				{
+					case 'v': return T_VERT;
+					case 'f': return T_FACE;
+					case 'g': return T_GROUP;
+					case 'o': return T_OBJECT;
+				}
+			}
+			else if(tokEnd - tok == 6)
+			{
+				if(memcmp(tok, "usemtl", 6) == 0) return T_USEMTL;
+				if(memcmp(tok, "mtllib", 6) == 0) return T_MTLLIB;
+			}
+			else if(tokEnd - tok == 2 && tok[0] == 'v')
+			{
+				switch(tok[1])
+				{
+					case 'n': return T_NORMAL;
+					case 't': return T_TEXCOORD;
+				}
+			}
+			return T_NONE;
+		}
+
+		bool loadOBJ(const char *objfile, Trimesh *pmesh, int nthreads = 1)
+		{
+			MappedFile file(objfile);
+			if(!file.isOpen()) return false;
+			setMaterialDir(objfile);
+
+			// gzip magic, the file is decompressed and parsed as a stream
+			if(file.size() >= 2 && (unsigned char)file.data()[0] == 0x1f &&
+			   (unsigned char)file.data()[1] == 0x8b)
+			{
+				file.close();
+				return loadOBJGz(objfile, pmesh);
+			}
+
+			if(progress) progress->total = file.size();
+
+			std::vector<ObjChunk> chunks;
+			splitChunks(file.data(), file.data() + file.size(), nthreads, chunks);
+
+			runChunks(chunks, &TrimeshLoader::countRecords);
+			if(cancelled()) return false;
+
+			size_t nverts = 0, nnormals = 0, ntexcoords = 0, nfaces = 0;
+			for(ObjChunk &c : chunks)
+			{
+				c.vertBase = nverts;
+				c.normBase = nnormals;
+				c.texBase  = ntexcoords;
+				nverts     += c.nverts;
+				nnormals   += c.nnormals;
+				ntexcoords += c.ntexcoords;
+				nfaces     += c.nfaces;
+			}
+
+			runChunks(chunks, &TrimeshLoader::parseChunk);
+			if(cancelled()) return false;
+			buildMesh(chunks, pmesh);
+			return true;
+		}
+
+		bool cancelled()
+		{
+			return progress && progress->cancel;
+		}
+
+		// Parses a gzip compressed OBJ while it is being decompressed. The
+		// decoder thread fills a ring of buffers, complete lines are parsed
+		// straight out of each buffer and the one line that straddles two
+		// buffers is stitched together in carry.
+		//
+		// Progress counts decompressed bytes, against the size in the gzip
+		// trailer. That is only the size modulo 4 GiB of the last member, so
+		// the total grows with the bytes parsed when they pass it.
+		bool loadOBJGz(const char *objfile, Trimesh *pmesh)
+		{
+			GzBlockReader gz;
+			if(!gz.open(objfile)) return false;
+			setMaterialDir(objfile);
+			if(progress) progress->total = gzipSize(objfile);
+
+			std::vector<ObjChunk> chunks(1);
+			std::string carry;
+			const char *data;
+			size_t len;
+			while(!cancelled() && gz.next(data, len))
+			{
+				const char *first = static_cast<const char*>(memchr(data, '\n', len));
+				if(first == NULL)
+				{
+					carry.append(data, len);
+					gz.release();
+					continue;
+				}
+				const char *last = static_cast<const char*>(memrchr(data, '\n', len));
+
+				carry.append(data, first + 1 - data);
+				parseRange(chunks[0], carry.data(), carry.data() + carry.size());
+				parseRange(chunks[0], first + 1, last + 1);
+				carry.assign(last + 1, data + len);
+				gz.release();
+				if(progress && progress->bytes > progress->total) progress->total = progress->bytes.load();
+			}
+			parseRange(chunks[0], carry.data(), carry.data() + carry.size());
+			if(progress && progress->bytes > progress->total) progress->total = progress->bytes.load();
+			if(!gz.ok() || cancelled()) return false;
+
+			buildMesh(chunks, pmesh);
+			return true;
+		}
 
-		static TokenPair tokenMap[];
+		// Uncompressed size from the ISIZE field that ends a gzip file
+		static size_t gzipSize(const char *path)
+		{
+			MappedFile file(path);
+			if(!file.isOpen() || file.size() < 18) return 0;
+			const unsigned char *p = reinterpret_cast<const unsigned char*>(file.data() + file.size() - 4);
+			return (size_t)p[0] | (size_t)p[1] << 8 | (size_t)p[2] << 16 | (size_t)p[3] << 24;
+		}
 
-		static char TOK_SEPS[];
+		// Appends the records in [begin, end) to a chunk that is being
+		// parsed piece by piece
+		void parseRange(ObjChunk &c, const char *begin, const char *end)
+		{
+			c.begin = begin;
+			c.end   = end;
+			parseChunk(c);
+		}
 
-		TokenPair *tokenMatch(char *srchtok)
+		// Material libraries are looked up next to the OBJ file
+		void setMaterialDir(const char *objfile)
 		{
-			if(!srchtok) return 0;
-			TokenPair *ptokp = &tokenMap[0];
-			for(; *ptokp != EMPTY_PAIR && strcmp(ptokp->strval,srchtok) != 0; ptokp++);
-			if(*ptokp == EMPTY_PAIR) ptokp = 0;
-			return ptokp;
+			const char *slash = strrchr(objfile, '/');
+			mtlDir = slash ? std::string(objfile, slash + 1) : std::string();
+		}
+
+		// Stitches parsed chunks into the mesh in file order, or in material
+		// order when the file has groups or materials
+		void buildMesh(std::vector<ObjChunk> &chunks, Trimesh *pmesh)
+		{
+			std::vector<Material> materials;
+			std::vector<Submesh>  submeshes;
+			groupFaces(chunks, materials, submeshes);
+			for(const Material &m : materials)
+				pmesh->addMaterial(m);
+			for(const Submesh &sm : submeshes)
+				pmesh->addSubmesh(sm.name, sm.material, sm.first, sm.count);
+
+			size_t nverts = 0, nfaces = 0;
+			for(ObjChunk &c : chunks)
+			{
+				nverts += c.verts.size() / 3;
+				nfaces += c.tris.size() / 3;
+			}
+
+			// Which attributes every corner has decides what becomes part
+			// of a vertex. Normals are only taken from the file when all
+			// corners have one, otherwise they are computed as before.
+			bool allNormals = nfaces > 0, allTexcoords = nfaces > 0;
+			for(ObjChunk &c : chunks)
+			{
+				bool hasAttrs = c.hasAttrs || c.tris.empty();
+				for(size_t i = 0; i < c.attrs.size() && (allNormals || allTexcoords); i += 2)
+				{
+					allTexcoords &= c.attrs[i] >= 0;
+					allNormals   &= c.attrs[i + 1] >= 0;
+				}
+				allNormals   &= hasAttrs;
+				allTexcoords &= hasAttrs;
+			}
+
+			if(allNormals || allTexcoords)
+			{
+				buildIndexed(chunks, pmesh, nverts, nfaces, allNormals, allTexcoords);
+			}
+			else
+			{
+				pmesh->reserve(nverts, nfaces);
+				for(ObjChunk &c : chunks)
+					pmesh->addVertices(c.verts.data(), c.verts.size() / 3);
+				for(ObjChunk &c : chunks)
+					pmesh->addFaces(c.tris.data(), c.tris.size() / 3);
+			}
 		}
 
-		void loadOBJ(const char *objfile, Trimesh *pmesh)
+		// Turns every distinct (position, texcoord, normal) corner into one
+		// vertex, in order of first use, and re-indexes the faces. The first
+		// tuple seen at each position is found through a flat table, only
+		// positions used with several tuples go through the hash map.
+		void buildIndexed(std::vector<ObjChunk> &chunks, Trimesh *pmesh, size_t nverts, size_t nfaces,
+		                  bool useNormals, bool useTexcoords)
 		{
-			std::ifstream ifs;
-			char line[LINE_SIZE];
-			char *tok;
-			ifs.open(objfile);
-			while(!ifs.eof())
+			std::vector<float> verts, normals, texcoords;
+			verts.reserve(nverts * 3);
+			for(ObjChunk &c : chunks)
+			{
+				verts.insert(verts.end(), c.verts.begin(), c.verts.end());
+				normals.insert(normals.end(), c.normals.begin(), c.normals.end());
+				texcoords.insert(texcoords.end(), c.texcoords.begin(), c.texcoords.end());
+			}
+
+			std::vector<int> first(nverts, -1);
+			std::vector<ObjCorner> made;
+			std::unordered_map<ObjCorner, int, ObjCornerHash> others;
+			made.reserve(nverts);
+			pmesh->reserve(nverts, nfaces);
+			pmesh->setFileNormals(useNormals);
+
+			for(ObjChunk &c : chunks)
 			{
-				ifs.getline(line, LINE_SIZE);
-				tok = strtok(line, TOK_SEPS);
-				TokenPair *ptokp = tokenMatch(tok);
-				if(ptokp)
+				int tri[3];
+				for(size_t i = 0; i < c.tris.size(); ++i)
 				{
-					switch(ptokp->tokID)
+					ObjCorner key = { c.tris[i],
+					                  useTexcoords ? c.attrs[2 * i] : -1,
+					                  useNormals ? c.attrs[2 * i + 1] : -1 };
+					int *slot = &first[key.v];
+					if(*slot >= 0 && !(made[*slot] == key))
 					{
-						case T_VERT    : processVertex(tok, pmesh); break;
-						case T_FACE    : processFace(tok, pmesh); break;
-						default: processSkip(tok); break;
+						std::pair<std::unordered_map<ObjCorner, int, ObjCornerHash>::iterator, bool> ins =
+							others.insert(std::make_pair(key, -1));
+						slot = &ins.first->second;
 					}
+					if(*slot < 0)
+					{
+						*slot = made.size();
+						made.push_back(key);
+						pmesh->addVertex(&verts[3 * key.v], useNormals ? &normals[3 * key.n] : NULL);
+						if(useTexcoords) pmesh->addTexcoord(&texcoords[2 * key.t]);
+					}
+					tri[i % 3] = *slot;
+					if(i % 3 == 2) pmesh->addFace(tri);
 				}
 			}
-			ifs.close();
 		}
 
-		int readFloats(char *tok, float *buf, int bufsz)
+		// Sorts the triangles by material, keeping file order within each
+		// material, so a material can be drawn in one batch. Runs of one
+		// group and material become submeshes. The sorted triangles all go
+		// to the first chunk. Files without g, o or usemtl are left alone.
+		void groupFaces(std::vector<ObjChunk> &chunks, std::vector<Material> &materials,
+		                std::vector<Submesh> &submeshes)
 		{
-			int i = 0;
-			while((tok = strtok(0, TOK_SEPS)) != 0 && i < bufsz)
-				buf[i++] = atof(tok);
-			return i;
+			bool grouped = false, anyAttrs = false;
+			size_t ntris = 0;
+			for(ObjChunk &c : chunks)
+			{
+				grouped  |= !c.switches.empty();
+				anyAttrs |= c.hasAttrs;
+				ntris    += c.tris.size() / 3;
+			}
+			if(!grouped) return;
+
+			std::map<std::string, Material> library;
+			for(ObjChunk &c : chunks)
+				for(const std::string &lib : c.mtllibs)
+					loadMTL((lib[0] == '/' ? lib : mtlDir + lib).c_str(), library);
+
+			// Material and group of every triangle in file order, and the
+			// triangles themselves gathered from all chunks
+			std::unordered_map<std::string, int> matIds, groupIds;
+			std::vector<std::string> groups;
+			std::vector<int> triMat, triGroup, tris, attrs;
+			triMat.reserve(ntris);
+			triGroup.reserve(ntris);
+			tris.reserve(3 * ntris);
+			if(anyAttrs) attrs.reserve(6 * ntris);
+			int mat = -1, group = -1;
+			for(ObjChunk &c : chunks)
+			{
+				size_t k = 0, n = c.tris.size() / 3;
+				for(const ObjSwitch &sw : c.switches)
+				{
+					for(; k < sw.tri; ++k)
+					{
+						triMat.push_back(mat);
+						triGroup.push_back(group);
+					}
+					if(sw.kind == T_USEMTL)
+					{
+						std::pair<std::unordered_map<std::string, int>::iterator, bool> ins =
+							matIds.insert(std::make_pair(sw.name, (int)materials.size()));
+						if(ins.second)
+						{
+							std::map<std::string, Material>::iterator it = library.find(sw.name);
+							Material m = it != library.end() ? it->second : Material();
+							m.name = sw.name;
+							materials.push_back(m);
+						}
+						mat = ins.first->second;
+					}
+					else
+					{
+						std::pair<std::unordered_map<std::string, int>::iterator, bool> ins =
+							groupIds.insert(std::make_pair(sw.name, (int)groups.size()));
+						if(ins.second) groups.push_back(sw.name);
+						group = ins.first->second;
+					}
+				}
+				for(; k < n; ++k)
+				{
+					triMat.push_back(mat);
+					triGroup.push_back(group);
+				}
+				tris.insert(tris.end(), c.tris.begin(), c.tris.end());
+				if(c.hasAttrs)
+					attrs.insert(attrs.end(), c.attrs.begin(), c.attrs.end());
+				else if(anyAttrs)
+					attrs.resize(attrs.size() + 2 * c.tris.size(), -1);
+			}
+
+			// Stable counting sort on the material, the default (-1) first
+			std::vector<size_t> next(materials.size() + 2, 0);
+			for(size_t t = 0; t < ntris; ++t)
+				next[triMat[t] + 2]++;
+			for(size_t m = 1; m < next.size(); ++m)
+				next[m] += next[m - 1];
+			std::vector<size_t> order(ntris);
+			for(size_t t = 0; t < ntris; ++t)
+				order[next[triMat[t] + 1]++] = t;
+
+			ObjChunk &first = chunks[0];
+			first.tris.resize(3 * ntris);
+			first.attrs.resize(anyAttrs ? 6 * ntris : 0);
+			first.hasAttrs = anyAttrs;
+			for(size_t i = 0; i < ntris; ++i)
+			{
+				size_t t = order[i];
+				memcpy(&first.tris[3 * i], &tris[3 * t], 3 * sizeof(int));
+				if(anyAttrs) memcpy(&first.attrs[6 * i], &attrs[6 * t], 6 * sizeof(int));
+			}
+			for(size_t i = 1; i < chunks.size(); ++i)
+			{
+				chunks[i].tris.clear();
+				chunks[i].attrs.clear();
+				chunks[i].hasAttrs = false;
+			}
+
+			for(size_t i = 0; i < ntris; )
+			{
+				size_t j = i + 1;
+				int m = triMat[order[i]], g = triGroup[order[i]];
+				while(j < ntris && triMat[order[j]] == m && triGroup[order[j]] == g) j++;
+				Submesh sm = { g >= 0 ? groups[g] : std::string("default"), m, (int)i, (int)(j - i) };
+				submeshes.push_back(sm);
+				i = j;
+			}
+		}
+
+		// Reads the colors of every newmtl in an .mtl file into library
+		void loadMTL(const char *path, std::map<std::string, Material> &library)
+		{
+			MappedFile file(path);
+			if(!file.isOpen())
+			{
+				std::cout << "Warning: could not open material library " << path << std::endl;
+				return;
+			}
+			ObjScanner sc(file.data(), file.data() + file.size());
+			Material *m = NULL;
+			while(!sc.done())
+			{
+				const char *tok = sc.pop();
+				if(sc.isLineEnd(tok)) continue;
+				std::string key(tok, sc.tokenEnd(tok));
+				if(key == "newmtl")
+				{
+					std::string name = readName(sc);
+					m = &library[name];
+					m->name = name;
+				}
+				else if(m != NULL)
+				{
+					float v[3] = { 0.0f, 0.0f, 0.0f };
+					int n = readFloats(sc, v, 3);
+					if(n == 1) v[1] = v[2] = v[0];
+					if(key == "Ka")      memcpy(m->ambient, v, sizeof(v));
+					else if(key == "Kd") memcpy(m->diffuse, v, sizeof(v));
+					else if(key == "Ks") memcpy(m->specular, v, sizeof(v));
+					else if(key == "Ns") m->shininess = v[0] < 128.0f ? v[0] : 128.0f;
+					else if(key == "d")  m->diffuse[3] = v[0];
+					else if(key == "Tr") m->diffuse[3] = 1.0f - v[0];
+				}
+				sc.skipLine();
+			}
+		}
+
+		void splitChunks(const char *begin, const char *end, int nthreads, std::vector<ObjChunk> &chunks)
+		{
+			size_t size = end - begin;
+			size_t n = size / MIN_CHUNK_SIZE;
+			if(n > (size_t)nthreads) n = nthreads;
+			if(n < 1) n = 1;
+
+			const char *p = begin;
+			for(size_t i = 1; i <= n && p < end; ++i)
+			{
+				const char *q = i == n ? end : begin + size * i / n;
+				if(q < p) q = p;
+				const char *eol = static_cast<const char*>(memchr(q, '\n', end - q));
+				q = eol ? eol + 1 : end;
+
+				ObjChunk c;
+				c.begin = p;
+				c.end   = q;
+				chunks.push_back(c);
+				p = q;
+			}
+		}
+
+		// Runs one pass over every chunk, a thread per chunk
+		void runChunks(std::vector<ObjChunk> &chunks, void (TrimeshLoader::*pass)(ObjChunk &))
+		{
+			if(chunks.size() == 1)
+			{
+				(this->*pass)(chunks[0]);
+				return;
+			}
+			std::vector<std::thread> workers;
+			for(size_t i = 1; i < chunks.size(); ++i)
+				workers.push_back(std::thread(pass, this, std::ref(chunks[i])));
+			(this->*pass)(chunks[0]);
+			for(std::thread &t : workers)
+				t.join();
 		}
 
-		int readInts(char *tok, int *buf, int bufsz)
+		// Pre-pass over a chunk: the number of vertices and the number of
+		// triangles its faces will fan out into
+		void countRecords(ObjChunk &c)
+		{
+			ObjScanner sc(c.begin, c.end);
+			for(size_t lines = 1; !sc.done(); ++lines)
+			{
+				if(lines % PROGRESS_LINES == 0 && cancelled()) return;
+				const char *tok = sc.pop();
+				switch(tokenMatch(tok, sc.tokenEnd(tok)))
+				{
+					case T_VERT     : c.nverts++; break;
+					case T_NORMAL   : c.nnormals++; break;
+					case T_TEXCOORD : c.ntexcoords++; break;
+					case T_FACE     :
+					{
+						int cnt = 0;
+						for(; !sc.atLineEnd(); sc.pop()) cnt++;
+						if(cnt >= 3) c.nfaces += cnt - 2;
+						break;
+					}
+					default: break;
+				}
+				if(!sc.isLineEnd(tok)) sc.skipLine();
+			}
+		}
+
+		void parseChunk(ObjChunk &c)
+		{
+			c.verts.reserve(c.nverts * 3);
+			c.tris.reserve(c.nfaces * 3);
+			ObjScanner sc(c.begin, c.end);
+			const char *reported = c.begin;
+			size_t trisReported = c.tris.size() / 3;
+			for(size_t lines = 1; !sc.done(); ++lines)
+			{
+				processLine(sc, c);
+				if(progress && lines % PROGRESS_LINES == 0)
+				{
+					if(progress->cancel) return;
+					report(sc.position(), c, reported, trisReported);
+				}
+			}
+			if(progress) report(c.end, c, reported, trisReported);
+		}
+
+		// Adds what was parsed since the last report to the shared counters
+		void report(const char *at, ObjChunk &c, const char *&reported, size_t &trisReported)
+		{
+			size_t tris = c.tris.size() / 3;
+			progress->bytes += at - reported;
+			progress->tris  += tris - trisReported;
+			reported     = at;
+			trisReported = tris;
+		}
+
+		// Parses one record, consuming its line. Unknown records are skipped.
+		void processLine(ObjScanner &sc, ObjChunk &c)
+		{
+			const char *tok = sc.pop();
+			if(sc.isLineEnd(tok)) return;
+			TokenID id = tokenMatch(tok, sc.tokenEnd(tok));
+			switch(id)
+			{
+				case T_VERT     : processVertex(sc, c); break;
+				case T_NORMAL   : processNormal(sc, c); break;
+				case T_TEXCOORD : processTexcoord(sc, c); break;
+				case T_FACE     : processFace(sc, c); break;
+				case T_GROUP    :
+				case T_OBJECT   :
+				case T_USEMTL   : processSwitch(sc, c, id); break;
+				case T_MTLLIB   : c.mtllibs.push_back(readName(sc)); break;
+				default: break;
+			}
+			sc.skipLine();
+		}
+
+		// Token readers consume tokens up to the end of the line. A token
+		// that fails to parse reads as zero, as atof/atoi used to.
+		int readFloats(ObjScanner &sc, float *buf, int bufsz)
 		{
 			int i = 0;
-			while((tok = strtok(0, TOK_SEPS)) != 0 && i < bufsz)
-				buf[i++] = atoi(tok);
+			while(i < bufsz && !sc.atLineEnd())
+				ObjScanner::decodeFloat(sc.pop(), sc.end(), buf[i++]);
 			return i;
 		}
 
-		void processSkip(char *tok)
-		{}
+		// Reads v, v/vt, v//vn or v/vt/vn corners, absent indices read as 0
+		int readCorners(ObjScanner &sc, std::vector<ObjCorner> &buf)
+		{
+			buf.clear();
+			const char *end = sc.end();
+			while(!sc.atLineEnd())
+			{
+				ObjCorner k = { 0, 0, 0 };
+				const char *p = ObjScanner::decodeInt(sc.pop(), end, k.v);
+				if(p < end && *p == '/')
+				{
+					p = ObjScanner::decodeInt(p + 1, end, k.t);
+					if(p < end && *p == '/')
+						ObjScanner::decodeInt(p + 1, end, k.n);
+				}
+				buf.push_back(k);
+			}
+			return buf.size();
+		}
+
+		// The rest of the line, inner whitespace kept
+		std::string readName(ObjScanner &sc)
+		{
+			const char *first = NULL, *last = NULL;
+			while(!sc.atLineEnd())
+			{
+				const char *tok = sc.pop();
+				if(first == NULL) first = tok;
+				last = sc.tokenEnd(tok);
+			}
+			return first ? std::string(first, last) : std::string();
+		}
+
+		void processSwitch(ObjScanner &sc, ObjChunk &c, TokenID kind)
+		{
+			ObjSwitch sw = { c.tris.size() / 3, kind, readName(sc) };
+			c.switches.push_back(sw);
+		}
 
 
-		void processVertex(char *tok, Trimesh *pmsh)
+		void processVertex(ObjScanner &sc, ObjChunk &c)
 		{
 			float values[3];
-			int cnt = readFloats(tok, values, 3);
-			if(cnt >= 3) pmsh->addVertex(values);
+			int cnt = readFloats(sc, values, 3);
+			if(cnt >= 3) c.verts.insert(c.verts.end(), values, values + 3);
 		}
 
-		bool processFace(char *tok, Trimesh *pmsh)
+		void processNormal(ObjScanner &sc, ObjChunk &c)
 		{
-			int ids[256]; 
-			int cnt = readInts(tok, ids, 256);
-			if(cnt >= 3) {
-				int tri[3] = { ids[0] - 1, ids[1] - 1, ids[2] - 1 };
-			    pmsh->addFace(tri);
-				for(int i = 3; i < cnt; ++i)
+			float values[3] = { 0.0f, 0.0f, 0.0f };
+			readFloats(sc, values, 3);
+			c.normals.insert(c.normals.end(), values, values + 3);
+		}
+
+		// Only u and v are kept, a missing v reads as zero
+		void processTexcoord(ObjScanner &sc, ObjChunk &c)
+		{
+			float values[2] = { 0.0f, 0.0f };
+			readFloats(sc, values, 2);
+			c.texcoords.insert(c.texcoords.end(), values, values + 2);
+		}
+
+		// OBJ indices are 1-based, negative indices count back from the
+		// most recently read vertex
+		bool resolveIndex(int id, int nverts, int &out)
+		{
+			out = id > 0 ? id - 1 : nverts + id;
+			return id != 0 && out >= 0 && out < nverts;
+		}
+
+		// Resolves an optional texture or normal index to -1 when absent
+		bool resolveAttr(int id, int count, int &out)
+		{
+			if(id == 0)
+			{
+				out = -1;
+				return true;
+			}
+			return resolveIndex(id, count, out);
+		}
+
+		bool processFace(ObjScanner &sc, ObjChunk &c)
+		{
+			std::vector<ObjCorner> &ids = c.corners;
+			int cnt = readCorners(sc, ids);
+			if(cnt < 3) return true;
+
+			int nverts     = c.vertBase + c.verts.size() / 3;
+			int nnormals   = c.normBase + c.normals.size() / 3;
+			int ntexcoords = c.texBase + c.texcoords.size() / 2;
+			bool hasAttrs  = false;
+			for(int i = 0; i < cnt; ++i)
+			{
+				ObjCorner &k = ids[i];
+				if(!resolveIndex(k.v, nverts, k.v) ||
+				   !resolveAttr(k.t, ntexcoords, k.t) ||
+				   !resolveAttr(k.n, nnormals, k.n)) return false;
+				hasAttrs |= k.t >= 0 || k.n >= 0;
+			}
+
+			// Start recording attributes at the first face that has any
+			if(hasAttrs && !c.hasAttrs)
+			{
+				c.hasAttrs = true;
+				c.attrs.reserve(c.nfaces * 6);
+				c.attrs.resize(c.tris.size() * 2, -1);
+			}
+
+			// Fan triangulation around the first vertex
+			for(int i = 2; i < cnt; ++i)
+			{
+				const ObjCorner *tri[3] = { &ids[0], &ids[i - 1], &ids[i] };
+				for(int j = 0; j < 3; ++j)
 				{
-					tri[1] = tri[2];
-					tri[2] = ids[i] - 1;
-					pmsh->addFace(tri);
+					c.tris.push_back(tri[j]->v);
+					if(c.hasAttrs)
+					{
+						c.attrs.push_back(tri[j]->t);
+						c.attrs.push_back(tri[j]->n);
+					}
 				}
-            }
+			}
 			return true;
 		}
-};
 
-TokenPair TrimeshLoader::EMPTY_PAIR={"",T_NONE};
+	private:
 
-TokenPair TrimeshLoader::tokenMap[] = { 
-	{"v", T_VERT}, {"f",T_FACE}, 
-	EMPTY_PAIR
+		LoadProgress *progress;
+		std::string mtlDir;
 };
 
-char TrimeshLoader::TOK_SEPS[] = " \t";
 #endif
@@ -0,0 +1,102 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __LOADPOOL_H__
+#define __LOADPOOL_H__
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+// Worker threads shared by all background loads, one per core, so importing
+// hundreds of files does not start hundreds of threads. Jobs run in the
+// order they were submitted.
+//
+// A job that could use several threads itself asks threadsPerJob() how
+// many, so a batch of jobs does not start a thread per core each.
+class LoadPool {
+
+    private:
+
+        std::mutex lock;
+        std::condition_variable wake;
+        std::deque<std::function<void()> > jobs;
+        std::vector<std::thread> workers;
+
+        // Jobs taken by a worker and not finished yet
+        size_t running = 0;
+
+        // Set on the pool's own threads
+        static bool &onWorker() {
+            thread_local bool on = false;
+            return on;
+        }
+
+        LoadPool(int n) {
+            for(int i = 0; i < n; ++i) {
+                workers.push_back(std::thread([this] { run(); }));
+            }
+        }
+
+        void run() {
+            onWorker() = true;
+            for(;;) {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> l(lock);
+                    wake.wait(l, [this] { return !jobs.empty(); });
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                    running++;
+                }
+                job();
+                std::lock_guard<std::mutex> l(lock);
+                running--;
+            }
+        }
+
+    public:
+
+        // Never destroyed, the workers end with the process instead of
+        // holding up exit until their loads finish
+        static LoadPool &instance() {
+            static LoadPool *pool = new LoadPool(cores());
+            return *pool;
+        }
+
+        static int cores() {
+            int n = std::thread::hardware_concurrency();
+            return n > 0 ? n : 1;
+        }
+
+        // Threads the calling thread may use for one job: every core off
+        // the pool, and on a worker its share of the cores among the jobs
+        // running and waiting, at least 1
+        static int threadsPerJob() {
+            if(!onWorker()) {
+                return cores();
+            }
+            LoadPool &pool = instance();
+            std::lock_guard<std::mutex> l(pool.lock);
+            size_t busy = std::max((size_t)1, pool.running + pool.jobs.size());
+            return std::max(1, (int)(cores() / busy));
+        }
+
+        void submit(std::function<void()> job) {
+            {
+                std::lock_guard<std::mutex> l(lock);
+                jobs.push_back(std::move(job));
+            }
+            wake.notify_one();
+        }
+
+        int size() const {
+            return workers.size();
+        }
+};
+
+#endif
@@ -0,0 +1,221 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __LOD_H__
+#define __LOD_H__
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "geom.h"
+#include "simplify.h"
+#include "meshcache.h"
+#include "loadpool.h"
+#include "reorder.h"
+
+// Fewest faces a level is simplified down to. Meshes with fewer than twice
+// as many get no levels.
+#define LOD_MIN_FACES 1024
+
+// Most levels below the full mesh
+#define LOD_MAX_LEVELS 12
+
+// One level of detail and how far it strays from the full mesh, in the
+// units of the mesh's positions
+struct LodLevel {
+    MeshHandle mesh;
+    float error;
+};
+
+// The full mesh and its simplified levels, each about half the faces of
+// the one before. The levels are built on the load pool after the chain is
+// made and show up one by one, finest first; until then the coarsest one
+// so far is drawn in their place. Chains are shared by every node drawing
+// the same mesh.
+//
+// Each frame select() picks the coarsest level whose error, projected at
+// the mesh's distance, stays under pixelError() pixels.
+class LodChain {
+
+    private:
+
+        mutable std::mutex lock;
+        std::vector<LodLevel> levels;
+        MeshHandle full;
+        float center[3], radius;
+
+        static std::mutex &registryLock() {
+            static std::mutex lock;
+            return lock;
+        }
+
+        static std::map<const Trimesh*, std::weak_ptr<LodChain> > &registry() {
+            static std::map<const Trimesh*, std::weak_ptr<LodChain> > chains;
+            return chains;
+        }
+
+        // Screen pixels per radian of the current camera
+        static float &pixelsPerRadian() {
+            static float ppr = 0.0f;
+            return ppr;
+        }
+
+        // Adds the levels of mesh to chain one by one, stopping when the
+        // chain is released or there are no more levels
+        static void build(std::weak_ptr<LodChain> chain, MeshHandle mesh) {
+            MeshSimplifier s(mesh.get());
+            size_t faces = mesh->numFaces();
+            for(int i = 0; i < LOD_MAX_LEVELS && !chain.expired(); ++i) {
+                Trimesh *level = nextLevel(s, faces);
+                if(level == NULL) {
+                    return;
+                }
+                faces = level->numFaces();
+                LodLevel l = { MeshHandle(level), s.error() };
+                std::shared_ptr<LodChain> c = chain.lock();
+                if(c == NULL) {
+                    return;
+                }
+                std::lock_guard<std::mutex> g(c->lock);
+                c->levels.push_back(l);
+            }
+        }
+
+    public:
+
+        // The level after one of faces faces, simplified by s to about half
+        // as many and reordered for the vertex cache, or NULL if it would
+        // go under LOD_MIN_FACES or not be much smaller. Its error is
+        // s.error() until s simplifies again.
+        static Trimesh *nextLevel(MeshSimplifier &s, size_t faces) {
+            if(faces / 2 < LOD_MIN_FACES || !s.simplify(faces / 2) || s.numFaces() > faces * 9 / 10) {
+                return NULL;
+            }
+            Trimesh *level = s.build();
+            FaceReorder().apply(level);
+            return level;
+        }
+
+        LodChain(MeshHandle mesh) : full(mesh) {
+            LodLevel l = { mesh, 0.0f };
+            levels.push_back(l);
+            const float *b = mesh->getBounds();
+            float r2 = 0.0f;
+            for(int k = 0; k < 3; ++k) {
+                center[k] = (b[k] + b[k + 3]) / 2.0f;
+                r2 += (b[k + 3] - b[k]) * (b[k + 3] - b[k]) / 4.0f;
+            }
+            radius = sqrtf(r2);
+        }
+
+        // The chain of mesh, started on the load pool if no one holds it
+        static std::shared_ptr<LodChain> of(MeshHandle mesh) {
+            std::lock_guard<std::mutex> l(registryLock());
+            for(auto it = registry().begin(); it != registry().end(); ) {
+                if(it->second.expired()) {
+                    it = registry().erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            std::shared_ptr<LodChain> chain = registry()[mesh.get()].lock();
+            if(chain == NULL) {
+                chain = std::make_shared<LodChain>(mesh);
+                registry()[mesh.get()] = chain;
+                if(mesh->numFaces() >= 2 * LOD_MIN_FACES) {
+                    std::weak_ptr<LodChain> weak = chain;
+                    LoadPool::instance().submit([weak, mesh] { build(weak, mesh); });
+                }
+            }
+            return chain;
+        }
+
+        // Draws every mesh at full detail when off
+        static bool &enabled() {
+            static bool on = true;
+            return on;
+        }
+
+        // Largest error in pixels a level may show
+        static float &pixelError() {
+            static float pixels = 1.0f;
+            return pixels;
+        }
+
+        // Fraction of pixelError() a coarser level must stay below before
+        // it replaces the one drawn, so a mesh near the limit does not
+        // switch back and forth every frame
+        static float &hysteresis() {
+            static float h = 0.25f;
+            return h;
+        }
+
+        // Call with the camera's vertical field of view in degrees after
+        // setting the viewport
+        static void setView(float fov) {
+            GLint vp[4];
+            glGetIntegerv(GL_VIEWPORT, vp);
+            pixelsPerRadian() = vp[3] / (2.0f * tanf(fov * (float)M_PI / 360.0f));
+        }
+
+        MeshHandle base() const { return full; }
+
+        size_t numLevels() const {
+            std::lock_guard<std::mutex> l(lock);
+            return levels.size();
+        }
+
+        LodLevel level(size_t i) const {
+            std::lock_guard<std::mutex> l(lock);
+            return levels[std::min(i, levels.size() - 1)];
+        }
+
+        // Screen pixels one unit of a mesh covers at the distance of the
+        // sphere around it under the current modelview matrix, or 0 when
+        // the eye is inside the sphere or no camera has been set
+        static float pixelsPerUnit(const float *center, float radius) {
+            if(pixelsPerRadian() <= 0.0f) {
+                return 0.0f;
+            }
+            float mv[16];
+            glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+            float eye[3], scale = 0.0f;
+            for(int k = 0; k < 3; ++k) {
+                eye[k] = mv[k] * center[0] + mv[4 + k] * center[1] + mv[8 + k] * center[2] + mv[12 + k];
+                scale = std::max(scale, sqrtf(mv[4 * k] * mv[4 * k] + mv[4 * k + 1] * mv[4 * k + 1] +
+                                              mv[4 * k + 2] * mv[4 * k + 2]));
+            }
+            // Distance to the nearest point of the sphere
+            float dist = sqrtf(eye[0] * eye[0] + eye[1] * eye[1] + eye[2] * eye[2]) - scale * radius;
+            return dist > 0.0f ? scale * pixelsPerRadian() / dist : 0.0f;
+        }
+
+        // The level to draw under the current modelview matrix, given the
+        // level drawn last. Levels up to current are kept while their
+        // error projects to at most pixelError(); coarser ones must stay
+        // under (1 - hysteresis()) of it.
+        size_t select(size_t current) const {
+            std::lock_guard<std::mutex> l(lock);
+            float perUnit = pixelsPerUnit(center, radius);
+            if(!enabled() || levels.size() < 2 || perUnit <= 0.0f) {
+                return 0;
+            }
+            float limit = pixelError(), strict = limit * (1.0f - hysteresis());
+            size_t pick = 0;
+            for(size_t i = 1; i < levels.size(); ++i) {
+                if(levels[i].error * perUnit <= (i > current ? strict : limit)) {
+                    pick = i;
+                }
+            }
+            return pick;
+        }
+};
+
+#endif
@@ -5,6 +5,8 @@
 #include <GL/glut.h>
 #include <iostream>
 #include <string>
+#include <cstdio>
+#include <cstring>
 
 #include "scenegraph.h"
 #include "src/include/GL/glui.h"
@@ -17,7 +19,10 @@ enum {
     ID_SELECT_CHILD,
     ID_SELECT_PARENT,
     ID_ADD_CHILD,
-    ID_DELETE_CHILD
+    ID_DELETE_CHILD,
+    ID_IMPORT_SCENE,
+    ID_IMPORT_FILES,
+    ID_EXPORT_SCENE
 };
 
 SceneGraph *sg;
@@ -28,10 +33,23 @@ GLUI *glui, *panel_transform;
 GLUI_Panel *panel_geom, *panel_attr, *panel_camera;
 GLUI_Listbox *childList;
 GLUI_StaticText *selectedNodeName;
+GLUI_StaticText *loadStatus;
+GLUI_Button *loadButton;
 
 // GLUI live variables
 char filename[128];
+char savename[128];
+char scenefile[128];
 int renderMode = MODE_LIT;
+int pageBudget = CHUNK_BUDGET_MB;
+int useBuffers = 1;
+int cullMeshlets = 1;
+float creaseAngle = 30.0f;
+int useLod = 1;
+float lodPixels = 1.0f;
+float lodHysteresis = 0.25f;
+int weldVertices = 0;
+float weldEpsilon = 0.0f;
 int showFaceNormals = 0;
 int showVertNormals = 0;
 
@@ -58,12 +76,70 @@ void reshape(int w, int h) {
     GLUI_Master.auto_set_viewport();
 }
 
+// Shows the progress of a background load of the selected object's geometry
+void updateLoadStatus() {
+    static std::string shown;
+    std::string text;
+    bool loading = false;
+
+    SGNode *n = sg->getCurrent();
+    if(n->getNodeType() == NODE_OBJECT && static_cast<ObjectNode*>(n)->geom != NULL) {
+        GeometryNode *g = static_cast<ObjectNode*>(n)->geom;
+        char buf[64];
+        if(g->isLoading()) {
+            const LoadProgress &p = g->getProgress();
+            if(p.total > 0) {
+                snprintf(buf, sizeof(buf), "%.1f/%.1f MB, %zu tris", p.bytes / 1e6, p.total / 1e6, p.tris.load());
+            } else {
+                snprintf(buf, sizeof(buf), "%.1f MB, %zu tris", p.bytes / 1e6, p.tris.load());
+            }
+            text = buf;
+            loading = true;
+        } else if(g->getModel() != NULL && g->getLevel() > 0) {
+            snprintf(buf, sizeof(buf), "%d tris, LOD %zu/%zu: %d tris", g->getModel()->numFaces(),
+                     g->getLevel(), g->numLevels() - 1, g->getDrawn()->numFaces());
+            text = buf;
+        } else if(g->getModel() != NULL) {
+            snprintf(buf, sizeof(buf), "%d tris", g->getModel()->numFaces());
+            text = buf;
+        } else if(g->getPaged() != NULL) {
+            const ChunkedMesh *m = g->getPaged();
+            snprintf(buf, sizeof(buf), "%zu tris, %zu/%zu chunks, %zu MB", m->numFaces(),
+                     m->numResident(), m->numChunks(), ChunkedMesh::getResidentBytes() >> 20);
+            text = buf;
+        } else if(g->getProgressive() != NULL) {
+            const ProgressiveMesh *m = g->getProgressive();
+            snprintf(buf, sizeof(buf), "%zu/%zu tris, %zu%% read", m->numFaces(), m->maxFaces(),
+                     m->maxSplits() > 0 ? 100 * m->numAvailable() / m->maxSplits() : 100);
+            text = buf;
+        }
+        // Faces of the last draw outside the view or facing away
+        if(!loading && g->getModel() != NULL && g->getDrawn()->lastCull().faces > 0) {
+            const MeshletStats &c = g->getDrawn()->lastCull();
+            snprintf(buf, sizeof(buf), ", %zu%% culled", 100 - 100 * c.drawn / c.faces);
+            text += buf;
+        }
+    }
+    if(text != shown) {
+        shown = text;
+        loadStatus->set_text(text.c_str());
+        loadButton->set_name(loading ? "Cancel" : "Load File");
+    }
+}
+
 void idle() {
     glutSetWindow(main_window);
+    updateLoadStatus();
     glutPostRedisplay();
 }
 
 void display() {
+    Trimesh::useBuffers() = useBuffers != 0;
+    Trimesh::cullMeshlets() = cullMeshlets != 0;
+    Trimesh::creaseAngle() = creaseAngle;
+    LodChain::enabled() = useLod != 0;
+    LodChain::pixelError() = lodPixels;
+    LodChain::hysteresis() = lodHysteresis;
     sg->display();
     glFlush();
 }
@@ -178,6 +254,15 @@ void crud_cb(int id) {
         case ID_DELETE_CHILD:
             sg->deleteChild(childIdx);
             break;
+        case ID_IMPORT_SCENE:
+            sg->importGLB(std::string(scenefile));
+            break;
+        case ID_IMPORT_FILES:
+            sg->importFiles(std::string(scenefile));
+            break;
+        case ID_EXPORT_SCENE:
+            sg->exportScene(std::string(scenefile));
+            break;
     }
     readLiveVars(sg->getCurrent());
 }
@@ -188,7 +273,11 @@ void node_cb(int id) {
     switch(id) {
         case NODE_GEOM:
             o = static_cast<ObjectNode*>(sg->getCurrent());
-            o->geom->loadModel(std::string(filename));
+            if(o->geom->isLoading()) {
+                o->geom->cancelLoad();
+            } else {
+                o->geom->loadModelAsync(std::string(filename));
+            }
             break;
         case NODE_ATTR:
             o = static_cast<ObjectNode*>(sg->getCurrent());
@@ -216,6 +305,23 @@ void object_cb(int id) {
             delete o->attr;
             o->attr = NULL;
             break;
+        case 2:
+            // Never over the file in the load box, which is usually the
+            // model's own source
+            if(savename[0] == '\0' || strcmp(savename, filename) == 0) {
+                std::cout << "Error: enter a save path other than the load path" << std::endl;
+            } else if(o->geom->getModel() == NULL || !MeshExporter().save(std::string(savename), o->geom->getModel())) {
+                std::cout << "Error: could not write " << savename << std::endl;
+            }
+            break;
+        case 3:
+            if(pageBudget < 16) pageBudget = 16;
+            ChunkedMesh::setBudget((size_t)pageBudget << 20);
+            break;
+        case 4:
+            if(weldEpsilon < 0.0f) weldEpsilon = 0.0f;
+            MeshCache::setWeld(weldVertices ? weldEpsilon : -1.0f);
+            break;
     }
     readLiveVars(sg->getCurrent());
 }
@@ -273,6 +379,33 @@ int main(int argc, char *argv[]) {
     new GLUI_Column( addOptions, false );
     new GLUI_Button( addOptions, "Add Child", ID_ADD_CHILD, crud_cb );
 
+    // Scene import, adds a .glb file's nodes or a directory of meshes as
+    // children
+    GLUI_Panel *importOptions = new GLUI_Panel( glui, "" );
+    glui->add_edittext_to_panel( importOptions, "Path: ", GLUI_EDITTEXT_TEXT, &scenefile );
+    new GLUI_Column( importOptions, false );
+    new GLUI_Button( importOptions, "Import glTF", ID_IMPORT_SCENE, crud_cb );
+    new GLUI_Button( importOptions, "Import Files", ID_IMPORT_FILES, crud_cb );
+    new GLUI_Button( importOptions, "Export Scene", ID_EXPORT_SCENE, crud_cb );
+
+    // Off draws every mesh through glBegin/glEnd, for comparison
+    new GLUI_Checkbox( glui, "Vertex Buffers", &useBuffers );
+
+    // Off draws every face of solid and lit meshes, for comparison
+    new GLUI_Checkbox( glui, "Cull Meshlets", &cullMeshlets );
+
+    // Angle between faces above which "Feature Edges" draws their edge
+    GLUI_Spinner *creaseSpinner = new GLUI_Spinner( glui, "Crease Angle: ", &creaseAngle );
+    creaseSpinner->set_float_limits( 0.0f, 180.0f );
+
+    // Simplified levels drawn for meshes whose error would stay under
+    // "LOD Pixels" on screen
+    new GLUI_Checkbox( glui, "Level of Detail", &useLod );
+    GLUI_Spinner *lodSpinner = new GLUI_Spinner( glui, "LOD Pixels: ", &lodPixels );
+    lodSpinner->set_float_limits( 0.0f, 100.0f );
+    GLUI_Spinner *hystSpinner = new GLUI_Spinner( glui, "LOD Hysteresis: ", &lodHysteresis );
+    hystSpinner->set_float_limits( 0.0f, 0.9f );
+
     new GLUI_StaticText( glui, "" );
 
     /*************************************************************************/
@@ -285,8 +418,14 @@ int main(int argc, char *argv[]) {
 
     // Geometry node options
     glui->add_edittext_to_panel( panel_geom, "Path: ", GLUI_EDITTEXT_TEXT, &filename );
+    loadStatus = new GLUI_StaticText( panel_geom, "" );
+    glui->add_edittext_to_panel( panel_geom, "Save as: ", GLUI_EDITTEXT_TEXT, &savename );
     new GLUI_Column( panel_geom, false );
-    new GLUI_Button( panel_geom, "Load File", NODE_GEOM, node_cb );
+    loadButton = new GLUI_Button( panel_geom, "Load File", NODE_GEOM, node_cb );
+    new GLUI_Button( panel_geom, "Save File", 2, object_cb );
+    new GLUI_Spinner( panel_geom, "Page MB: ", &pageBudget, 3, object_cb );
+    new GLUI_Checkbox( panel_geom, "Weld Vertices", &weldVertices, 4, object_cb );
+    new GLUI_Spinner( panel_geom, "Weld eps: ", &weldEpsilon, 4, object_cb );
     new GLUI_Button( panel_geom, "Delete Node", 0, object_cb );
 
     // Attribute node options
@@ -294,6 +433,7 @@ int main(int argc, char *argv[]) {
     attr_list->add_item(MODE_LIT, "Lit");
     attr_list->add_item(MODE_SOLID, "Solid");
     attr_list->add_item(MODE_WIRE, "Wireframe");
+    attr_list->add_item(MODE_FEATURE, "Feature Edges");
     attr_list->add_item(MODE_POINT, "Point");
   
     new GLUI_StaticText( panel_attr, "" );
@@ -0,0 +1,100 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __MAPFILE_H__
+#define __MAPFILE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A read-only memory mapping of an entire file. The mapping lives as long as
+// the object does, so parsers can work on the bytes in place.
+class MappedFile {
+
+    private:
+
+        int fd = -1;
+        const char *base = NULL;
+        size_t length = 0;
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+    public:
+
+        MappedFile() {}
+
+        MappedFile(const char *path) { open(path); }
+
+        ~MappedFile() { close(); }
+
+        bool open(const char *path) {
+            close();
+            fd = ::open(path, O_RDONLY);
+            if(fd < 0) {
+                return false;
+            }
+            struct stat st;
+            if(fstat(fd, &st) != 0) {
+                close();
+                return false;
+            }
+            length = st.st_size;
+
+            // mmap refuses zero-length mappings, an empty file is still valid
+            if(length == 0) {
+                base = "";
+                return true;
+            }
+            void *p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p == MAP_FAILED) {
+                close();
+                return false;
+            }
+            madvise(p, length, MADV_SEQUENTIAL);
+            base = static_cast<const char*>(p);
+            return true;
+        }
+
+        void close() {
+            if(base != NULL && length > 0) {
+                munmap(const_cast<char*>(base), length);
+            }
+            if(fd >= 0) {
+                ::close(fd);
+            }
+            fd = -1;
+            base = NULL;
+            length = 0;
+        }
+
+        bool isOpen() const { return base != NULL; }
+
+        const char *data() const { return base; }
+
+        size_t size() const { return length; }
+
+        // 64-bit content hash, eight bytes per step, for cache validation
+        uint64_t hash() const {
+            const uint64_t prime = 0x100000001b3ULL;
+            uint64_t h = 0xcbf29ce484222325ULL ^ length;
+            size_t i = 0;
+            for(; i + 8 <= length; i += 8) {
+                uint64_t w;
+                memcpy(&w, base + i, 8);
+                h = (h ^ w) * prime;
+                h ^= h >> 29;
+            }
+            for(; i < length; ++i) {
+                h = (h ^ (unsigned char)base[i]) * prime;
+            }
+            return h ^ (h >> 32);
+        }
+};
+
+#endif
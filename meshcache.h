@@ -0,0 +1,319 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __MESHCACHE_H__
+#define __MESHCACHE_H__
+
+#include <map>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <strings.h>
+#include <iostream>
+#include <sys/stat.h>
+
+#include "geom.h"
+#include "loader.h"
+#include "plyloader.h"
+#include "stlloader.h"
+#include "glbloader.h"
+#include "mapfile.h"
+#include "sidecar.h"
+#include "weld.h"
+#include "reorder.h"
+#include "loadpool.h"
+
+typedef std::shared_ptr<const Trimesh> MeshHandle;
+
+// File formats the cache can load
+enum MeshFormat {
+    FORMAT_OBJ,
+    FORMAT_PLY,
+    FORMAT_STL,
+    FORMAT_GLB
+};
+
+// Process-wide cache of loaded meshes. Files are identified by canonical
+// path and content hash, and every request for the same file gets a handle
+// to the same immutable mesh. The cache only holds weak references, so a
+// mesh is freed when the last node using it lets go of its handle.
+//
+// A request for a file that is already being loaded waits for that load
+// instead of starting another one.
+//
+// When welding is on (see setWeld), every mesh is welded after it is read.
+// The sidecar keeps the mesh as parsed, so changing the epsilon never
+// needs a fresh parse.
+class MeshCache {
+
+    private:
+
+        // Outcome of one load, shared by everyone waiting on it
+        struct Result {
+            MeshHandle mesh;
+            bool cancelled = false;
+        };
+
+        struct Entry {
+            uint64_t size  = 0;
+            int64_t  mtime = 0;
+            uint64_t hash  = 0;
+            bool     hashed = false;
+            float    weld  = -1.0f;
+            std::weak_ptr<const Trimesh> mesh;
+            std::shared_future<Result> pending;
+        };
+
+        std::mutex lock;
+        std::map<std::string, Entry> entries;
+
+        MeshCache() {}
+
+        // Weld epsilon, negative when welding is off
+        static float &weldEpsilon() {
+            static float eps = -1.0f;
+            return eps;
+        }
+
+        MeshCache(const MeshCache &) = delete;
+        MeshCache &operator=(const MeshCache &) = delete;
+
+        static std::string canonicalPath(const std::string &filename) {
+            char buf[PATH_MAX];
+            return realpath(filename.c_str(), buf) != NULL ? std::string(buf) : filename;
+        }
+
+        static int64_t mtimeOf(const struct stat &st) {
+            return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        }
+
+        static uint64_t contentHash(const std::string &path) {
+            MappedFile file(path.c_str());
+            return file.isOpen() ? file.hash() : 0;
+        }
+
+        static bool hasExtension(const std::string &filename, const char *ext) {
+            size_t n = strlen(ext);
+            return filename.size() >= n && strcasecmp(filename.c_str() + filename.size() - n, ext) == 0;
+        }
+
+        // Picks a loader from the leading bytes of the file, or from its
+        // extension when those are not conclusive
+        static MeshFormat detectFormat(const std::string &filename) {
+            MappedFile file(filename.c_str());
+            if(file.isOpen() && PlyLoader::isPLY(file.data(), file.size())) {
+                return FORMAT_PLY;
+            }
+            if(file.isOpen() && StlLoader::isSTL(file.data(), file.size())) {
+                return FORMAT_STL;
+            }
+            if(file.isOpen() && GlbFile::isGLB(file.data(), file.size())) {
+                return FORMAT_GLB;
+            }
+            if(hasExtension(filename, ".ply")) {
+                return FORMAT_PLY;
+            }
+            if(hasExtension(filename, ".stl")) {
+                return FORMAT_STL;
+            }
+            if(hasExtension(filename, ".glb")) {
+                return FORMAT_GLB;
+            }
+            return FORMAT_OBJ;
+        }
+
+        // Parses with up to nthreads threads, see LoadPool::threadsPerJob
+        static bool parse(const std::string &filename, Trimesh *mesh, LoadProgress *progress, int nthreads) {
+            switch(detectFormat(filename)) {
+                case FORMAT_PLY: return PlyLoader(progress).loadPLY(filename.c_str(), mesh);
+                case FORMAT_STL: return StlLoader(progress).loadSTL(filename.c_str(), mesh);
+                case FORMAT_GLB: {
+                    // The whole scene, flattened into one mesh
+                    GlbFile file;
+                    return file.open(filename.c_str()) && file.buildScene(mesh);
+                }
+                default:         return TrimeshLoader(progress).loadOBJ(filename.c_str(), mesh, nthreads);
+            }
+        }
+
+        // Parses a file from scratch, or from its sidecar when that is
+        // current. Faces are put in vertex cache order before the sidecar
+        // is written, so only the first load pays for it. The sidecar
+        // knows the content hash of the file, hashed is false when there
+        // was none to read or write.
+        static bool read(const std::string &filename, Trimesh *mesh, LoadProgress *progress, int nthreads,
+                         uint64_t &hash, bool &hashed) {
+            hashed = MeshSidecar::load(filename, mesh, &hash);
+            if(hashed) {
+                return true;
+            }
+            if(!parse(filename, mesh, progress, nthreads)) {
+                if(progress != NULL && progress->cancel) {
+                    std::cout << "Cancelled loading " << filename << std::endl;
+                } else {
+                    std::cout << "Error: could not open " << filename << std::endl;
+                }
+                return false;
+            }
+            FaceReorder(true).apply(mesh);
+            hashed = MeshSidecar::save(filename, mesh, &hash);
+            return true;
+        }
+
+        static void weld(const std::string &filename, Trimesh *mesh, float eps, int nthreads) {
+            WeldStats s;
+            if(MeshWelder(eps, nthreads).weld(mesh, &s)) {
+                std::cout << "Welded " << filename << ": " << s.vertsBefore << " -> " << s.vertsAfter
+                          << " vertices, " << s.facesBefore - s.facesAfter << " degenerate faces dropped, "
+                          << s.bytesBefore / 1024 << " -> " << s.bytesAfter / 1024 << " kB" << std::endl;
+                // Merged vertices are shared by more faces now
+                FaceReorder(true).apply(mesh);
+            }
+        }
+
+        // Waits for a load started by another request, giving up early if
+        // this request is cancelled
+        static bool wait(const std::shared_future<Result> &pending, LoadProgress *progress) {
+            while(pending.wait_for(std::chrono::milliseconds(10)) != std::future_status::ready) {
+                if(progress != NULL && progress->cancel) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Forgets files whose meshes have all been released
+        void prune() {
+            for(auto it = entries.begin(); it != entries.end(); ) {
+                if(!it->second.pending.valid() && it->second.mesh.expired()) {
+                    it = entries.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+    public:
+
+        // Whether a directory listing entry looks like something acquire()
+        // can load
+        static bool isMeshFile(const std::string &filename) {
+            return hasExtension(filename, ".obj") || hasExtension(filename, ".obj.gz") ||
+                   hasExtension(filename, ".ply") || hasExtension(filename, ".stl") ||
+                   hasExtension(filename, ".glb");
+        }
+
+        // Welds meshes read from now on, merging vertices closer than eps.
+        // A negative eps turns welding off.
+        static void setWeld(float eps) { weldEpsilon() = eps; }
+
+        static float getWeld() { return weldEpsilon(); }
+
+        static MeshCache &instance() {
+            static MeshCache cache;
+            return cache;
+        }
+
+        // Returns the mesh for filename, loading it if no one holds it yet.
+        // Null if the file cannot be loaded or progress->cancel is set.
+        MeshHandle acquire(const std::string &filename, LoadProgress *progress = NULL) {
+            std::string path = canonicalPath(filename);
+            float eps = weldEpsilon();
+            for(;;) {
+                std::promise<Result> promise;
+                std::shared_future<Result> pending;
+                {
+                    std::unique_lock<std::mutex> l(lock);
+                    prune();
+                    Entry &e = entries[path];
+                    if(e.pending.valid()) {
+                        pending = e.pending;
+                    } else {
+                        struct stat st;
+                        bool found = stat(path.c_str(), &st) == 0;
+                        MeshHandle mesh = e.mesh.lock();
+                        if(mesh != NULL && found && (uint64_t)st.st_size == e.size && e.weld == eps) {
+                            // Same size and mtime, or touched but unchanged.
+                            // The file is only hashed when its mtime moved,
+                            // and without a hash from the load it is read
+                            // again.
+                            if(mtimeOf(st) == e.mtime) {
+                                return mesh;
+                            }
+                            if(e.hashed) {
+                                l.unlock();
+                                uint64_t hash = contentHash(path);
+                                l.lock();
+                                if(e.pending.valid()) {
+                                    continue;
+                                }
+                                if(e.hashed && hash == e.hash) {
+                                    e.mtime = mtimeOf(st);
+                                    return mesh;
+                                }
+                            }
+                        }
+                        e.pending = promise.get_future().share();
+                    }
+                }
+
+                if(pending.valid()) {
+                    if(!wait(pending, progress)) {
+                        return NULL;
+                    }
+                    Result r = pending.get();
+                    if(r.cancelled && !(progress != NULL && progress->cancel)) {
+                        // The request that started the load gave up, take
+                        // over from it
+                        continue;
+                    }
+                    return r.mesh;
+                }
+
+                // This request does the load
+                struct stat st;
+                bool found = stat(path.c_str(), &st) == 0;
+                Trimesh *mesh = new Trimesh();
+                Result r;
+                uint64_t hash = 0;
+                bool hashed = false;
+                int nthreads = LoadPool::threadsPerJob();
+                if(read(filename, mesh, progress, nthreads, hash, hashed)) {
+                    if(eps >= 0.0f) {
+                        weld(filename, mesh, eps, nthreads);
+                    }
+                    r.mesh = MeshHandle(mesh);
+                } else {
+                    r.cancelled = progress != NULL && progress->cancel;
+                    delete mesh;
+                }
+
+                std::lock_guard<std::mutex> l(lock);
+                Entry &e = entries[path];
+                e.size  = found ? st.st_size : 0;
+                e.mtime = found ? mtimeOf(st) : 0;
+                e.hash  = hash;
+                e.hashed = r.mesh != NULL && hashed;
+                e.weld  = eps;
+                e.mesh  = r.mesh;
+                e.pending = std::shared_future<Result>();
+                promise.set_value(r);
+                return r.mesh;
+            }
+        }
+
+        // Number of distinct meshes currently alive
+        size_t size() {
+            std::lock_guard<std::mutex> l(lock);
+            prune();
+            return entries.size();
+        }
+};
+
+#endif
@@ -0,0 +1,296 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __MESHLET_H__
+#define __MESHLET_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include "normals.h"
+
+// Most faces and vertices in a meshlet, and the fewest faces a meshlet
+// gets before a face that shares no vertex with it starts the next one
+#define MESHLET_FACES     128
+#define MESHLET_VERTS     64
+#define MESHLET_MIN_FACES 32
+
+// Past MESHLET_MIN_FACES, a face whose normal is further than this cosine
+// from the meshlet's mean normal starts the next meshlet, so cones stay
+// narrow enough to cull
+#define MESHLET_CONE 0.5f
+
+// A run of consecutive faces with a sphere around its vertices and a cone
+// around its face normals. The faces all point away from any eye for which
+// dot(center - eye, axis) >= cutoff * |center - eye| + radius; a cutoff of
+// 1 or more never passes.
+struct Meshlet {
+    uint32_t first, count;
+    float center[3], radius;
+    float axis[3], cutoff;
+};
+
+// What culling did in one draw of a mesh
+struct MeshletStats {
+    size_t meshlets = 0, outside = 0, backFacing = 0;
+    size_t faces = 0, drawn = 0;
+};
+
+// The frustum planes, normalized, and the eye of a view in the object
+// space of a mesh
+struct MeshletView {
+    float planes[6][4];
+    float eye[3];
+};
+
+// Cuts a mesh into meshlets and culls them against a view. Meshlets are
+// runs of the face order as it is; FaceReorder leaves faces in small
+// connected fans, so cutting its order where a run stops sharing vertices
+// gives compact pieces without moving a face. Culling drops the meshlets
+// outside the frustum and those whose normal cone faces away from the eye
+// (Shirman and Abi-Ezzi, "The cone of normals technique for fast
+// processing of curved patches").
+//
+// Back faces are drawn in this viewer, so the cones only go on meshes that
+// are closed with consistent winding, where the faces turned away are always
+// behind others. Open meshes are only culled against the frustum.
+class Meshlets {
+
+    private:
+
+        // Whether every directed edge a->b other than a->a has exactly one
+        // twin b->a
+        static bool closed(const uint32_t *ids, size_t nfaces, size_t nverts) {
+            std::vector<uint32_t> offsets(nverts + 1, 0), ends(3 * nfaces);
+            for(size_t i = 0; i < 3 * nfaces; ++i) {
+                offsets[ids[i] + 1]++;
+            }
+            for(size_t v = 0; v < nverts; ++v) {
+                offsets[v + 1] += offsets[v];
+            }
+            std::vector<uint32_t> at(offsets.begin(), offsets.end() - 1);
+            for(size_t i = 0; i < 3 * nfaces; ++i) {
+                ends[at[ids[i]]++] = ids[i - i % 3 + (i + 1) % 3];
+            }
+            // Sorted ends per vertex, so counting an edge is a search
+            for(size_t v = 0; v < nverts; ++v) {
+                std::sort(ends.begin() + offsets[v], ends.begin() + offsets[v + 1]);
+            }
+            for(size_t a = 0; a < nverts; ++a) {
+                for(uint32_t i = offsets[a]; i < offsets[a + 1]; ++i) {
+                    uint32_t b = ends[i];
+                    if(b == a) continue;
+                    bool once = (i == offsets[a] || ends[i - 1] != b) && (i + 1 == offsets[a + 1] || ends[i + 1] != b);
+                    std::pair<std::vector<uint32_t>::iterator, std::vector<uint32_t>::iterator> back =
+                        std::equal_range(ends.begin() + offsets[b], ends.begin() + offsets[b + 1], (uint32_t)a);
+                    if(!once || back.second - back.first != 1) return false;
+                }
+            }
+            return true;
+        }
+
+        // Sphere and cone of faces [first, first + count); fn holds their
+        // unit normals. flip turns the cones around for meshes wound
+        // inside out.
+        static void bound(const float *pos, const uint32_t *ids, const float *fn, bool cones, bool flip, Meshlet &m) {
+            float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+            for(size_t i = 0; i < 3 * (size_t)m.count; ++i) {
+                const float *p = &pos[3 * ids[3 * (size_t)m.first + i]];
+                for(int k = 0; k < 3; ++k) {
+                    lo[k] = std::min(lo[k], p[k]);
+                    hi[k] = std::max(hi[k], p[k]);
+                }
+            }
+            float r2 = 0.0f;
+            for(int k = 0; k < 3; ++k) {
+                m.center[k] = (lo[k] + hi[k]) / 2.0f;
+            }
+            for(size_t i = 0; i < 3 * (size_t)m.count; ++i) {
+                const float *p = &pos[3 * ids[3 * (size_t)m.first + i]];
+                float dx = p[0] - m.center[0], dy = p[1] - m.center[1], dz = p[2] - m.center[2];
+                r2 = std::max(r2, dx * dx + dy * dy + dz * dz);
+            }
+            m.radius = sqrtf(r2);
+
+            float a[3] = { 0.0f, 0.0f, 0.0f };
+            for(size_t f = 0; f < m.count; ++f) {
+                for(int k = 0; k < 3; ++k) a[k] += fn[3 * f + k];
+            }
+            float len = sqrtf(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+            m.cutoff = 1.0f;
+            if(!cones || len == 0.0f) {
+                memset(m.axis, 0, sizeof(m.axis));
+                return;
+            }
+            float mindp = 1.0f;
+            for(int k = 0; k < 3; ++k) {
+                m.axis[k] = a[k] / len;
+            }
+            for(size_t f = 0; f < m.count; ++f) {
+                const float *n = &fn[3 * f];
+                if(n[0] != 0.0f || n[1] != 0.0f || n[2] != 0.0f) {
+                    mindp = std::min(mindp, n[0] * m.axis[0] + n[1] * m.axis[1] + n[2] * m.axis[2]);
+                }
+            }
+            // Wider than a half space, some face always looks at the eye
+            if(mindp > 0.0f) {
+                m.cutoff = sqrtf(1.0f - mindp * mindp);
+            }
+            if(flip) {
+                for(int k = 0; k < 3; ++k) m.axis[k] = -m.axis[k];
+            }
+        }
+
+    public:
+
+        // Meshlets of faces [first, last) of each range, which a meshlet
+        // never crosses. Positions are read as by FaceNormals.
+        static void build(const float *pos, const uint32_t *ids, size_t nfaces, size_t nverts,
+                          const std::vector<std::pair<size_t, size_t> > &ranges, std::vector<Meshlet> &out) {
+            out.clear();
+            bool cones = closed(ids, nfaces, nverts);
+            // Signed volume, negative when the winding points inward
+            double volume = 0.0;
+            for(size_t f = 0; cones && f < nfaces; ++f) {
+                const float *a = &pos[3 * ids[3 * f]], *b = &pos[3 * ids[3 * f + 1]], *c = &pos[3 * ids[3 * f + 2]];
+                volume += (double)a[0] * (b[1] * c[2] - b[2] * c[1]) + (double)a[1] * (b[2] * c[0] - b[0] * c[2]) +
+                          (double)a[2] * (b[0] * c[1] - b[1] * c[0]);
+            }
+
+            std::vector<uint32_t> stamp(nverts, 0);
+            std::vector<float> fn(3 * MESHLET_FACES);
+            uint32_t mark = 0;
+            for(const std::pair<size_t, size_t> &r : ranges) {
+                Meshlet m;
+                m.first = r.first;
+                m.count = 0;
+                size_t verts = 0;
+                float sum[3] = { 0.0f, 0.0f, 0.0f };
+                mark++;
+                for(size_t f = r.first; f < r.second; ++f) {
+                    const uint32_t *t = &ids[3 * f];
+                    float n[3];
+                    FaceNormals::compute(pos, t, 1, n);
+                    size_t fresh = 0;
+                    for(int k = 0; k < 3; ++k) fresh += stamp[t[k]] != mark;
+                    float len = sqrtf(sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2]);
+                    float dot = n[0] * sum[0] + n[1] * sum[1] + n[2] * sum[2];
+                    bool full = m.count == MESHLET_FACES || verts + fresh > MESHLET_VERTS ||
+                                (m.count >= MESHLET_MIN_FACES && (fresh == 3 || (cones && dot < MESHLET_CONE * len)));
+                    if(full) {
+                        bound(pos, ids, fn.data(), cones, volume < 0.0, m);
+                        out.push_back(m);
+                        m.first = f;
+                        m.count = 0;
+                        verts = 0;
+                        sum[0] = sum[1] = sum[2] = 0.0f;
+                        mark++;
+                        fresh = 0;
+                        for(int k = 0; k < 3; ++k) fresh += stamp[t[k]] != mark;
+                    }
+                    for(int k = 0; k < 3; ++k) {
+                        stamp[t[k]] = mark;
+                        sum[k] += n[k];
+                        fn[3 * m.count + k] = n[k];
+                    }
+                    verts += fresh;
+                    m.count++;
+                }
+                if(m.count > 0) {
+                    bound(pos, ids, fn.data(), cones, volume < 0.0, m);
+                    out.push_back(m);
+                }
+            }
+        }
+
+        // The view of the modelview and projection matrices (column major)
+        // in object space. False if the modelview cannot be inverted.
+        static bool view(const float *mv, const float *p, MeshletView &v) {
+            float m[16];
+            for(int c = 0; c < 4; ++c) {
+                for(int r = 0; r < 4; ++r) {
+                    m[c * 4 + r] = p[r] * mv[c * 4] + p[4 + r] * mv[c * 4 + 1] +
+                                   p[8 + r] * mv[c * 4 + 2] + p[12 + r] * mv[c * 4 + 3];
+                }
+            }
+            for(int k = 0; k < 3; ++k) {
+                for(int j = 0; j < 4; ++j) {
+                    v.planes[2 * k][j]     = m[j * 4 + 3] + m[j * 4 + k];
+                    v.planes[2 * k + 1][j] = m[j * 4 + 3] - m[j * 4 + k];
+                }
+            }
+            for(int i = 0; i < 6; ++i) {
+                float *pl = v.planes[i];
+                float len = sqrtf(pl[0] * pl[0] + pl[1] * pl[1] + pl[2] * pl[2]);
+                if(len == 0.0f) return false;
+                for(int j = 0; j < 4; ++j) pl[j] /= len;
+            }
+
+            // The eye is where the modelview takes to the origin, -A^-1 t
+            // for the linear part A and translation t
+            float a = mv[0], b = mv[4], c = mv[8], d = mv[1], e = mv[5], f = mv[9], g = mv[2], h = mv[6], i = mv[10];
+            float co[9] = { e * i - f * h, c * h - b * i, b * f - c * e,
+                            f * g - d * i, a * i - c * g, c * d - a * f,
+                            d * h - e * g, b * g - a * h, a * e - b * d };
+            float det = a * co[0] + b * co[3] + c * co[6];
+            if(!(fabsf(det) > 1e-12f)) {
+                return false;
+            }
+            for(int r = 0; r < 3; ++r) {
+                v.eye[r] = -(co[3 * r] * mv[12] + co[3 * r + 1] * mv[13] + co[3 * r + 2] * mv[14]) / det;
+            }
+            return true;
+        }
+
+        static bool outside(const Meshlet &m, const MeshletView &v) {
+            for(int i = 0; i < 6; ++i) {
+                const float *pl = v.planes[i];
+                if(pl[0] * m.center[0] + pl[1] * m.center[1] + pl[2] * m.center[2] + pl[3] < -m.radius) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static bool backFacing(const Meshlet &m, const MeshletView &v) {
+            if(m.cutoff >= 1.0f) {
+                return false;
+            }
+            float d[3] = { m.center[0] - v.eye[0], m.center[1] - v.eye[1], m.center[2] - v.eye[2] };
+            float dist = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+            return d[0] * m.axis[0] + d[1] * m.axis[1] + d[2] * m.axis[2] >= m.cutoff * dist + m.radius;
+        }
+
+        // The faces of meshlets in [first, last) that survive the view, as
+        // runs of (first face, face count), neighbors joined
+        static void cull(const std::vector<Meshlet> &meshlets, size_t first, size_t last, const MeshletView &v,
+                         std::vector<std::pair<size_t, size_t> > &runs, MeshletStats &stats) {
+            // Meshlets never cross a range, so the first one starts at first
+            size_t i = std::lower_bound(meshlets.begin(), meshlets.end(), first, [](const Meshlet &m, size_t f) {
+                return m.first < f;
+            }) - meshlets.begin();
+            for(; i < meshlets.size() && meshlets[i].first < last; ++i) {
+                const Meshlet &m = meshlets[i];
+                stats.meshlets++;
+                stats.faces += m.count;
+                if(outside(m, v)) {
+                    stats.outside++;
+                } else if(backFacing(m, v)) {
+                    stats.backFacing++;
+                } else if(!runs.empty() && runs.back().first + runs.back().second == m.first) {
+                    runs.back().second += m.count;
+                    stats.drawn += m.count;
+                } else {
+                    runs.push_back(std::make_pair((size_t)m.first, (size_t)m.count));
+                    stats.drawn += m.count;
+                }
+            }
+        }
+};
+
+#endif
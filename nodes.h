@@ -6,9 +6,17 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <cstring>
 
 #include "geom.h"
 #include "loader.h"
+#include "meshcache.h"
+#include "loadpool.h"
+#include "chunkedmesh.h"
+#include "pmesh.h"
+#include "lod.h"
 
 // Node types
 enum {
@@ -32,6 +40,8 @@ class SGNode {
     
     public:
 
+        virtual ~SGNode() {}
+
         std::string getName() { return name; }
 
         void setParent(SGNode *p) { parent = p; }
@@ -54,6 +64,12 @@ class ParentNode : public SGNode {
 
         std::vector<SGNode*> children;
 
+        ~ParentNode() {
+            for(int i = 0; i < children.size(); ++i) {
+                delete children[i];
+            }
+        }
+
         void addChild(SGNode *n) {
             if(n != NULL) {
                 n->setParent(this);
@@ -100,6 +116,25 @@ class TransformNode : public ParentNode {
             }
         }
 
+        // Multiplies a column major matrix by this node's transform on the
+        // right, the way draw() changes the modelview matrix
+        void applyTo(float *m) const {
+            for(int r = 0; r < 4; ++r) {
+                m[12 + r] += m[r] * translation.x + m[4 + r] * translation.y + m[8 + r] * translation.z;
+                m[r]     *= scaling.x;
+                m[4 + r] *= scaling.y;
+                m[8 + r] *= scaling.z;
+            }
+            float out[16];
+            for(int c = 0; c < 4; ++c) {
+                for(int r = 0; r < 4; ++r) {
+                    out[c * 4 + r] = m[r] * rotation[c * 4] + m[4 + r] * rotation[c * 4 + 1] +
+                                     m[8 + r] * rotation[c * 4 + 2] + m[12 + r] * rotation[c * 4 + 3];
+                }
+            }
+            memcpy(m, out, sizeof(out));
+        }
+
         void draw() {
             glTranslatef(translation.x, translation.y, translation.z);
             glScalef(scaling.x, scaling.y, scaling.z);
@@ -127,19 +162,152 @@ class GeometryNode : public SGNode {
 
     private:
 
-        Trimesh *model = NULL;
+        // A background load, shared with its pool job so the node can walk
+        // away from it without waiting for the job to see the cancel flag
+        struct PendingLoad {
+            LoadProgress progress;
+            MeshHandle mesh;
+            std::shared_ptr<ChunkedMesh> paged;
+            std::shared_ptr<ProgressiveMesh> progressive;
+            std::atomic<bool> done{false};
+        };
+
+        MeshHandle model;
+
+        // Set instead of model for chunked files, which are drawn from the
+        // chunks that are in memory
+        std::shared_ptr<ChunkedMesh> paged;
+
+        // Or for progressive files, which refine as their splits are read
+        std::shared_ptr<ProgressiveMesh> progressive;
+
+        // The worker publishes the finished mesh in pending and the GLUT
+        // thread swaps it in on its next draw
+        std::shared_ptr<PendingLoad> pending;
+
+        // Simplified levels of model, and the level drawn last
+        std::shared_ptr<LodChain> lods;
+        size_t lodLevel = 0;
+
+        // The level of model to draw at the current modelview matrix
+        MeshHandle pickLevel() {
+            if(!LodChain::enabled() || model->numFaces() < 2 * LOD_MIN_FACES) {
+                lodLevel = 0;
+                return model;
+            }
+            if(lods == NULL || lods->base() != model) {
+                lods = LodChain::of(model);
+                lodLevel = 0;
+            }
+            lodLevel = lods->select(lodLevel);
+            return lods->level(lodLevel).mesh;
+        }
 
     public:
 
         GeometryNode() : SGNode("Geometry") {}
 
+        ~GeometryNode() {
+            cancelLoad();
+        }
+
         void loadModel(std::string filename) {
-            if(model != NULL) {
-                delete model;
+            cancelLoad();
+            paged.reset();
+            progressive.reset();
+            if(ChunkedMesh::isChunked(filename)) {
+                paged = ChunkedMesh::open(filename);
+                model.reset();
+            } else if(ProgressiveMesh::isProgressive(filename)) {
+                progressive = ProgressiveMesh::open(filename);
+                model.reset();
+            } else {
+                model = MeshCache::instance().acquire(filename);
+            }
+        }
+
+        // Shows a mesh that was loaded elsewhere, e.g. one of several in a
+        // scene file
+        void setModel(MeshHandle mesh) {
+            cancelLoad();
+            model = mesh;
+            paged.reset();
+            progressive.reset();
+        }
+
+        // Loads on the shared load pool, the current model stays up until
+        // the new one is ready
+        void loadModelAsync(std::string filename) {
+            cancelLoad();
+            std::shared_ptr<PendingLoad> load = std::make_shared<PendingLoad>();
+            pending = load;
+            LoadPool::instance().submit([load, filename] {
+                if(load->progress.cancel) {
+                    // Dropped before it started
+                } else if(ChunkedMesh::isChunked(filename)) {
+                    load->paged = ChunkedMesh::open(filename);
+                    if(load->paged == NULL) {
+                        std::cout << "Error: could not open " << filename << std::endl;
+                    }
+                } else if(ProgressiveMesh::isProgressive(filename)) {
+                    load->progressive = ProgressiveMesh::open(filename);
+                    if(load->progressive == NULL) {
+                        std::cout << "Error: could not open " << filename << std::endl;
+                    }
+                } else {
+                    load->mesh = MeshCache::instance().acquire(filename, &load->progress);
+                }
+                load->done = true;
+            });
+        }
+
+        void cancelLoad() {
+            if(pending != NULL) {
+                pending->progress.cancel = true;
+                pending.reset();
+            }
+        }
+
+        bool isLoading() { return pending != NULL && !pending->done; }
+
+        const LoadProgress &getProgress() {
+            static const LoadProgress idle;
+            return pending != NULL ? pending->progress : idle;
+        }
+
+        const Trimesh *getModel() { return model.get(); }
+
+        const ChunkedMesh *getPaged() { return paged.get(); }
+
+        const ProgressiveMesh *getProgressive() { return progressive.get(); }
+
+        // The level of detail drawn last, 0 for the full mesh
+        size_t getLevel() { return lods != NULL && lods->base() == model ? lodLevel : 0; }
+
+        // Levels of the model built so far, the full mesh included
+        size_t numLevels() { return lods != NULL && lods->base() == model ? lods->numLevels() : 1; }
+
+        // The mesh drawn last, the model or one of its levels
+        MeshHandle getDrawn() { return getLevel() > 0 ? lods->level(lodLevel).mesh : model; }
+
+        // Picks up a finished background load, call from the GLUT thread
+        void update() {
+            if(pending != NULL && pending->done) {
+                if(pending->mesh != NULL) {
+                    model = pending->mesh;
+                    paged.reset();
+                    progressive.reset();
+                } else if(pending->paged != NULL) {
+                    paged = pending->paged;
+                    model.reset();
+                    progressive.reset();
+                } else if(pending->progressive != NULL) {
+                    progressive = pending->progressive;
+                    model.reset();
+                    paged.reset();
+                }
+                pending.reset();
             }
-            model = new Trimesh();
-            TrimeshLoader ldr;
-            ldr.loadOBJ(filename.c_str(), model);
         }
 
         int getNodeType() {
@@ -147,8 +315,13 @@ class GeometryNode : public SGNode {
         }
 
         void draw(int mode, bool drawFaceNormals, bool drawVertNormals) {
+            update();
             if(model != NULL) {
-                model->draw(mode, drawFaceNormals, drawVertNormals);
+                pickLevel()->draw(mode, drawFaceNormals, drawVertNormals);
+            } else if(paged != NULL) {
+                paged->draw(mode);
+            } else if(progressive != NULL) {
+                progressive->draw(mode);
             }
         }
 };
@@ -179,10 +352,17 @@ class ObjectNode : public ParentNode {
 
         ObjectNode() : ObjectNode("Object") {}
 
+        ~ObjectNode() {
+            delete geom;
+            delete attr;
+        }
+
         int getNodeType() {
             return NODE_OBJECT;
         }
 
+        // The geometry picks its level of detail from the modelview matrix
+        // accumulated down to this node
         void draw() {
             if(geom != NULL && attr != NULL) {
                 geom->draw(attr->renderMode, attr->drawFaceNormals, attr->drawVertNormals);
@@ -236,6 +416,7 @@ class CameraNode : public SGNode {
             glMatrixMode(GL_PROJECTION);
             glLoadIdentity();
             gluPerspective(fov, 1, zNear, zFar);
+            LodChain::setView(fov);
 
             glMatrixMode(GL_MODELVIEW);
             glLoadIdentity();
@@ -0,0 +1,139 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __NORMALS_H__
+#define __NORMALS_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <emmintrin.h>
+
+// Faces whose normals are computed per kernel call, and the least work
+// worth another thread when computing normals
+#define NORMAL_BLOCK    1024
+#define NORMAL_MIN_WORK 65536
+
+// Instruction sets the face normal kernel can use
+enum NormalLevel {
+    NORMAL_SCALAR,
+    NORMAL_SSE2
+};
+
+// Unit face normals of a run of triangles, written as x, y, z per face.
+// The vector kernel transposes the corners of 4 faces into one register
+// per coordinate and does the cross product and normalization for all of
+// them at once. A degenerate face gets a zero normal. An 8 wide AVX2
+// kernel was no faster, the loads and transposes dominate.
+//
+// Positions are read four floats at a time, so one float past the last
+// position must be readable. In a Trimesh the indices follow them.
+//
+// Only plain multiplies, subtracts, square roots and divides are used, so
+// both levels produce the same bits.
+class FaceNormals {
+
+    public:
+
+        typedef void (*Kernel)(const float *pos, const uint32_t *ids, size_t n, float *out);
+
+        // Reference implementation the vector kernels must agree with
+        static void computeScalar(const float *pos, const uint32_t *ids, size_t n, float *out) {
+            for(size_t f = 0; f < n; ++f) {
+                const float *a = &pos[3 * ids[3 * f]];
+                const float *b = &pos[3 * ids[3 * f + 1]];
+                const float *c = &pos[3 * ids[3 * f + 2]];
+                float u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+                float v[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+                float *nf = &out[3 * f];
+                nf[0] = u[1] * v[2] - u[2] * v[1];
+                nf[1] = u[2] * v[0] - u[0] * v[2];
+                nf[2] = u[0] * v[1] - u[1] * v[0];
+                float len = sqrtf(nf[0] * nf[0] + nf[1] * nf[1] + nf[2] * nf[2]);
+                if(len > 0.0f) {
+                    nf[0] /= len; nf[1] /= len; nf[2] /= len;
+                }
+            }
+        }
+
+        // Corners k of faces t[0..3] as one register per coordinate. Each
+        // position is read as four floats, the fourth is dropped.
+        static void loadCorners(const float *pos, const uint32_t *t, int k, __m128 *c) {
+            __m128 p0 = _mm_loadu_ps(&pos[3 * t[k]]);
+            __m128 p1 = _mm_loadu_ps(&pos[3 * t[3 + k]]);
+            __m128 p2 = _mm_loadu_ps(&pos[3 * t[6 + k]]);
+            __m128 p3 = _mm_loadu_ps(&pos[3 * t[9 + k]]);
+            _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+            c[0] = p0; c[1] = p1; c[2] = p2;
+        }
+
+        // Writes x, y, z of four faces back as triples
+        static void storeNormals(__m128 x, __m128 y, __m128 z, float *out, bool last) {
+            __m128 w = _mm_setzero_ps();
+            _MM_TRANSPOSE4_PS(x, y, z, w);
+            _mm_storeu_ps(out, x);
+            _mm_storeu_ps(out + 3, y);
+            _mm_storeu_ps(out + 6, z);
+            if(last) {
+                float tail[4];
+                _mm_storeu_ps(tail, w);
+                memcpy(out + 9, tail, 3 * sizeof(float));
+            } else {
+                _mm_storeu_ps(out + 9, w);
+            }
+        }
+
+        static void computeSSE2(const float *pos, const uint32_t *ids, size_t n, float *out) {
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 one  = _mm_set1_ps(1.0f);
+            size_t f = 0;
+            for(; f + 4 <= n; f += 4) {
+                const uint32_t *t = ids + 3 * f;
+                __m128 a[3], b[3], c[3];
+                loadCorners(pos, t, 0, a);
+                loadCorners(pos, t, 1, b);
+                loadCorners(pos, t, 2, c);
+                __m128 ux = _mm_sub_ps(b[0], a[0]), vx = _mm_sub_ps(c[0], a[0]);
+                __m128 uy = _mm_sub_ps(b[1], a[1]), vy = _mm_sub_ps(c[1], a[1]);
+                __m128 uz = _mm_sub_ps(b[2], a[2]), vz = _mm_sub_ps(c[2], a[2]);
+                __m128 nx = _mm_sub_ps(_mm_mul_ps(uy, vz), _mm_mul_ps(uz, vy));
+                __m128 ny = _mm_sub_ps(_mm_mul_ps(uz, vx), _mm_mul_ps(ux, vz));
+                __m128 nz = _mm_sub_ps(_mm_mul_ps(ux, vy), _mm_mul_ps(uy, vx));
+                __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)),
+                                                    _mm_mul_ps(nz, nz)));
+                // Divide by one where the face is degenerate, leaving zero
+                __m128 live = _mm_cmpgt_ps(len, zero);
+                len = _mm_or_ps(_mm_and_ps(live, len), _mm_andnot_ps(live, one));
+                storeNormals(_mm_div_ps(nx, len), _mm_div_ps(ny, len), _mm_div_ps(nz, len),
+                             out + 3 * f, f + 4 == n);
+            }
+            computeScalar(pos, ids + 3 * f, n - f, out + 3 * f);
+        }
+
+        // The level compute uses; SSE2 is part of every x86-64 CPU
+        static NormalLevel &level() {
+            static NormalLevel l = NORMAL_SSE2;
+            return l;
+        }
+
+        static Kernel kernel(NormalLevel l) {
+            return l == NORMAL_SSE2 ? computeSSE2 : computeScalar;
+        }
+
+        // Differential check of the vector kernel against the scalar
+        // reference over n faces
+        static bool agrees(NormalLevel l, const float *pos, const uint32_t *ids, size_t n) {
+            std::vector<float> ref(3 * n), vec(3 * n);
+            computeScalar(pos, ids, n, ref.data());
+            kernel(l)(pos, ids, n, vec.data());
+            return n == 0 || memcmp(ref.data(), vec.data(), 3 * n * sizeof(float)) == 0;
+        }
+
+        static void compute(const float *pos, const uint32_t *ids, size_t n, float *out) {
+            kernel(level())(pos, ids, n, out);
+        }
+};
+
+#endif
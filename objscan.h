@@ -0,0 +1,318 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __OBJSCAN_H__
+#define __OBJSCAN_H__
+
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#define SCAN_BLOCK  64
+#define SCAN_WINDOW 16
+
+// Instruction sets the block classifier can use
+enum ScanLevel {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2
+};
+
+// Separator and newline bitmasks for one 64 byte block, bit i is byte i
+struct ScanBlock {
+    uint64_t sep;
+    uint64_t nl;
+};
+
+// Walks the tokens and line ends of a byte range. Bytes are classified a 64
+// byte block at a time into separator and newline bitmasks, and the start of
+// every token and every newline in the block is extracted from the masks
+// with count-trailing-zeros. The parser then steps from entry to entry
+// without looking at the bytes in between.
+class ObjScanner {
+
+    public:
+
+        typedef void (*Classifier)(const char *p, ScanBlock &b);
+
+        static bool isSep(char c) {
+            return c == ' ' || c == '\t' || c == '\r';
+        }
+
+        // Reference implementation the vector kernels must agree with
+        static void classifyScalar(const char *p, ScanBlock &b) {
+            b.sep = 0;
+            b.nl  = 0;
+            for(int i = 0; i < SCAN_BLOCK; ++i) {
+                b.sep |= (uint64_t)isSep(p[i]) << i;
+                b.nl  |= (uint64_t)(p[i] == '\n') << i;
+            }
+        }
+
+        static void classifySSE2(const char *p, ScanBlock &b) {
+            const __m128i space = _mm_set1_epi8(' ');
+            const __m128i tab   = _mm_set1_epi8('\t');
+            const __m128i cr    = _mm_set1_epi8('\r');
+            const __m128i lf    = _mm_set1_epi8('\n');
+            b.sep = 0;
+            b.nl  = 0;
+            for(int i = 0; i < SCAN_BLOCK; i += 16) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+                __m128i s = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                                      _mm_cmpeq_epi8(v, tab)),
+                                         _mm_cmpeq_epi8(v, cr));
+                b.sep |= (uint64_t)(uint16_t)_mm_movemask_epi8(s) << i;
+                b.nl  |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)) << i;
+            }
+        }
+
+        __attribute__((target("avx2")))
+        static void classifyAVX2(const char *p, ScanBlock &b) {
+            const __m256i space = _mm256_set1_epi8(' ');
+            const __m256i tab   = _mm256_set1_epi8('\t');
+            const __m256i cr    = _mm256_set1_epi8('\r');
+            const __m256i lf    = _mm256_set1_epi8('\n');
+            b.sep = 0;
+            b.nl  = 0;
+            for(int i = 0; i < SCAN_BLOCK; i += 32) {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+                __m256i s = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                                                            _mm256_cmpeq_epi8(v, tab)),
+                                            _mm256_cmpeq_epi8(v, cr));
+                b.sep |= (uint64_t)(uint32_t)_mm256_movemask_epi8(s) << i;
+                b.nl  |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf)) << i;
+            }
+        }
+
+        static ScanLevel detectLevel() {
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") ? SCAN_AVX2 : SCAN_SSE2;
+        }
+
+        // The level new scanners use; defaults to the best the CPU supports
+        static ScanLevel &level() {
+            static ScanLevel l = detectLevel();
+            return l;
+        }
+
+        static Classifier classifier(ScanLevel l) {
+            switch(l) {
+                case SCAN_AVX2: return classifyAVX2;
+                case SCAN_SSE2: return classifySSE2;
+                default:        return classifyScalar;
+            }
+        }
+
+        // Differential check of a vector kernel against the scalar
+        // reference over a whole buffer
+        static bool agrees(ScanLevel l, const char *data, size_t size) {
+            ObjScanner ref(data, data + size, SCAN_SCALAR);
+            ObjScanner vec(data, data + size, l);
+            for(size_t pos = 0; pos < size; pos += SCAN_BLOCK) {
+                ScanBlock a, b;
+                ref.load(pos, a);
+                vec.load(pos, b);
+                if(a.sep != b.sep || a.nl != b.nl) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    private:
+
+        const char *base;
+        size_t      size;
+        Classifier  classify;
+
+        // Next block to classify, and whether the byte before it was a
+        // separator or newline (the range start counts as one)
+        size_t   blkPos = 0;
+        uint64_t carry  = 1;
+
+        // Entries of the current window of blocks, pending ones are
+        // [next, count)
+        const char *entries[SCAN_BLOCK * SCAN_WINDOW + 4];
+        int next  = 0;
+        int count = 0;
+
+        void load(size_t pos, ScanBlock &b) {
+            if(pos + SCAN_BLOCK <= size) {
+                classify(base + pos, b);
+            } else {
+                // Pad the last block with separators, which start no token
+                // and end no line, so every entry lies inside the range. A
+                // final line without a newline ends with the range.
+                size_t len = size - pos;
+                char tail[SCAN_BLOCK];
+                memset(tail, ' ', SCAN_BLOCK);
+                memcpy(tail, base + pos, len);
+                classify(tail, b);
+            }
+        }
+
+        // Classifies the next window of blocks, false once the range ends.
+        // A token longer than the window yields no entries, so the window
+        // grows until something is found.
+        bool refill() {
+            next  = 0;
+            count = 0;
+            for(int i = 0; (i < SCAN_WINDOW || count == 0) && blkPos < size; ++i) {
+                ScanBlock b;
+                load(blkPos, b);
+                uint64_t ws     = b.sep | b.nl;
+                uint64_t starts = ~ws & ((ws << 1) | carry);
+                carry = ws >> 63;
+
+                // Extract four entries per step, writes past the last set bit
+                // land in the slack at the end of the window and are ignored
+                const char *at = base + blkPos;
+                uint64_t bits = starts | b.nl;
+                int n = __builtin_popcountll(bits);
+                const char **out = entries + count;
+                for(int k = 0; k < n; k += 4) {
+                    out[k + 0] = at + __builtin_ctzll(bits | (1ull << 63)); bits &= bits - 1;
+                    out[k + 1] = at + __builtin_ctzll(bits | (1ull << 63)); bits &= bits - 1;
+                    out[k + 2] = at + __builtin_ctzll(bits | (1ull << 63)); bits &= bits - 1;
+                    out[k + 3] = at + __builtin_ctzll(bits | (1ull << 63)); bits &= bits - 1;
+                }
+                count += n;
+                blkPos += SCAN_BLOCK;
+            }
+            return count > 0;
+        }
+
+    public:
+
+        ObjScanner(const char *begin, const char *end, ScanLevel l = level()) :
+            base(begin), size(end - begin), classify(classifier(l)) {}
+
+        const char *begin() const { return base; }
+
+        const char *end() const { return base + size; }
+
+        // How far the range has been classified, entries before it may
+        // still be pending
+        const char *position() const {
+            return base + (blkPos < size ? blkPos : size);
+        }
+
+        bool done() {
+            return next == count && !refill();
+        }
+
+        // The next token start or newline, call only when !done()
+        const char *peek() {
+            return entries[next];
+        }
+
+        const char *pop() {
+            return entries[next++];
+        }
+
+        bool isLineEnd(const char *p) const {
+            return p == base + size || *p == '\n';
+        }
+
+        // True when the current line has no tokens left
+        bool atLineEnd() {
+            return done() || isLineEnd(peek());
+        }
+
+        // Drops the rest of the current line including its newline
+        void skipLine() {
+            while(!done() && !isLineEnd(pop()));
+        }
+
+        // End of the token starting at p, for the few callers that need it
+        const char *tokenEnd(const char *p) const {
+            const char *e = base + size;
+            while(p < e && !isSep(*p) && *p != '\n') p++;
+            return p;
+        }
+
+        // Decoders for a single token. Both return the position after the
+        // number, or the token start if nothing could be parsed (in which
+        // case the value is zero). Results are identical to std::from_chars,
+        // the fast paths only take inputs they can convert exactly.
+
+        static const char *decodeInt(const char *p, const char *e, int &out) {
+            const char *s = p;
+            bool neg = p < e && *p == '-';
+            p += (p < e && (*p == '-' || *p == '+'));
+
+            const char *digits = p;
+            uint32_t v = 0;
+            while(p < e && (unsigned)(*p - '0') < 10 && p - digits < 9) {
+                v = v * 10 + (*p - '0');
+                p++;
+            }
+            if(p == digits || (p < e && (unsigned)(*p - '0') < 10)) {
+                // Empty, or long enough that it might overflow
+                out = 0;
+                std::from_chars_result r = std::from_chars(s + (*s == '+'), e, out);
+                return r.ec == std::errc::invalid_argument ? s : r.ptr;
+            }
+            out = neg ? -(int)v : (int)v;
+            return p;
+        }
+
+        static const char *decodeFloat(const char *p, const char *e, float &out) {
+            static const float pow10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                           1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+            const char *s = p;
+            bool neg = p < e && *p == '-';
+            p += (p < e && (*p == '-' || *p == '+'));
+
+            uint64_t m = 0;
+            int ndigits = 0;
+            int exp10 = 0;
+            while(p < e && (unsigned)(*p - '0') < 10) {
+                m = m * 10 + (*p++ - '0');
+                ndigits++;
+            }
+            if(p < e && *p == '.') {
+                const char *frac = ++p;
+                while(p < e && (unsigned)(*p - '0') < 10) {
+                    m = m * 10 + (*p++ - '0');
+                }
+                ndigits += p - frac;
+                exp10 -= p - frac;
+            }
+            bool ok = ndigits > 0 && ndigits <= 19;
+            if(ok && p < e && (*p | 0x20) == 'e') {
+                const char *q = p + 1;
+                bool eneg = q < e && *q == '-';
+                q += (q < e && (*q == '-' || *q == '+'));
+                const char *edigits = q;
+                int x = 0;
+                while(q < e && (unsigned)(*q - '0') < 10 && q - edigits < 4) {
+                    x = x * 10 + (*q++ - '0');
+                }
+                ok = q > edigits && !(q < e && (unsigned)(*q - '0') < 10);
+                exp10 += eneg ? -x : x;
+                p = q;
+            }
+            while(ok && m > (1 << 24) && m % 10 == 0) {
+                m /= 10;
+                exp10++;
+            }
+
+            // m and 10^|exp10| are exact in a float, so one multiply or
+            // divide rounds correctly
+            if(ok && m <= (1 << 24) && exp10 >= -10 && exp10 <= 10) {
+                float v = (float)m;
+                v = exp10 < 0 ? v / pow10[-exp10] : v * pow10[exp10];
+                out = neg ? -v : v;
+                return p;
+            }
+
+            out = 0.0f;
+            std::from_chars_result r = std::from_chars(s + (s < e && *s == '+'), e, out);
+            return r.ec == std::errc::invalid_argument ? s : r.ptr;
+        }
+};
+
+#endif
@@ -0,0 +1,561 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __PLYLOADER_H__
+#define __PLYLOADER_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include "geom.h"
+#include "loader.h"
+#include "mapfile.h"
+#include "objscan.h"
+
+// Rows read between progress reports and cancellation checks
+#define PLY_PROGRESS_ROWS (1 << 16)
+
+enum PlyFormat {
+    PLY_ASCII,
+    PLY_BINARY_LE,
+    PLY_BINARY_BE
+};
+
+enum PlyType {
+    PLY_NONE,
+    PLY_INT8,
+    PLY_UINT8,
+    PLY_INT16,
+    PLY_UINT16,
+    PLY_INT32,
+    PLY_UINT32,
+    PLY_FLOAT32,
+    PLY_FLOAT64
+};
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;
+    PlyType countType = PLY_NONE;   // Set for list properties
+
+    bool isList() const { return countType != PLY_NONE; }
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count = 0;
+    std::vector<PlyProperty> props;
+
+    int find(const char *a, const char *b = NULL) const {
+        for(size_t i = 0; i < props.size(); ++i) {
+            if(props[i].name == a || (b != NULL && props[i].name == b)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+};
+
+// Loads PLY files (ASCII and binary of either byte order) from a read-only
+// mapping. Positions come from the x, y and z properties of the vertex
+// element, normals and texture coordinates are taken when every vertex has
+// them. Polygons in the face element are fanned into triangles.
+//
+// Binary vertex blocks of plain little endian x y z floats are copied in a
+// single memcpy, other fixed-size rows are read at precomputed offsets.
+class PlyLoader {
+
+    private:
+
+        LoadProgress *progress;
+
+        const char *base = NULL;
+        bool swap = false;
+
+        std::vector<float> verts, normals, texcoords;
+        std::vector<int> tris;
+
+        static int typeSize(PlyType t) {
+            static const int sizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+            return sizes[t];
+        }
+
+        static PlyType parseType(const std::string &s) {
+            if(s == "char"   || s == "int8")    return PLY_INT8;
+            if(s == "uchar"  || s == "uint8")   return PLY_UINT8;
+            if(s == "short"  || s == "int16")   return PLY_INT16;
+            if(s == "ushort" || s == "uint16")  return PLY_UINT16;
+            if(s == "int"    || s == "int32")   return PLY_INT32;
+            if(s == "uint"   || s == "uint32")  return PLY_UINT32;
+            if(s == "float"  || s == "float32") return PLY_FLOAT32;
+            if(s == "double" || s == "float64") return PLY_FLOAT64;
+            return PLY_NONE;
+        }
+
+        // Splits the header line starting at p into words, returns the
+        // start of the next line
+        static const char *headerLine(const char *p, const char *end, std::vector<std::string> &words) {
+            words.clear();
+            while(p < end && *p != '\n') {
+                while(p < end && ObjScanner::isSep(*p)) p++;
+                const char *w = p;
+                while(p < end && !ObjScanner::isSep(*p) && *p != '\n') p++;
+                if(p > w) {
+                    words.push_back(std::string(w, p));
+                }
+            }
+            return p < end ? p + 1 : p;
+        }
+
+        // Reads the header, returns the start of the body or NULL if the
+        // header is malformed
+        static const char *parseHeader(const char *p, const char *end, PlyFormat &format,
+                                       std::vector<PlyElement> &elements) {
+            std::vector<std::string> w;
+            p = headerLine(p, end, w);
+            if(w.size() != 1 || w[0] != "ply") {
+                return NULL;
+            }
+            bool haveFormat = false;
+            while(p < end) {
+                p = headerLine(p, end, w);
+                if(w.empty() || w[0] == "comment" || w[0] == "obj_info") {
+                    continue;
+                }
+                if(w[0] == "end_header") {
+                    return haveFormat ? p : NULL;
+                }
+                if(w[0] == "format" && w.size() >= 2) {
+                    haveFormat = true;
+                    if(w[1] == "ascii")                     format = PLY_ASCII;
+                    else if(w[1] == "binary_little_endian") format = PLY_BINARY_LE;
+                    else if(w[1] == "binary_big_endian")    format = PLY_BINARY_BE;
+                    else return NULL;
+                } else if(w[0] == "element" && w.size() == 3) {
+                    PlyElement el;
+                    el.name  = w[1];
+                    el.count = strtoull(w[2].c_str(), NULL, 10);
+                    elements.push_back(el);
+                } else if(w[0] == "property" && !elements.empty()) {
+                    PlyProperty prop;
+                    if(w.size() == 5 && w[1] == "list") {
+                        prop.countType = parseType(w[2]);
+                        prop.type = parseType(w[3]);
+                        prop.name = w[4];
+                        if(prop.countType == PLY_NONE || prop.countType >= PLY_FLOAT32) {
+                            return NULL;
+                        }
+                    } else if(w.size() == 3) {
+                        prop.type = parseType(w[1]);
+                        prop.name = w[2];
+                    } else {
+                        return NULL;
+                    }
+                    if(prop.type == PLY_NONE) {
+                        return NULL;
+                    }
+                    elements.back().props.push_back(prop);
+                } else {
+                    return NULL;
+                }
+            }
+            return NULL;
+        }
+
+        // Decodes one binary scalar, swapping bytes for big endian files
+        template <typename T>
+        T readBinary(const char *p) const {
+            uint64_t raw = 0;
+            memcpy(&raw, p, sizeof(T));
+            if(swap) {
+                switch(sizeof(T)) {
+                    case 2: raw = __builtin_bswap16(raw); break;
+                    case 4: raw = __builtin_bswap32(raw); break;
+                    case 8: raw = __builtin_bswap64(raw); break;
+                }
+            }
+            T v;
+            memcpy(&v, &raw, sizeof(T));
+            return v;
+        }
+
+        double readValue(const char *p, PlyType t) const {
+            switch(t) {
+                case PLY_INT8:    return (int8_t)*p;
+                case PLY_UINT8:   return (uint8_t)*p;
+                case PLY_INT16:   return readBinary<int16_t>(p);
+                case PLY_UINT16:  return readBinary<uint16_t>(p);
+                case PLY_INT32:   return readBinary<int32_t>(p);
+                case PLY_UINT32:  return readBinary<uint32_t>(p);
+                case PLY_FLOAT32: return readBinary<float>(p);
+                case PLY_FLOAT64: return readBinary<double>(p);
+                default:          return 0;
+            }
+        }
+
+        int64_t readIndex(const char *p, PlyType t) const {
+            switch(t) {
+                case PLY_FLOAT32:
+                case PLY_FLOAT64: return (int64_t)readValue(p, t);
+                case PLY_INT8:    return (int8_t)*p;
+                case PLY_UINT8:   return (uint8_t)*p;
+                case PLY_INT16:   return readBinary<int16_t>(p);
+                case PLY_UINT16:  return readBinary<uint16_t>(p);
+                case PLY_INT32:   return readBinary<int32_t>(p);
+                default:          return readBinary<uint32_t>(p);
+            }
+        }
+
+        // Adds the triangles of one polygon, dropped if any index is bad
+        void addPolygon(const int64_t *ids, size_t n, size_t nverts) {
+            for(size_t i = 0; i < n; ++i) {
+                if(ids[i] < 0 || (size_t)ids[i] >= nverts) {
+                    return;
+                }
+            }
+            for(size_t i = 2; i < n; ++i) {
+                tris.insert(tris.end(), { (int)ids[0], (int)ids[i - 1], (int)ids[i] });
+            }
+        }
+
+        // Publishes progress, false once the load has been cancelled
+        bool report(const char *at) {
+            if(progress == NULL) {
+                return true;
+            }
+            progress->bytes = at - base;
+            progress->tris  = tris.size() / 3;
+            return !progress->cancel;
+        }
+
+        // Which vertex properties end up in the mesh
+        struct VertexLayout {
+            int pos[3];
+            int normal[3];
+            int uv[2];
+            bool hasNormals;
+            bool hasTexcoords;
+
+            VertexLayout(const PlyElement &el) {
+                pos[0] = el.find("x");
+                pos[1] = el.find("y");
+                pos[2] = el.find("z");
+                normal[0] = el.find("nx");
+                normal[1] = el.find("ny");
+                normal[2] = el.find("nz");
+                uv[0] = el.find("u", "s");
+                uv[1] = el.find("v", "t");
+                if(uv[0] < 0) uv[0] = el.find("texture_u");
+                if(uv[1] < 0) uv[1] = el.find("texture_v");
+                hasNormals   = normal[0] >= 0 && normal[1] >= 0 && normal[2] >= 0;
+                hasTexcoords = uv[0] >= 0 && uv[1] >= 0;
+            }
+        };
+
+        // Row size of an element without list properties, 0 otherwise
+        static size_t rowSize(const PlyElement &el, std::vector<size_t> *offsets = NULL) {
+            size_t size = 0;
+            for(const PlyProperty &prop : el.props) {
+                if(prop.isList()) {
+                    return 0;
+                }
+                if(offsets != NULL) {
+                    offsets->push_back(size);
+                }
+                size += typeSize(prop.type);
+            }
+            return size;
+        }
+
+        // Fewest bytes one row of the element takes: its scalars and list
+        // counts in binary, a digit and a separator per value in ASCII
+        static size_t minRowSize(const PlyElement &el, PlyFormat format) {
+            size_t size = 0;
+            for(const PlyProperty &prop : el.props) {
+                size += format == PLY_ASCII ? 2 : typeSize(prop.isList() ? prop.countType : prop.type);
+            }
+            return size;
+        }
+
+        // Whether the rows the header announces fit in the bytes left, so
+        // nothing is sized from a count the file cannot hold. The last
+        // ASCII value needs no separator.
+        static bool fits(const PlyElement &el, PlyFormat format, size_t left) {
+            size_t row = minRowSize(el, format);
+            if(row == 0) {
+                return el.count == 0;
+            }
+            return el.count <= (left + (format == PLY_ASCII ? 1 : 0)) / row;
+        }
+
+        // Skips the list properties of a binary row to find the others
+        const char *binaryRow(const char *p, const char *end, const PlyElement &el,
+                              std::vector<const char*> &at) const {
+            at.resize(el.props.size());
+            for(size_t i = 0; i < el.props.size(); ++i) {
+                const PlyProperty &prop = el.props[i];
+                at[i] = p;
+                if(prop.isList()) {
+                    if(typeSize(prop.countType) > end - p) return NULL;
+                    int64_t n = readIndex(p, prop.countType);
+                    p += typeSize(prop.countType);
+                    if(n > 0 && (uint64_t)n > (uint64_t)(end - p) / typeSize(prop.type)) return NULL;
+                    p += (n > 0 ? n : 0) * typeSize(prop.type);
+                } else {
+                    if(typeSize(prop.type) > end - p) return NULL;
+                    p += typeSize(prop.type);
+                }
+            }
+            return p;
+        }
+
+        const char *binaryVertices(const char *p, const char *end, const PlyElement &el) {
+            VertexLayout vl(el);
+            std::vector<size_t> offsets;
+            size_t row = rowSize(el, &offsets);
+            if(row > 0 && el.count > (size_t)(end - p) / row) {
+                return NULL;
+            }
+            verts.resize(3 * el.count);
+            if(vl.hasNormals)   normals.resize(3 * el.count);
+            if(vl.hasTexcoords) texcoords.resize(2 * el.count);
+
+            // Plain x y z float rows are already the layout the mesh wants
+            if(row == 12 && !swap && vl.pos[0] == 0 && vl.pos[1] == 1 && vl.pos[2] == 2 &&
+               el.props[0].type == PLY_FLOAT32 && el.props[1].type == PLY_FLOAT32 &&
+               el.props[2].type == PLY_FLOAT32) {
+                memcpy(verts.data(), p, 12 * el.count);
+                return p + 12 * el.count;
+            }
+
+            std::vector<const char*> at(el.props.size());
+            for(size_t i = 0; i < el.count; ++i) {
+                if(row > 0) {
+                    for(size_t k = 0; k < at.size(); ++k) {
+                        at[k] = p + offsets[k];
+                    }
+                    p += row;
+                } else if((p = binaryRow(p, end, el, at)) == NULL) {
+                    return NULL;
+                }
+                for(int k = 0; k < 3; ++k) {
+                    verts[3*i + k] = vl.pos[k] >= 0 ? readValue(at[vl.pos[k]], el.props[vl.pos[k]].type) : 0.0f;
+                }
+                for(int k = 0; vl.hasNormals && k < 3; ++k) {
+                    normals[3*i + k] = readValue(at[vl.normal[k]], el.props[vl.normal[k]].type);
+                }
+                for(int k = 0; vl.hasTexcoords && k < 2; ++k) {
+                    texcoords[2*i + k] = readValue(at[vl.uv[k]], el.props[vl.uv[k]].type);
+                }
+                if(i % PLY_PROGRESS_ROWS == 0 && !report(p)) {
+                    return NULL;
+                }
+            }
+            return p;
+        }
+
+        const char *binaryFaces(const char *p, const char *end, const PlyElement &el, size_t nverts) {
+            int list = el.find("vertex_indices", "vertex_index");
+            tris.reserve(tris.size() + 3 * el.count);
+
+            // A lone list of 32 bit indices is the layout nearly every
+            // exporter writes, read it without the per-property walk
+            if(list >= 0 && el.props.size() == 1 && el.props[0].countType == PLY_UINT8 &&
+               (el.props[0].type == PLY_INT32 || el.props[0].type == PLY_UINT32)) {
+                int64_t ids[256];
+                for(size_t i = 0; i < el.count; ++i) {
+                    if(p >= end) return NULL;
+                    int n = (uint8_t)*p++;
+                    if(p + 4 * n > end) return NULL;
+                    if(n == 3 && !swap) {
+                        int32_t tri[3];
+                        memcpy(tri, p, 12);
+                        if((uint32_t)tri[0] < nverts && (uint32_t)tri[1] < nverts && (uint32_t)tri[2] < nverts) {
+                            tris.insert(tris.end(), tri, tri + 3);
+                        }
+                    } else {
+                        for(int k = 0; k < n; ++k) {
+                            ids[k] = readIndex(p + 4 * k, el.props[0].type);
+                        }
+                        addPolygon(ids, n, nverts);
+                    }
+                    p += 4 * n;
+                    if(i % PLY_PROGRESS_ROWS == 0 && !report(p)) {
+                        return NULL;
+                    }
+                }
+                return p;
+            }
+
+            std::vector<const char*> at;
+            std::vector<int64_t> ids;
+            for(size_t i = 0; i < el.count; ++i) {
+                if((p = binaryRow(p, end, el, at)) == NULL) {
+                    return NULL;
+                }
+                if(list >= 0) {
+                    const PlyProperty &prop = el.props[list];
+                    const char *q = at[list];
+                    int64_t n = readIndex(q, prop.countType);
+                    q += typeSize(prop.countType);
+                    ids.resize(n > 0 ? n : 0);
+                    for(int64_t k = 0; k < n; ++k) {
+                        ids[k] = readIndex(q + k * typeSize(prop.type), prop.type);
+                    }
+                    addPolygon(ids.data(), ids.size(), nverts);
+                }
+                if(i % PLY_PROGRESS_ROWS == 0 && !report(p)) {
+                    return NULL;
+                }
+            }
+            return p;
+        }
+
+        // Skips whitespace and returns the end of the token at p
+        static const char *asciiToken(const char *&p, const char *end) {
+            while(p < end && (ObjScanner::isSep(*p) || *p == '\n')) p++;
+            const char *e = p;
+            while(e < end && !ObjScanner::isSep(*e) && *e != '\n') e++;
+            return e;
+        }
+
+        static bool asciiFloat(const char *&p, const char *end, float &out) {
+            const char *e = asciiToken(p, end);
+            bool ok = e > p && ObjScanner::decodeFloat(p, e, out) == e;
+            p = e;
+            return ok;
+        }
+
+        static bool asciiInt(const char *&p, const char *end, int &out) {
+            const char *e = asciiToken(p, end);
+            float f;
+            bool ok = e > p && (ObjScanner::decodeInt(p, e, out) == e ||
+                                (ObjScanner::decodeFloat(p, e, f) == e && (out = (int)f, true)));
+            p = e;
+            return ok;
+        }
+
+        const char *asciiElement(const char *p, const char *end, const PlyElement &el, size_t nverts) {
+            bool isVertex = el.name == "vertex";
+            bool isFace   = el.name == "face";
+            VertexLayout vl(el);
+            int list = el.find("vertex_indices", "vertex_index");
+            if(isVertex) {
+                verts.resize(3 * el.count);
+                if(vl.hasNormals)   normals.resize(3 * el.count);
+                if(vl.hasTexcoords) texcoords.resize(2 * el.count);
+            }
+
+            std::vector<float> row(el.props.size());
+            std::vector<int64_t> ids;
+            for(size_t i = 0; i < el.count; ++i) {
+                for(size_t k = 0; k < el.props.size(); ++k) {
+                    const PlyProperty &prop = el.props[k];
+                    if(!prop.isList()) {
+                        if(!asciiFloat(p, end, row[k])) return NULL;
+                        continue;
+                    }
+                    int n;
+                    if(!asciiInt(p, end, n) || n < 0 || (size_t)n > (size_t)(end - p) / 2) return NULL;
+                    ids.resize(n);
+                    for(int j = 0; j < n; ++j) {
+                        int id;
+                        if(!asciiInt(p, end, id)) return NULL;
+                        ids[j] = id;
+                    }
+                    if(isFace && (int)k == list) {
+                        addPolygon(ids.data(), n, nverts);
+                    }
+                }
+                if(isVertex) {
+                    for(int k = 0; k < 3; ++k) {
+                        verts[3*i + k] = vl.pos[k] >= 0 ? row[vl.pos[k]] : 0.0f;
+                    }
+                    for(int k = 0; vl.hasNormals && k < 3; ++k) {
+                        normals[3*i + k] = row[vl.normal[k]];
+                    }
+                    for(int k = 0; vl.hasTexcoords && k < 2; ++k) {
+                        texcoords[2*i + k] = row[vl.uv[k]];
+                    }
+                }
+                if(i % PLY_PROGRESS_ROWS == 0 && !report(p)) {
+                    return NULL;
+                }
+            }
+            return p;
+        }
+
+        void buildMesh(Trimesh *pmesh) {
+            size_t nverts = verts.size() / 3;
+            pmesh->reserve(nverts, tris.size() / 3);
+            pmesh->setFileNormals(!normals.empty());
+            for(size_t i = 0; i < nverts; ++i) {
+                pmesh->addVertex(&verts[3 * i], normals.empty() ? NULL : &normals[3 * i]);
+                if(!texcoords.empty()) pmesh->addTexcoord(&texcoords[2 * i]);
+            }
+            pmesh->addFaces(tris.data(), tris.size() / 3);
+        }
+
+    public:
+
+        PlyLoader(LoadProgress *progress = NULL) : progress(progress) {}
+
+        static bool isPLY(const char *data, size_t size) {
+            return size >= 4 && memcmp(data, "ply", 3) == 0 && (data[3] == '\n' || data[3] == '\r');
+        }
+
+        bool loadPLY(const char *plyfile, Trimesh *pmesh) {
+            MappedFile file(plyfile);
+            if(!file.isOpen() || !isPLY(file.data(), file.size())) return false;
+            if(progress) progress->total = file.size();
+
+            base = file.data();
+            const char *end = base + file.size();
+            PlyFormat format;
+            std::vector<PlyElement> elements;
+            const char *p = parseHeader(base, end, format, elements);
+            if(p == NULL) return false;
+            swap = format == PLY_BINARY_BE;
+
+            // Faces are checked against the vertex count, which the header
+            // already gives even if the face element comes first
+            size_t nverts = 0;
+            for(const PlyElement &el : elements) {
+                if(el.name == "vertex") nverts = el.count;
+            }
+
+            verts.clear();
+            normals.clear();
+            texcoords.clear();
+            tris.clear();
+            for(const PlyElement &el : elements) {
+                if(!fits(el, format, end - p)) return false;
+                if(format == PLY_ASCII) {
+                    p = asciiElement(p, end, el, nverts);
+                } else if(el.name == "vertex") {
+                    p = binaryVertices(p, end, el);
+                } else if(el.name == "face") {
+                    p = binaryFaces(p, end, el, nverts);
+                } else {
+                    size_t row = rowSize(el);
+                    if(row > 0) {
+                        p = el.count <= (size_t)(end - p) / row ? p + row * el.count : NULL;
+                    } else {
+                        std::vector<const char*> at;
+                        for(size_t i = 0; i < el.count && p != NULL; ++i) {
+                            p = binaryRow(p, end, el, at);
+                        }
+                    }
+                }
+                if(p == NULL || !report(p)) return false;
+            }
+
+            buildMesh(pmesh);
+            report(end);
+            return true;
+        }
+};
+
+#endif
@@ -0,0 +1,518 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __PMESH_H__
+#define __PMESH_H__
+
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "geom.h"
+#include "simplify.h"
+#include "loadpool.h"
+#include "lod.h"
+
+#define PM_EXT     ".tpm"
+#define PM_VERSION 1
+
+// Faces the base mesh is simplified down to
+#define PM_BASE_FACES 64
+
+// Bytes read from the file at a time while streaming; the splits they
+// complete are shown before the next block is read
+#define PM_READ_BLOCK (256 << 10)
+
+// Progressive mesh file, coarsest first so any prefix of it is a mesh:
+//
+//     ProgressiveFileHeader
+//     float    positions[3 * baseVerts]
+//     float    normals[3 * baseVerts]
+//     uint32_t faces[3 * baseFaces]
+//     per split, in order:
+//         SplitRecord
+//         uint32_t faces[3 * nfaces]         (the faces it brings back)
+//         uint32_t corners[ncorners]         (3 * face + k of moved corners)
+//
+// nfaces and ncorners in the header are the totals once every split is in.
+struct ProgressiveFileHeader {
+    char     magic[4];
+    uint32_t version;
+    uint32_t baseVerts;
+    uint32_t baseFaces;
+    uint32_t nsplits;
+    float    baseError;
+    uint64_t nfaces;
+    uint64_t ncorners;
+    float    bounds[6];
+};
+
+// Split i brings back vertex baseVerts + i, split off its parent
+struct SplitRecord {
+    float    position[3];
+    float    normal[3];
+    uint32_t parent;
+    uint32_t nfaces;
+    uint32_t ncorners;
+    // Error of the mesh once this split is made
+    float    error;
+};
+
+// A mesh as a coarse base mesh and the vertex splits that refine it back
+// to the full mesh, after Hoppe, "Progressive meshes". The splits undo the
+// collapses of MeshSimplifier in reverse. Vertices and faces are numbered
+// in the order they come back, so the mesh after n splits is a prefix of
+// the vertex array and of the face array: a split appends its faces and
+// moves a few corners of earlier faces from the parent to the new vertex,
+// and undoing it moves them back and drops the faces off the end. Going
+// from one face count to another costs time in proportion to the splits
+// between them, not to the size of the mesh.
+//
+// Each frame draw() refines or coarsens to the fewest splits whose error,
+// projected like a LodChain level, stays under LodChain::pixelError(),
+// with the same hysteresis before coarsening.
+//
+// open() reads only the header and the base mesh; the splits are read on
+// the load pool in order and the mesh can refine as far as they have come.
+// Normals are those of the full mesh. Materials and texture coordinates
+// are not kept.
+class ProgressiveMesh {
+
+    friend class MeshExporter;
+
+    private:
+
+        // Everything the file holds, allocated in full up front. Shared
+        // with the reading job, which fills the splits in order and bumps
+        // available once one is complete; the GLUT thread only reads up
+        // to available.
+        struct Store {
+            ProgressiveFileHeader header;
+            std::vector<float> positions, normals;
+            // Faces as each one is when its split brings it back, base faces
+            // first
+            std::vector<uint32_t> born;
+            std::vector<uint32_t> corners;
+            // Per split: the parent, the faces and corners after it, and the
+            // error once it is made
+            std::vector<uint32_t> parents, faceEnds, cornerEnds;
+            std::vector<float> errors;
+            std::atomic<size_t> available{0};
+            std::atomic<bool> cancel{false};
+            int fd = -1;
+
+            Store(const ProgressiveFileHeader &h) : header(h) {
+                positions.resize(3 * ((size_t)h.baseVerts + h.nsplits));
+                normals.resize(positions.size());
+                born.resize(3 * h.nfaces);
+                corners.resize(h.ncorners);
+                parents.resize(h.nsplits);
+                faceEnds.resize(h.nsplits);
+                cornerEnds.resize(h.nsplits);
+                errors.resize(h.nsplits);
+            }
+
+            ~Store() {
+                if(fd >= 0) close(fd);
+            }
+        };
+
+        std::shared_ptr<Store> store;
+
+        // The faces after the splits made so far
+        std::vector<uint32_t> faces;
+        size_t splits = 0;
+
+        float center[3], radius;
+
+        ProgressiveMesh(std::shared_ptr<Store> s) : store(s) {
+            const ProgressiveFileHeader &h = s->header;
+            faces.resize(3 * h.nfaces);
+            memcpy(faces.data(), s->born.data(), 3 * (size_t)h.baseFaces * sizeof(uint32_t));
+            float r2 = 0.0f;
+            for(int k = 0; k < 3; ++k) {
+                center[k] = (h.bounds[k] + h.bounds[k + 3]) / 2.0f;
+                r2 += (h.bounds[k + 3] - h.bounds[k]) * (h.bounds[k + 3] - h.bounds[k]) / 4.0f;
+            }
+            radius = sqrtf(r2);
+        }
+
+        size_t faceStart(size_t i) const { return i == 0 ? store->header.baseFaces : store->faceEnds[i - 1]; }
+
+        size_t cornerStart(size_t i) const { return i == 0 ? 0 : store->cornerEnds[i - 1]; }
+
+        // Error of the mesh after n splits
+        float errorAt(size_t n) const { return n == 0 ? store->header.baseError : store->errors[n - 1]; }
+
+        // Fewest splits up to last whose error covers at most limit pixels
+        size_t fewest(size_t last, float perUnit, float limit) const {
+            size_t lo = 0, hi = last;
+            while(lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if(errorAt(mid) * perUnit <= limit) hi = mid;
+                else lo = mid + 1;
+            }
+            return lo;
+        }
+
+        // Reads the splits after the base mesh, starting at offset, until
+        // the file ends, a split does not check out or the mesh is gone
+        static void stream(std::shared_ptr<Store> s, uint64_t offset) {
+            const ProgressiveFileHeader &h = s->header;
+            std::vector<char> buf;
+            size_t used = 0, at = 0;
+            size_t nverts = h.baseVerts, nfaces = h.baseFaces, ncorners = 0;
+            for(size_t i = 0; i < h.nsplits && !s->cancel; ) {
+                // Keep the unread tail and add the next block
+                buf.erase(buf.begin(), buf.begin() + at);
+                used -= at;
+                at = 0;
+                buf.resize(used + PM_READ_BLOCK);
+                ssize_t n = pread(s->fd, buf.data() + used, PM_READ_BLOCK, offset);
+                if(n <= 0) {
+                    return;
+                }
+                used += n;
+                offset += n;
+
+                // Every split the buffer holds in full
+                size_t before = i;
+                while(i < h.nsplits && used - at >= sizeof(SplitRecord)) {
+                    SplitRecord r;
+                    memcpy(&r, buf.data() + at, sizeof(r));
+                    size_t bytes = sizeof(r) + ((size_t)r.nfaces * 3 + r.ncorners) * sizeof(uint32_t);
+                    if(nfaces + r.nfaces > h.nfaces || ncorners + r.ncorners > h.ncorners || r.parent >= nverts) {
+                        return;
+                    }
+                    if(used - at < bytes) {
+                        break;
+                    }
+                    const uint32_t *born = (const uint32_t *)(buf.data() + at + sizeof(r));
+                    const uint32_t *moved = born + 3 * (size_t)r.nfaces;
+                    // Born faces may use the new vertex, moved corners belong
+                    // to faces that are already there
+                    for(size_t k = 0; k < 3 * (size_t)r.nfaces; ++k) {
+                        if(born[k] > nverts) return;
+                    }
+                    for(size_t k = 0; k < r.ncorners; ++k) {
+                        if(moved[k] >= 3 * nfaces) return;
+                    }
+                    memcpy(&s->positions[3 * nverts], r.position, sizeof(r.position));
+                    memcpy(&s->normals[3 * nverts], r.normal, sizeof(r.normal));
+                    memcpy(&s->born[3 * nfaces], born, 3 * (size_t)r.nfaces * sizeof(uint32_t));
+                    memcpy(&s->corners[ncorners], moved, r.ncorners * sizeof(uint32_t));
+                    nverts++;
+                    nfaces   += r.nfaces;
+                    ncorners += r.ncorners;
+                    s->parents[i]    = r.parent;
+                    s->faceEnds[i]   = nfaces;
+                    s->cornerEnds[i] = ncorners;
+                    s->errors[i]     = r.error;
+                    at += bytes;
+                    i++;
+                }
+                if(i > before) {
+                    s->available.store(i, std::memory_order_release);
+                }
+            }
+        }
+
+    public:
+
+        ~ProgressiveMesh() {
+            store->cancel = true;
+        }
+
+        static bool isProgressive(const std::string &filename) {
+            size_t n = strlen(PM_EXT);
+            return filename.size() >= n && strcasecmp(filename.c_str() + filename.size() - n, PM_EXT) == 0;
+        }
+
+        // Simplifies mesh down to about baseFaces faces and keeps every
+        // collapse as a split. Degenerate faces and unused vertices of mesh
+        // are dropped. Null if mesh has no faces.
+        static ProgressiveMesh *build(const Trimesh *mesh, size_t baseFaces = PM_BASE_FACES) {
+            size_t nv = mesh->numVerts(), nf = mesh->numFaces();
+            if(nf == 0) {
+                return NULL;
+            }
+            MeshSimplifier s(mesh);
+            CollapseHistory hist;
+            s.record(&hist);
+            s.simplify(baseFaces);
+            const std::vector<CollapseRecord> &cs = hist.collapses;
+            size_t nsplits = cs.size();
+
+            // Vertices in the order they come back: the base mesh, then the
+            // collapsed ones, last collapse first. A vertex whose faces all
+            // went with a collapse it was not part of is never collapsed
+            // itself, so it joins the base mesh without any faces.
+            std::vector<uint32_t> vertId(nv, UINT32_MAX);
+            size_t baseVerts = 0;
+            for(uint32_t v : s.vertexOrigins()) {
+                vertId[v] = baseVerts++;
+            }
+            for(const CollapseRecord &c : cs) {
+                vertId[c.from] = 0;
+            }
+            const uint32_t *ids = mesh->getIndices();
+            for(size_t i = 0; i < 3 * nf; ++i) {
+                if(vertId[ids[i]] == UINT32_MAX) {
+                    vertId[ids[i]] = baseVerts++;
+                }
+            }
+            for(size_t i = 0; i < nsplits; ++i) {
+                vertId[cs[nsplits - 1 - i].from] = baseVerts + i;
+            }
+
+            // Faces likewise: the base mesh, then the faces of each split
+            std::vector<uint32_t> faceId(nf, UINT32_MAX);
+            size_t nfaces = 0;
+            for(uint32_t f : s.faceOrigins()) {
+                faceId[f] = nfaces++;
+            }
+            for(size_t i = 0; i < nsplits; ++i) {
+                size_t j = nsplits - 1 - i;
+                for(size_t k = j == 0 ? 0 : cs[j - 1].faceEnd; k < cs[j].faceEnd; ++k) {
+                    faceId[hist.faces[k]] = nfaces++;
+                }
+            }
+
+            ProgressiveFileHeader h;
+            memset(&h, 0, sizeof(h));
+            memcpy(h.magic, "TPM", 4);
+            h.version   = PM_VERSION;
+            h.baseVerts = baseVerts;
+            h.baseFaces = s.numFaces();
+            h.nsplits   = nsplits;
+            h.nfaces    = nfaces;
+            h.ncorners  = hist.corners.size();
+            memcpy(h.bounds, mesh->getBounds(), sizeof(h.bounds));
+            std::shared_ptr<Store> st = std::make_shared<Store>(h);
+
+            const float *p = mesh->getPositions(), *n = mesh->getNormals();
+            for(size_t v = 0; v < nv; ++v) {
+                if(vertId[v] != UINT32_MAX) {
+                    memcpy(&st->positions[3 * (size_t)vertId[v]], &p[3 * v], 3 * sizeof(float));
+                    memcpy(&st->normals[3 * (size_t)vertId[v]], &n[3 * v], 3 * sizeof(float));
+                }
+            }
+
+            // Replay the collapses on the full faces, taking each face as it
+            // is when its collapse takes it away
+            std::vector<uint32_t> cur(ids, ids + 3 * nf);
+            for(size_t j = 0; j < nsplits; ++j) {
+                for(size_t k = j == 0 ? 0 : cs[j - 1].faceEnd; k < cs[j].faceEnd; ++k) {
+                    size_t f = hist.faces[k];
+                    for(int c = 0; c < 3; ++c) {
+                        st->born[3 * (size_t)faceId[f] + c] = vertId[cur[3 * f + c]];
+                    }
+                }
+                for(size_t k = j == 0 ? 0 : cs[j - 1].cornerEnd; k < cs[j].cornerEnd; ++k) {
+                    cur[hist.corners[k]] = cs[j].to;
+                }
+            }
+            for(uint32_t f : s.faceOrigins()) {
+                for(int c = 0; c < 3; ++c) {
+                    st->born[3 * (size_t)faceId[f] + c] = vertId[cur[3 * (size_t)f + c]];
+                }
+            }
+
+            // The errors only ever grew while collapsing, so the worst one
+            // still in place is the largest up to there
+            std::vector<float> worst(nsplits);
+            for(size_t j = 0; j < nsplits; ++j) {
+                worst[j] = std::max(cs[j].error, j == 0 ? 0.0f : worst[j - 1]);
+            }
+            st->header.baseError = nsplits == 0 ? 0.0f : worst[nsplits - 1];
+            size_t face = h.baseFaces, corner = 0;
+            for(size_t i = 0; i < nsplits; ++i) {
+                size_t j = nsplits - 1 - i;
+                face += cs[j].faceEnd - (j == 0 ? 0 : cs[j - 1].faceEnd);
+                st->parents[i]  = vertId[cs[j].to];
+                st->faceEnds[i] = face;
+                for(size_t k = j == 0 ? 0 : cs[j - 1].cornerEnd; k < cs[j].cornerEnd; ++k) {
+                    uint32_t c = hist.corners[k];
+                    st->corners[corner++] = 3 * faceId[c / 3] + c % 3;
+                }
+                st->cornerEnds[i] = corner;
+                st->errors[i]     = j == 0 ? 0.0f : worst[j - 1];
+            }
+            st->available = nsplits;
+            return new ProgressiveMesh(st);
+        }
+
+        // Reads the header and the base mesh and starts reading the splits
+        // on the load pool. Null if the file is missing or damaged.
+        static std::shared_ptr<ProgressiveMesh> open(const std::string &filename) {
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if(fd < 0) {
+                return NULL;
+            }
+            struct stat st;
+            ProgressiveFileHeader h;
+            uint64_t baseBytes = 0, totalBytes = 0;
+            if(fstat(fd, &st) == 0 && pread(fd, &h, sizeof(h), 0) == sizeof(h)) {
+                baseBytes  = sizeof(h) + (uint64_t)h.baseVerts * 6 * sizeof(float) +
+                             (uint64_t)h.baseFaces * 3 * sizeof(uint32_t);
+                totalBytes = baseBytes + (uint64_t)h.nsplits * sizeof(SplitRecord) +
+                             ((h.nfaces - h.baseFaces) * 3 + h.ncorners) * sizeof(uint32_t);
+            }
+            // The file may be cut short anywhere after the base mesh
+            if(baseBytes == 0 || memcmp(h.magic, "TPM", 4) != 0 || h.version != PM_VERSION ||
+               h.nfaces < h.baseFaces || h.nfaces > UINT32_MAX / 3 || h.ncorners > UINT32_MAX ||
+               (uint64_t)h.baseVerts + h.nsplits > UINT32_MAX || baseBytes > (uint64_t)st.st_size ||
+               totalBytes < baseBytes) {
+                ::close(fd);
+                return NULL;
+            }
+            // The store is sized from the header. A file cut short has
+            // totals no bytes back, so they are capped by what the bytes
+            // after the base mesh could hold.
+            if(totalBytes > (uint64_t)st.st_size) {
+                uint64_t rest = st.st_size - baseBytes;
+                h.nsplits  = std::min<uint64_t>(h.nsplits, rest / sizeof(SplitRecord));
+                h.nfaces   = std::min<uint64_t>(h.nfaces, h.baseFaces + rest / (3 * sizeof(uint32_t)));
+                h.ncorners = std::min<uint64_t>(h.ncorners, rest / sizeof(uint32_t));
+            }
+            std::shared_ptr<Store> s = std::make_shared<Store>(h);
+            s->fd = fd;
+            size_t pbytes = 3 * (size_t)h.baseVerts * sizeof(float), fbytes = 3 * (size_t)h.baseFaces * sizeof(uint32_t);
+            if(pread(fd, s->positions.data(), pbytes, sizeof(h)) != (ssize_t)pbytes ||
+               pread(fd, s->normals.data(), pbytes, sizeof(h) + pbytes) != (ssize_t)pbytes ||
+               pread(fd, s->born.data(), fbytes, sizeof(h) + 2 * pbytes) != (ssize_t)fbytes) {
+                return NULL;
+            }
+            for(size_t k = 0; k < 3 * (size_t)h.baseFaces; ++k) {
+                if(s->born[k] >= h.baseVerts) return NULL;
+            }
+            std::shared_ptr<ProgressiveMesh> m(new ProgressiveMesh(s));
+            LoadPool::instance().submit([s, baseBytes] { stream(s, baseBytes); });
+            return m;
+        }
+
+        size_t numVerts() const { return store->header.baseVerts + splits; }
+
+        size_t numFaces() const { return faceStart(splits); }
+
+        // Faces of the full mesh
+        size_t maxFaces() const { return store->header.nfaces; }
+
+        size_t numSplits() const { return splits; }
+
+        size_t maxSplits() const { return store->header.nsplits; }
+
+        // Splits read so far
+        size_t numAvailable() const { return store->available.load(std::memory_order_acquire); }
+
+        // How far the current mesh strays from the full mesh, in the units
+        // of its positions
+        float error() const { return errorAt(splits); }
+
+        // Makes or undoes splits until n are made, as far as they have been
+        // read
+        void setSplits(size_t n) {
+            const Store &s = *store;
+            n = std::min(n, numAvailable());
+            for(; splits < n; ++splits) {
+                uint32_t v = s.header.baseVerts + splits;
+                size_t first = faceStart(splits);
+                memcpy(&faces[3 * first], &s.born[3 * first], 3 * (s.faceEnds[splits] - first) * sizeof(uint32_t));
+                for(size_t k = cornerStart(splits); k < s.cornerEnds[splits]; ++k) {
+                    faces[s.corners[k]] = v;
+                }
+            }
+            for(; splits > n; --splits) {
+                uint32_t parent = s.parents[splits - 1];
+                for(size_t k = cornerStart(splits - 1); k < s.cornerEnds[splits - 1]; ++k) {
+                    faces[s.corners[k]] = parent;
+                }
+            }
+        }
+
+        // Refines or coarsens to the fewest splits with at least f faces
+        void setFaceCount(size_t f) {
+            size_t lo = 0, hi = numAvailable();
+            while(lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if(faceStart(mid) >= f) hi = mid;
+                else lo = mid + 1;
+            }
+            setSplits(lo);
+        }
+
+        // The current mesh as a Trimesh of its own
+        Trimesh *extract() const {
+            Trimesh *m = new Trimesh();
+            m->reserve(numVerts(), numFaces());
+            for(size_t v = 0; v < numVerts(); ++v) {
+                m->addVertex(&store->positions[3 * v]);
+            }
+            m->addFaces(reinterpret_cast<const int*>(faces.data()), numFaces());
+            return m;
+        }
+
+        // Picks the detail for the current modelview matrix and draws it
+        void draw(int mode) {
+            size_t last = numAvailable(), n = last;
+            float perUnit = LodChain::pixelsPerUnit(center, radius);
+            if(LodChain::enabled() && perUnit > 0.0f) {
+                float limit = LodChain::pixelError();
+                n = fewest(last, perUnit, limit);
+                if(n < splits) {
+                    n = std::min(splits, fewest(last, perUnit, limit * (1.0f - LodChain::hysteresis())));
+                }
+            }
+            setSplits(n);
+
+            glMatrixMode(GL_MODELVIEW);
+            glEnableClientState(GL_VERTEX_ARRAY);
+            glEnableClientState(GL_NORMAL_ARRAY);
+            glVertexPointer(3, GL_FLOAT, 0, store->positions.data());
+            glNormalPointer(GL_FLOAT, 0, store->normals.data());
+            switch(mode) {
+                case MODE_POINT:
+                    glColor3f(1.0f, 0.0f, 0.0f);
+                    glPointSize(3.0);
+                    glDrawArrays(GL_POINTS, 0, numVerts());
+                    break;
+                // No edge lists, so both outline every face
+                case MODE_WIRE:
+                case MODE_FEATURE:
+                    glColor3f(0.0f, 1.0f, 0.0f);
+                    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+                    glDrawElements(GL_TRIANGLES, 3 * numFaces(), GL_UNSIGNED_INT, faces.data());
+                    break;
+                case MODE_SOLID:
+                    glColor3f(0.6f, 0.6f, 0.6f);
+                    glPolygonMode(GL_FRONT, GL_FILL);
+                    glDrawElements(GL_TRIANGLES, 3 * numFaces(), GL_UNSIGNED_INT, faces.data());
+                    break;
+                case MODE_LIT:
+                    glColor3f(0.6f, 0.6f, 0.6f);
+                    glPolygonMode(GL_FRONT, GL_FILL);
+                    glEnable(GL_LIGHTING);
+                    glEnable(GL_LIGHT0);
+                    glEnable(GL_COLOR_MATERIAL);
+                    glEnable(GL_NORMALIZE);
+                    glDrawElements(GL_TRIANGLES, 3 * numFaces(), GL_UNSIGNED_INT, faces.data());
+                    break;
+            }
+            glDisable(GL_LIGHTING);
+            glDisableClientState(GL_VERTEX_ARRAY);
+            glDisableClientState(GL_NORMAL_ARRAY);
+        }
+};
+
+#endif
@@ -0,0 +1,281 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __REORDER_H__
+#define __REORDER_H__
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "geom.h"
+
+// Vertices the post-transform cache is assumed to hold, both for ordering
+// and for measuring
+#define REORDER_CACHE 16
+
+// Fewest faces in a cluster the overdraw ordering moves as one piece
+#define REORDER_MIN_CLUSTER 256
+
+// Reorders the faces of a mesh so consecutive triangles share vertices the
+// GPU still has transformed, following Tipsify (Sander, Nehab and Barczak,
+// "Fast triangle reordering for vertex locality and reduced overdraw"). It
+// walks the mesh fanning around one vertex at a time and picks as the next
+// fan the neighbor that will still be in the cache when its remaining faces
+// are emitted. When no neighbor has faces left it backs up to a recently
+// used vertex that does, or failing that starts over at the next face not
+// yet emitted. This is linear in the number of faces.
+//
+// The optional overdraw ordering cuts the result into clusters where the
+// walk had to back up, and draws the clusters that face away from the
+// middle of the mesh first, since those tend to occlude the rest. Each
+// cluster keeps its cache friendly order, so the cache misses hardly grow.
+//
+// Faces only move within their submesh, so material batches stay as they
+// are. Cache efficiency is reported as ACMR, the average number of vertices
+// transformed per triangle with a FIFO cache of REORDER_CACHE entries: 3 at
+// worst, about 0.5 for a regular mesh with an unlimited cache.
+class FaceReorder {
+
+    private:
+
+        bool overdraw;
+        int cacheSize;
+
+        // A run of faces of the new order
+        struct Cluster {
+            size_t first, last;
+            float key;
+        };
+
+        // Tipsify over faces [first, last), appending face ids to order and
+        // the start of each cluster to starts. live counts the faces of each
+        // vertex not yet emitted, stamp is the time a vertex last entered
+        // the cache.
+        void tipsify(const uint32_t *ids, const Adjacency &adj, size_t first, size_t last,
+                     std::vector<uint32_t> &live, std::vector<uint32_t> &stamp, uint32_t &time,
+                     std::vector<char> &emitted, std::vector<uint32_t> &order, std::vector<size_t> &starts) const {
+            for(size_t i = 3 * first; i < 3 * last; ++i) {
+                live[ids[i]]++;
+            }
+            std::vector<uint32_t> deadEnd, candidates;
+            size_t cursor = first;
+            int64_t fan = first < last ? (int64_t)ids[3 * first] : -1;
+            starts.push_back(order.size());
+
+            while(fan >= 0) {
+                candidates.clear();
+                for(uint32_t i = adj.offsets[fan]; i < adj.offsets[fan + 1]; ++i) {
+                    uint32_t f = adj.faces[i];
+                    if(f < first || f >= last || emitted[f]) {
+                        continue;
+                    }
+                    emitted[f] = 1;
+                    order.push_back(f);
+                    for(int k = 0; k < 3; ++k) {
+                        uint32_t v = ids[3 * (size_t)f + k];
+                        deadEnd.push_back(v);
+                        candidates.push_back(v);
+                        live[v]--;
+                        if(time - stamp[v] > (uint32_t)cacheSize) {
+                            stamp[v] = time++;
+                        }
+                    }
+                }
+
+                // The neighbor that will still be cached once its remaining
+                // faces are out, the one that entered the cache first
+                fan = -1;
+                int64_t best = -1;
+                for(uint32_t v : candidates) {
+                    if(live[v] == 0) {
+                        continue;
+                    }
+                    int64_t age = time - stamp[v];
+                    int64_t p = age + 2 * live[v] <= cacheSize ? age : 0;
+                    if(p > best) {
+                        best = p;
+                        fan  = v;
+                    }
+                }
+                if(fan >= 0) {
+                    continue;
+                }
+
+                // Dead end
+                while(!deadEnd.empty() && fan < 0) {
+                    uint32_t v = deadEnd.back();
+                    deadEnd.pop_back();
+                    if(live[v] > 0) {
+                        fan = v;
+                    }
+                }
+                while(fan < 0 && cursor < last) {
+                    if(!emitted[cursor]) {
+                        fan = ids[3 * cursor];
+                    }
+                    cursor++;
+                }
+                if(fan >= 0) {
+                    starts.push_back(order.size());
+                }
+            }
+        }
+
+        // Sorts the clusters of order[first, last) so the ones facing away
+        // from the middle come first. Clusters smaller than
+        // REORDER_MIN_CLUSTER are joined to the one before.
+        void sortClusters(const float *pos, const uint32_t *ids, size_t first, size_t last,
+                          const std::vector<size_t> &starts, std::vector<uint32_t> &order) const {
+            std::vector<Cluster> clusters;
+            for(size_t i = 0; i < starts.size(); ++i) {
+                size_t end = i + 1 < starts.size() ? starts[i + 1] : last;
+                if(end <= starts[i]) {
+                    continue;
+                }
+                if(!clusters.empty() && (end - starts[i] < REORDER_MIN_CLUSTER ||
+                                         clusters.back().last - clusters.back().first < REORDER_MIN_CLUSTER)) {
+                    clusters.back().last = end;
+                } else {
+                    Cluster c = { starts[i], end, 0.0f };
+                    clusters.push_back(c);
+                }
+            }
+            if(clusters.size() < 2) {
+                return;
+            }
+
+            // Area weighted normal and centroid of each cluster, and of them all
+            std::vector<double> sums(6 * clusters.size(), 0.0);
+            double mid[4] = { 0.0, 0.0, 0.0, 0.0 };
+            for(size_t c = 0; c < clusters.size(); ++c) {
+                double *s = &sums[6 * c];
+                double area = 0.0;
+                for(size_t i = clusters[c].first; i < clusters[c].last; ++i) {
+                    const float *a = &pos[3 * ids[3 * (size_t)order[i]]];
+                    const float *b = &pos[3 * ids[3 * (size_t)order[i] + 1]];
+                    const float *d = &pos[3 * ids[3 * (size_t)order[i] + 2]];
+                    double u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+                    double v[3] = { d[0] - a[0], d[1] - a[1], d[2] - a[2] };
+                    double n[3] = { u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2], u[0] * v[1] - u[1] * v[0] };
+                    double w = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                    for(int k = 0; k < 3; ++k) {
+                        s[k]     += n[k];
+                        s[k + 3] += w * (a[k] + b[k] + d[k]) / 3.0;
+                    }
+                    area += w;
+                }
+                for(int k = 0; k < 3; ++k) {
+                    mid[k] += s[k + 3];
+                    s[k + 3] = area > 0.0 ? s[k + 3] / area : 0.0;
+                }
+                mid[3] += area;
+            }
+            for(int k = 0; k < 3; ++k) {
+                mid[k] = mid[3] > 0.0 ? mid[k] / mid[3] : 0.0;
+            }
+            for(size_t c = 0; c < clusters.size(); ++c) {
+                const double *s = &sums[6 * c];
+                double len = sqrt(s[0] * s[0] + s[1] * s[1] + s[2] * s[2]);
+                double dot = 0.0;
+                for(int k = 0; k < 3; ++k) {
+                    dot += (s[k + 3] - mid[k]) * s[k];
+                }
+                clusters[c].key = len > 0.0 ? dot / len : 0.0;
+            }
+
+            std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster &a, const Cluster &b) {
+                return a.key > b.key;
+            });
+            std::vector<uint32_t> sorted;
+            sorted.reserve(last - first);
+            for(const Cluster &c : clusters) {
+                sorted.insert(sorted.end(), order.begin() + c.first, order.begin() + c.last);
+            }
+            std::copy(sorted.begin(), sorted.end(), order.begin() + first);
+        }
+
+    public:
+
+        FaceReorder(bool overdraw = false, int cacheSize = REORDER_CACHE) : overdraw(overdraw), cacheSize(cacheSize) {}
+
+        // Average vertices transformed per triangle drawing ids in order
+        // through a FIFO cache of cacheSize vertices
+        static double acmr(const uint32_t *ids, size_t nfaces, size_t nverts, int cacheSize = REORDER_CACHE) {
+            if(nfaces == 0) {
+                return 0.0;
+            }
+            std::vector<uint32_t> stamp(nverts, 0);
+            uint32_t time = cacheSize + 1;
+            size_t misses = 0;
+            for(size_t i = 0; i < 3 * nfaces; ++i) {
+                if(time - stamp[ids[i]] > (uint32_t)cacheSize) {
+                    stamp[ids[i]] = time++;
+                    misses++;
+                }
+            }
+            return (double)misses / nfaces;
+        }
+
+        static double acmr(const Trimesh *mesh, int cacheSize = REORDER_CACHE) {
+            return acmr(mesh->getIndices(), mesh->numFaces(), mesh->numVerts(), cacheSize);
+        }
+
+        // The faces of mesh in the new order, as an index array. Returns the
+        // number of clusters the walk broke into.
+        size_t order(const Trimesh *mesh, std::vector<uint32_t> &indices) const {
+            const uint32_t *ids = mesh->getIndices();
+            size_t nverts = mesh->numVerts(), nfaces = mesh->numFaces();
+            const Adjacency &adj = mesh->getAdjacency();
+
+            // Submesh ranges, or the whole mesh
+            std::vector<std::pair<size_t, size_t> > ranges;
+            for(const Submesh &sm : mesh->getSubmeshes()) {
+                ranges.push_back(std::make_pair((size_t)sm.first, (size_t)sm.first + sm.count));
+            }
+            if(ranges.empty()) {
+                ranges.push_back(std::make_pair((size_t)0, nfaces));
+            }
+
+            std::vector<uint32_t> live(nverts, 0), stamp(nverts, 0), order;
+            std::vector<char> emitted(nfaces, 0);
+            uint32_t time = cacheSize + 1;
+            order.reserve(nfaces);
+            size_t nclusters = 0;
+            size_t covered = 0;
+            for(const std::pair<size_t, size_t> &r : ranges) {
+                // Faces between submeshes keep their place
+                for(size_t f = covered; f < r.first; ++f) {
+                    order.push_back(f);
+                }
+                std::vector<size_t> starts;
+                size_t at = order.size();
+                tipsify(ids, adj, r.first, r.second, live, stamp, time, emitted, order, starts);
+                if(overdraw) {
+                    sortClusters(mesh->getPositions(), ids, at, order.size(), starts, order);
+                }
+                nclusters += starts.size();
+                covered = r.second;
+            }
+            for(size_t f = covered; f < nfaces; ++f) {
+                order.push_back(f);
+            }
+
+            indices.resize(3 * nfaces);
+            for(size_t i = 0; i < nfaces; ++i) {
+                memcpy(&indices[3 * i], &ids[3 * (size_t)order[i]], 3 * sizeof(uint32_t));
+            }
+            return nclusters;
+        }
+
+        // Reorders the faces of mesh in place
+        void apply(Trimesh *mesh) const {
+            std::vector<uint32_t> indices;
+            order(mesh, indices);
+            mesh->setIndices(indices.data());
+        }
+};
+
+#endif
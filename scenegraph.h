@@ -4,7 +4,17 @@
 #ifndef __SCENEGRAPH_H__
 #define __SCENEGRAPH_H__
 
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <glob.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
 #include "nodes.h"
+#include "glbloader.h"
+#include "exporter.h"
 
 class SceneGraph {
     
@@ -22,13 +32,123 @@ class SceneGraph {
                 n->draw();
 
                 ParentNode *p = static_cast<ParentNode*>(n);
-                for(int i = 0; i < p->children.size(); ++i) {
+                for(size_t i = 0; i < p->children.size(); ++i) {
                     draw(p->children[i]);
                 }
             }
             glPopMatrix();
         }
 
+        // Turns glTF node idx and its descendants into transform nodes.
+        // TransformNode applies translation, scale, rotation in that order
+        // while glTF applies translation, rotation, scale, so a non-uniform
+        // scale goes into a child transform of its own.
+        SGNode *importNode(const GlbFile &file, int idx, std::vector<MeshHandle> &meshes, int depth) {
+            const JsonValue &n = file.doc()["nodes"][idx];
+            if(!n.isObject() || depth > (int)file.doc()["nodes"].size()) {
+                return NULL;
+            }
+            TransformNode *t = new TransformNode(n["name"].isString() ? n["name"].str : "Node " + std::to_string(idx));
+            TransformNode *inner = t;
+            if(n["matrix"].size() == 16) {
+                file.nodeMatrix(idx, t->rotation);
+                t->translation = Point(t->rotation[12], t->rotation[13], t->rotation[14]);
+                t->rotation[12] = t->rotation[13] = t->rotation[14] = 0.0f;
+            } else {
+                file.rotationMatrix(idx, t->rotation);
+                const JsonValue &tr = n["translation"];
+                const JsonValue &sc = n["scale"];
+                t->translation = Point(tr[0].num(), tr[1].num(), tr[2].num());
+                Point scale(sc[0].num(1), sc[1].num(1), sc[2].num(1));
+                if(scale.x == scale.y && scale.y == scale.z) {
+                    t->scaling = scale;
+                } else {
+                    inner = new TransformNode("Scale");
+                    inner->scaling = scale;
+                    t->addChild(inner);
+                }
+            }
+
+            int mesh = n["mesh"].integer();
+            if(mesh >= 0 && (size_t)mesh < meshes.size()) {
+                if(meshes[mesh] == NULL) {
+                    Trimesh *m = new Trimesh();
+                    if(file.buildMesh(mesh, m)) {
+                        meshes[mesh] = MeshHandle(m);
+                    } else {
+                        std::cout << "Error: could not read mesh " << mesh << std::endl;
+                        delete m;
+                    }
+                }
+                if(meshes[mesh] != NULL) {
+                    ObjectNode *o = new ObjectNode(file.meshName(mesh));
+                    o->geom = new GeometryNode();
+                    o->geom->setModel(meshes[mesh]);
+                    inner->addChild(o);
+                }
+            }
+            for(size_t i = 0; i < n["children"].size(); ++i) {
+                inner->addChild(importNode(file, n["children"][i].integer(), meshes, depth + 1));
+            }
+            return t;
+        }
+
+        // Collects the meshes below n with the matrix each is drawn with.
+        // Matrices are stored 16 floats per object in order.
+        static void collectMeshes(SGNode *n, const float *parent, std::vector<ExportItem> &items,
+                                  std::vector<float> &matrices) {
+            float m[16];
+            memcpy(m, parent, sizeof(m));
+            if(n->getNodeType() == NODE_TRANSFORM) {
+                static_cast<TransformNode*>(n)->applyTo(m);
+            } else if(n->getNodeType() == NODE_OBJECT) {
+                ObjectNode *o = static_cast<ObjectNode*>(n);
+                if(o->geom != NULL && o->geom->getModel() != NULL) {
+                    ExportItem it = { o->getName(), o->geom->getModel(), NULL };
+                    items.push_back(it);
+                    matrices.insert(matrices.end(), m, m + 16);
+                }
+            } else {
+                return;
+            }
+            ParentNode *p = static_cast<ParentNode*>(n);
+            for(size_t i = 0; i < p->children.size(); ++i) {
+                collectMeshes(p->children[i], m, items, matrices);
+            }
+        }
+
+        // The loadable files in a directory, or the files matching a glob
+        // pattern, sorted by name
+        static std::vector<std::string> listMeshFiles(const std::string &pattern) {
+            std::vector<std::string> files;
+            struct stat st;
+            if(stat(pattern.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+                std::string dir = pattern.back() == '/' ? pattern : pattern + "/";
+                DIR *d = opendir(dir.c_str());
+                for(struct dirent *e; d != NULL && (e = readdir(d)) != NULL; ) {
+                    if(MeshCache::isMeshFile(e->d_name)) {
+                        files.push_back(dir + e->d_name);
+                    }
+                }
+                if(d != NULL) closedir(d);
+                std::sort(files.begin(), files.end());
+            } else {
+                glob_t g;
+                if(glob(pattern.c_str(), 0, NULL, &g) == 0) {
+                    for(size_t i = 0; i < g.gl_pathc; ++i) {
+                        files.push_back(g.gl_pathv[i]);
+                    }
+                }
+                globfree(&g);
+            }
+            // Only regular files, globs may also match directories
+            files.erase(std::remove_if(files.begin(), files.end(), [](const std::string &f) {
+                struct stat st;
+                return stat(f.c_str(), &st) != 0 || !S_ISREG(st.st_mode);
+            }), files.end());
+            return files;
+        }
+
     public:
 
         SceneGraph() {
@@ -55,7 +175,7 @@ class SceneGraph {
             int type = current->getNodeType();
             if(type == NODE_TRANSFORM || type == NODE_OBJECT) {
                 ParentNode *p = static_cast<ParentNode*>(current);
-                if(idx < p->children.size()) {
+                if(idx >= 0 && (size_t)idx < p->children.size()) {
                     current = p->children[idx];
                 }
             }
@@ -118,6 +238,90 @@ class SceneGraph {
             return n;
         }
 
+        // Adds the default scene of a .glb file below the current node, as
+        // one transform node per glTF node. Nodes sharing a mesh share it
+        // in memory too.
+        SGNode *importGLB(const std::string &path) {
+            if(current->getNodeType() != NODE_OBJECT && current->getNodeType() != NODE_TRANSFORM) {
+                std::cout << "Error: cannot add child to node types other than Object or Transform" << std::endl;
+                return NULL;
+            }
+            GlbFile file;
+            if(!file.open(path.c_str())) {
+                std::cout << "Error: could not open " << path << std::endl;
+                return NULL;
+            }
+            std::vector<MeshHandle> meshes(file.numMeshes());
+            std::vector<int> roots = file.sceneRoots();
+            TransformNode *t = new TransformNode(path.substr(path.find_last_of('/') + 1));
+            for(int root : roots) {
+                t->addChild(importNode(file, root, meshes, 0));
+            }
+            static_cast<ParentNode*>(current)->addChild(t);
+            return t;
+        }
+
+        // Adds one object node per file in a directory or matching a glob
+        // pattern, under a new transform node below the current node. The
+        // files load concurrently on the load pool, and each object's
+        // geometry shows up as soon as its own file is done. The largest
+        // files are queued first so they do not end up finishing last.
+        SGNode *importFiles(const std::string &pattern) {
+            if(current->getNodeType() != NODE_OBJECT && current->getNodeType() != NODE_TRANSFORM) {
+                std::cout << "Error: cannot add child to node types other than Object or Transform" << std::endl;
+                return NULL;
+            }
+            std::vector<std::string> files = listMeshFiles(pattern);
+            if(files.empty()) {
+                std::cout << "Error: no mesh files match " << pattern << std::endl;
+                return NULL;
+            }
+
+            std::string dir = pattern.substr(0, pattern.find_last_not_of('/') + 1);
+            TransformNode *t = new TransformNode(dir.substr(dir.find_last_of('/') + 1));
+            std::vector<std::pair<off_t, size_t> > order;
+            for(size_t i = 0; i < files.size(); ++i) {
+                ObjectNode *o = new ObjectNode(files[i].substr(files[i].find_last_of('/') + 1));
+                o->geom = new GeometryNode();
+                t->addChild(o);
+                struct stat st;
+                order.push_back(std::make_pair(stat(files[i].c_str(), &st) == 0 ? -st.st_size : 0, i));
+            }
+            std::sort(order.begin(), order.end());
+            for(size_t i = 0; i < order.size(); ++i) {
+                size_t idx = order[i].second;
+                static_cast<ObjectNode*>(t->children[idx])->geom->loadModelAsync(files[idx]);
+            }
+            static_cast<ParentNode*>(current)->addChild(t);
+            std::cout << "Importing " << files.size() << " files on " << LoadPool::instance().size()
+                      << " threads" << std::endl;
+            return t;
+        }
+
+        // Saves every loaded mesh in the scene into one .obj or .ply file,
+        // each with its world transform baked into the vertices. The camera
+        // transform is left out, like the scene's own view of it.
+        bool exportScene(const std::string &path) {
+            std::vector<ExportItem> items;
+            std::vector<float> matrices;
+            const float identity[16] = { 1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1 };
+            for(size_t i = 1; i < root->children.size(); ++i) {
+                collectMeshes(root->children[i], identity, items, matrices);
+            }
+            for(size_t i = 0; i < items.size(); ++i) {
+                items[i].matrix = &matrices[16 * i];
+            }
+            if(items.empty()) {
+                std::cout << "Error: nothing to export" << std::endl;
+                return false;
+            }
+            if(!MeshExporter().save(path, items)) {
+                std::cout << "Error: could not write " << path << std::endl;
+                return false;
+            }
+            return true;
+        }
+
         void deleteChild(int idx) {
             if(current->getNodeType() == NODE_OBJECT || current->getNodeType() == NODE_TRANSFORM) {
                 static_cast<ParentNode*>(current)->deleteChild(idx);
@@ -125,8 +329,9 @@ class SceneGraph {
         }
 
         void display() {
+            ChunkedMesh::beginFrame();
             camera->draw();
-            for(int i = 1; i < root->children.size(); ++i) {
+            for(size_t i = 1; i < root->children.size(); ++i) {
                 draw(root->children[i]);
             }
         }
@@ -0,0 +1,287 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __SIDECAR_H__
+#define __SIDECAR_H__
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "geom.h"
+#include "mapfile.h"
+
+#define SIDECAR_EXT     ".tmc"
+#define SIDECAR_VERSION 7
+#define SIDECAR_NAME    64
+
+// Binary copy of a parsed mesh stored next to its source file. The header
+// identifies the source it was built from, followed by flat arrays:
+//
+//     float    positions[3 * nverts]
+//     float    vertNormals[3 * nverts]     (only when fileNormals is set)
+//     uint32_t indices[3 * nfaces]         (in vertex cache order)
+//     float    texcoords[2 * ntexcoords]   (ntexcoords is 0 or nverts)
+//     SidecarMaterial materials[nmaterials]
+//     SidecarSubmesh  submeshes[nsubmeshes]
+//
+// Names longer than SIDECAR_NAME - 1 bytes are cut short.
+//
+// A loaded mesh draws its positions and indices straight from the mapped
+// sidecar, which stays mapped while the mesh lives. Sidecars are only ever
+// replaced by a rename, so a mapping never sees its file change.
+struct SidecarHeader {
+    char     magic[4];
+    uint32_t version;
+    uint64_t srcSize;
+    int64_t  srcMtime;
+    uint64_t srcHash;
+    uint32_t nverts;
+    uint32_t nfaces;
+    uint32_t ntexcoords;
+    uint32_t fileNormals;
+    uint32_t nmaterials;
+    uint32_t nsubmeshes;
+};
+
+struct SidecarMaterial {
+    char  name[SIDECAR_NAME];
+    float ambient[3];
+    float diffuse[4];
+    float specular[3];
+    float shininess;
+};
+
+struct SidecarSubmesh {
+    char     name[SIDECAR_NAME];
+    int32_t  material;
+    uint32_t first;
+    uint32_t count;
+};
+
+class MeshSidecar {
+
+    private:
+
+        static std::string sidecarPath(const std::string &src) {
+            return src + SIDECAR_EXT;
+        }
+
+        static int64_t mtimeOf(const struct stat &st) {
+            return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        }
+
+        static size_t payloadSize(const SidecarHeader &h) {
+            return sizeof(SidecarHeader) + (size_t)h.nverts * (h.fileNormals ? 24 : 12) + (size_t)h.nfaces * 12 +
+                   (size_t)h.ntexcoords * 8 + (size_t)h.nmaterials * sizeof(SidecarMaterial) +
+                   (size_t)h.nsubmeshes * sizeof(SidecarSubmesh);
+        }
+
+        // A sidecar is current if the source has the same size and either
+        // the same mtime, or the same contents after being touched or copied.
+        // In the latter case mtime is set to the new one, otherwise to the
+        // stored one.
+        static bool isCurrent(const std::string &src, const SidecarHeader &h, int64_t &mtime) {
+            struct stat st;
+            if(stat(src.c_str(), &st) != 0 || (uint64_t)st.st_size != h.srcSize) {
+                return false;
+            }
+            mtime = mtimeOf(st);
+            if(mtime == h.srcMtime) {
+                return true;
+            }
+            MappedFile source(src.c_str());
+            return source.isOpen() && source.hash() == h.srcHash;
+        }
+
+        // Opens a new file next to path under a name no other writer uses
+        static FILE *createTemp(const std::string &path, std::string &tmp) {
+            tmp = path + ".XXXXXX";
+            int fd = mkstemp(&tmp[0]);
+            if(fd < 0) {
+                return NULL;
+            }
+            fchmod(fd, 0644);
+            FILE *f = fdopen(fd, "wb");
+            if(f == NULL) {
+                close(fd);
+                remove(tmp.c_str());
+            }
+            return f;
+        }
+
+        // Closes a file from createTemp and renames it over path if it was
+        // written in full, removes it otherwise
+        static bool replace(FILE *f, const std::string &tmp, const std::string &path, bool ok) {
+            ok = fclose(f) == 0 && ok;
+            if(!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+                remove(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        // Writes the mapped sidecar again with the source's new mtime.
+        // Meshes may hold the old file mapped, so it is never written in
+        // place.
+        static void refresh(const std::string &path, const MappedFile &file, int64_t mtime) {
+            std::string tmp;
+            FILE *f = createTemp(path, tmp);
+            if(f == NULL) {
+                return;
+            }
+            SidecarHeader h;
+            memcpy(&h, file.data(), sizeof(h));
+            h.srcMtime = mtime;
+            replace(f, tmp, path, writeAll(f, &h, sizeof(h)) &&
+                                  writeAll(f, file.data() + sizeof(h), file.size() - sizeof(h)));
+        }
+
+        static void copyName(char *dst, const std::string &src) {
+            memset(dst, 0, SIDECAR_NAME);
+            memcpy(dst, src.data(), src.size() < SIDECAR_NAME ? src.size() : SIDECAR_NAME - 1);
+        }
+
+        static bool writeAll(FILE *f, const void *data, size_t bytes) {
+            return bytes == 0 || fwrite(data, 1, bytes, f) == bytes;
+        }
+
+    public:
+
+        // Fills an empty mesh from the sidecar of src, false if there is no
+        // usable sidecar. The content hash of src is stored in srcHash.
+        static bool load(const std::string &src, Trimesh *pmesh, uint64_t *srcHash = NULL) {
+            std::string path = sidecarPath(src);
+            std::shared_ptr<MappedFile> map = std::make_shared<MappedFile>(path.c_str());
+            const MappedFile &file = *map;
+            if(!file.isOpen() || file.size() < sizeof(SidecarHeader)) {
+                return false;
+            }
+
+            SidecarHeader h;
+            int64_t mtime;
+            memcpy(&h, file.data(), sizeof(h));
+            if(memcmp(h.magic, "TMC", 4) != 0 || h.version != SIDECAR_VERSION ||
+               (h.ntexcoords != 0 && h.ntexcoords != h.nverts) ||
+               file.size() != payloadSize(h) || !isCurrent(src, h, mtime)) {
+                return false;
+            }
+
+            // The header is a multiple of 8 bytes, so every array is aligned
+            const float    *pos   = reinterpret_cast<const float*>(file.data() + sizeof(h));
+            const float    *vnorm = pos + 3 * (size_t)h.nverts;
+            const uint32_t *ids   = reinterpret_cast<const uint32_t*>(vnorm + (h.fileNormals ? 3 * (size_t)h.nverts : 0));
+            const float    *uv    = reinterpret_cast<const float*>(ids + 3 * (size_t)h.nfaces);
+            const SidecarMaterial *mats = reinterpret_cast<const SidecarMaterial*>(uv + 2 * (size_t)h.ntexcoords);
+            const SidecarSubmesh  *subs = reinterpret_cast<const SidecarSubmesh*>(mats + h.nmaterials);
+
+            for(size_t i = 0; i < 3 * (size_t)h.nfaces; ++i) {
+                if(ids[i] >= h.nverts) {
+                    return false;
+                }
+            }
+
+            // The positions and indices match the mesh layout, so the mesh
+            // adopts them in place. When there are faces, the normals or
+            // indices follow the positions, so one float past them is
+            // readable. Normals from the file and texture coordinates are
+            // copied; computed normals are derived again when first needed.
+            pmesh->adopt(pos, h.nverts, ids, h.nfaces, map, h.fileNormals ? vnorm : NULL);
+            pmesh->texcoords.assign(uv, uv + 2 * (size_t)h.ntexcoords);
+            for(size_t i = 0; i < h.nmaterials; ++i) {
+                Material m;
+                m.name = std::string(mats[i].name, strnlen(mats[i].name, SIDECAR_NAME));
+                memcpy(m.ambient,  mats[i].ambient,  sizeof(m.ambient));
+                memcpy(m.diffuse,  mats[i].diffuse,  sizeof(m.diffuse));
+                memcpy(m.specular, mats[i].specular, sizeof(m.specular));
+                m.shininess = mats[i].shininess;
+                pmesh->addMaterial(m);
+            }
+            for(size_t i = 0; i < h.nsubmeshes; ++i) {
+                const SidecarSubmesh &sm = subs[i];
+                if(sm.material >= (int32_t)h.nmaterials || (uint64_t)sm.first + sm.count > h.nfaces) {
+                    pmesh->submeshes.clear();
+                    break;
+                }
+                pmesh->addSubmesh(std::string(sm.name, strnlen(sm.name, SIDECAR_NAME)), sm.material, sm.first, sm.count);
+            }
+            if(mtime != h.srcMtime) {
+                refresh(path, file, mtime);
+            }
+            if(srcHash != NULL) {
+                *srcHash = h.srcHash;
+            }
+            return true;
+        }
+
+        // Writes the sidecar for a mesh just parsed from src. The file is
+        // written under a temporary name of its own and renamed, so readers
+        // never see a partial sidecar and concurrent saves cannot mix. The content hash of src is stored in srcHash.
+        static bool save(const std::string &src, Trimesh *pmesh, uint64_t *srcHash = NULL) {
+            MappedFile source(src.c_str());
+            struct stat st;
+            if(!source.isOpen() || stat(src.c_str(), &st) != 0) {
+                return false;
+            }
+
+            SidecarHeader h;
+            memcpy(h.magic, "TMC", 4);
+            h.version  = SIDECAR_VERSION;
+            h.srcSize  = st.st_size;
+            h.srcMtime = mtimeOf(st);
+            h.srcHash  = source.hash();
+            h.nverts   = pmesh->nverts;
+            h.nfaces   = pmesh->nfaces;
+            h.ntexcoords  = pmesh->texcoords.size() / 2;
+            h.fileNormals = pmesh->hasFileNormals();
+            h.nmaterials  = pmesh->materials.size();
+            h.nsubmeshes  = pmesh->submeshes.size();
+
+            std::vector<SidecarMaterial> mats(h.nmaterials);
+            for(size_t i = 0; i < h.nmaterials; ++i) {
+                const Material &m = pmesh->materials[i];
+                copyName(mats[i].name, m.name);
+                memcpy(mats[i].ambient,  m.ambient,  sizeof(m.ambient));
+                memcpy(mats[i].diffuse,  m.diffuse,  sizeof(m.diffuse));
+                memcpy(mats[i].specular, m.specular, sizeof(m.specular));
+                mats[i].shininess = m.shininess;
+            }
+            std::vector<SidecarSubmesh> subs(h.nsubmeshes);
+            for(size_t i = 0; i < h.nsubmeshes; ++i) {
+                const Submesh &sm = pmesh->submeshes[i];
+                copyName(subs[i].name, sm.name);
+                subs[i].material = sm.material;
+                subs[i].first    = sm.first;
+                subs[i].count    = sm.count;
+            }
+
+            std::string path = sidecarPath(src);
+            std::string tmp;
+            FILE *f = createTemp(path, tmp);
+            if(f == NULL) {
+                return false;
+            }
+            bool ok = writeAll(f, &h, sizeof(h)) &&
+                      writeAll(f, pmesh->positions, 3 * (size_t)h.nverts * sizeof(float)) &&
+                      writeAll(f, pmesh->normals.data(), h.fileNormals ? 3 * (size_t)h.nverts * sizeof(float) : 0) &&
+                      writeAll(f, pmesh->indices, 3 * (size_t)h.nfaces * sizeof(uint32_t)) &&
+                      writeAll(f, pmesh->texcoords.data(), pmesh->texcoords.size() * sizeof(float)) &&
+                      writeAll(f, mats.data(), mats.size() * sizeof(SidecarMaterial)) &&
+                      writeAll(f, subs.data(), subs.size() * sizeof(SidecarSubmesh));
+            if(!replace(f, tmp, path, ok)) {
+                return false;
+            }
+            if(srcHash != NULL) {
+                *srcHash = h.srcHash;
+            }
+            return true;
+        }
+};
+
+#endif
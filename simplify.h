@@ -0,0 +1,441 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __SIMPLIFY_H__
+#define __SIMPLIFY_H__
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "geom.h"
+
+// Weight of the planes that hold a boundary edge in place, per squared
+// edge length
+#define SIMPLIFY_BORDER_WEIGHT 10.0f
+
+// Sum of squared distances to a set of planes, each weighted by the area
+// it came from, as the symmetric matrix of Garland and Heckbert, "Surface
+// simplification using quadric error metrics". w is the total weight.
+struct Quadric {
+    float a00, a01, a02, a11, a12, a22;
+    float b0, b1, b2, c, w;
+
+    // The plane n.p + d = 0, n unit length
+    void addPlane(const float *n, float d, float weight) {
+        a00 += weight * n[0] * n[0]; a01 += weight * n[0] * n[1]; a02 += weight * n[0] * n[2];
+        a11 += weight * n[1] * n[1]; a12 += weight * n[1] * n[2]; a22 += weight * n[2] * n[2];
+        b0  += weight * n[0] * d;    b1  += weight * n[1] * d;    b2  += weight * n[2] * d;
+        c   += weight * d * d;
+        w   += weight;
+    }
+
+    void add(const Quadric &q) {
+        a00 += q.a00; a01 += q.a01; a02 += q.a02; a11 += q.a11; a12 += q.a12; a22 += q.a22;
+        b0  += q.b0;  b1  += q.b1;  b2  += q.b2;  c   += q.c;   w   += q.w;
+    }
+
+    // Weighted mean of the squared distances of p to the planes
+    float error(const float *p) const {
+        float x = p[0], y = p[1], z = p[2];
+        float e = a00 * x * x + a11 * y * y + a22 * z * z + 2.0f * (a01 * x * y + a02 * x * z + a12 * y * z) +
+                  2.0f * (b0 * x + b1 * y + b2 * z) + c;
+        return w > 0.0f && e > 0.0f ? e / w : 0.0f;
+    }
+};
+
+// The collapses of a simplification in the order they were made, in the
+// numbering of the full mesh: vertex from moved onto vertex to, the faces
+// that held both went away, and the corners of the other faces at from now
+// point to to. Collapse i owns faces [faceEnd of i - 1, faceEnd) and
+// corners [cornerEnd of i - 1, cornerEnd); a corner is 3 * face + k.
+struct CollapseRecord {
+    uint32_t from, to;
+    // Distance of the collapse from the planes it replaced, in the units
+    // of the mesh's positions
+    float error;
+    uint32_t faceEnd, cornerEnd;
+};
+
+struct CollapseHistory {
+    std::vector<CollapseRecord> collapses;
+    std::vector<uint32_t> faces;
+    std::vector<uint32_t> corners;
+};
+
+// Simplifies a mesh by edge collapse, cheapest collapse first by quadric
+// error. Vertices always collapse onto the other end of their edge, so a
+// level only uses vertices of the full mesh, with their texture
+// coordinates. Boundary edges carry extra planes at right angles to their
+// face so open borders stay put.
+//
+// Collapses are made in rounds. Each round finds the cheapest direction of
+// every edge, sorts them, and makes as many as it can from the cheapest
+// up, skipping any that would flip a face or touch a vertex whose
+// neighborhood an earlier collapse in the round changed. Simplifying in
+// steps continues from the last result, so a chain of levels costs about
+// as much as its first level.
+//
+// Submesh ranges move along with the faces, so materials stay. Positions
+// are scaled into the unit cube so the float quadrics keep their precision.
+//
+// Given a history, every collapse is also written down as it is made, for
+// undoing them in reverse (see ProgressiveMesh). Collapses in one round
+// never share a face, so their order within the round does not matter.
+class MeshSimplifier {
+
+    private:
+
+        // Collapse of vertex from onto vertex to
+        struct Collapse {
+            uint32_t from, to;
+            float cost;
+        };
+
+        const Trimesh *mesh;
+        float lo[3], scale;
+
+        // The current mesh. Vertices are numbered from 0 and origin maps
+        // them to the vertices of the full mesh.
+        std::vector<uint32_t> origin;
+        std::vector<float>    pos;
+        std::vector<Quadric>  quadrics;
+        std::vector<uint32_t> ids;
+        std::vector<Submesh>  submeshes;
+
+        // Where the collapses go, and the face of the full mesh each
+        // current face is, while there is a history
+        CollapseHistory *history = NULL;
+        std::vector<uint32_t> faceOrigin;
+
+        // Largest collapse cost so far
+        float worst = 0.0f;
+
+        static void cross(const float *a, const float *b, const float *c, float *n) {
+            float u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+            float v[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+            n[0] = u[1] * v[2] - u[2] * v[1];
+            n[1] = u[2] * v[0] - u[0] * v[2];
+            n[2] = u[0] * v[1] - u[1] * v[0];
+        }
+
+        static uint64_t edgeKey(uint32_t a, uint32_t b) {
+            return a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+        }
+
+        // Plane quadrics of every face at its corners, and of every
+        // boundary edge at its ends
+        void buildQuadrics() {
+            size_t nf = ids.size() / 3;
+            quadrics.assign(pos.size() / 3, Quadric());
+            std::vector<std::pair<uint64_t, uint32_t> > keys(3 * nf);
+            for(size_t f = 0; f < nf; ++f) {
+                const uint32_t *t = &ids[3 * f];
+                float n[3];
+                cross(&pos[3 * t[0]], &pos[3 * t[1]], &pos[3 * t[2]], n);
+                float len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                if(len > 0.0f) {
+                    n[0] /= len; n[1] /= len; n[2] /= len;
+                    float d = -(n[0] * pos[3 * t[0]] + n[1] * pos[3 * t[0] + 1] + n[2] * pos[3 * t[0] + 2]);
+                    for(int k = 0; k < 3; ++k) {
+                        quadrics[t[k]].addPlane(n, d, 0.5f * len);
+                    }
+                }
+                for(int k = 0; k < 3; ++k) {
+                    keys[3 * f + k] = std::make_pair(edgeKey(t[k], t[(k + 1) % 3]), (uint32_t)(3 * f + k));
+                }
+            }
+            std::sort(keys.begin(), keys.end());
+            for(size_t i = 0; i < keys.size(); ++i) {
+                bool alone = (i == 0 || keys[i - 1].first != keys[i].first) &&
+                             (i + 1 == keys.size() || keys[i + 1].first != keys[i].first);
+                if(!alone) {
+                    continue;
+                }
+                size_t f = keys[i].second / 3, k = keys[i].second % 3;
+                const float *a = &pos[3 * ids[3 * f + k]];
+                const float *b = &pos[3 * ids[3 * f + (k + 1) % 3]];
+                float n[3], e[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] }, p[3];
+                cross(&pos[3 * ids[3 * f]], &pos[3 * ids[3 * f + 1]], &pos[3 * ids[3 * f + 2]], n);
+                // At right angles to the face, through the edge
+                p[0] = e[1] * n[2] - e[2] * n[1];
+                p[1] = e[2] * n[0] - e[0] * n[2];
+                p[2] = e[0] * n[1] - e[1] * n[0];
+                float len = sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+                if(len == 0.0f) {
+                    continue;
+                }
+                p[0] /= len; p[1] /= len; p[2] /= len;
+                float d = -(p[0] * a[0] + p[1] * a[1] + p[2] * a[2]);
+                float weight = SIMPLIFY_BORDER_WEIGHT * (e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
+                quadrics[ids[3 * f + k]].addPlane(p, d, weight);
+                quadrics[ids[3 * f + (k + 1) % 3]].addPlane(p, d, weight);
+            }
+        }
+
+        // Whether moving c.from onto c.to turns one of the faces around
+        // c.from over. Faces holding both ends disappear and do not count.
+        bool flips(const Collapse &c, const std::vector<uint32_t> &offsets, const std::vector<uint32_t> &faces) const {
+            for(uint32_t i = offsets[c.from]; i < offsets[c.from + 1]; ++i) {
+                const uint32_t *t = &ids[3 * (size_t)faces[i]];
+                if(t[0] == c.to || t[1] == c.to || t[2] == c.to) {
+                    continue;
+                }
+                const float *p[3], *q[3];
+                for(int k = 0; k < 3; ++k) {
+                    p[k] = &pos[3 * t[k]];
+                    q[k] = t[k] == c.from ? &pos[3 * c.to] : p[k];
+                }
+                float before[3], after[3];
+                cross(p[0], p[1], p[2], before);
+                cross(q[0], q[1], q[2], after);
+                float dot = before[0] * after[0] + before[1] * after[1] + before[2] * after[2];
+                float b2  = before[0] * before[0] + before[1] * before[1] + before[2] * before[2];
+                float a2  = after[0] * after[0] + after[1] * after[1] + after[2] * after[2];
+                // A sliver that was already flat does not count
+                if(b2 > 0.0f && dot <= 0.25f * sqrtf(a2 * b2)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Writes c down in the history, in terms of the full mesh
+        void note(const Collapse &c, const std::vector<uint32_t> &offsets, const std::vector<uint32_t> &faces) {
+            for(uint32_t i = offsets[c.from]; i < offsets[c.from + 1]; ++i) {
+                const uint32_t *t = &ids[3 * (size_t)faces[i]];
+                uint32_t f = faceOrigin[faces[i]];
+                if(t[0] == c.to || t[1] == c.to || t[2] == c.to) {
+                    history->faces.push_back(f);
+                    continue;
+                }
+                for(int k = 0; k < 3; ++k) {
+                    if(t[k] == c.from) {
+                        history->corners.push_back(3 * f + k);
+                    }
+                }
+            }
+            CollapseRecord r = { origin[c.from], origin[c.to], sqrtf(c.cost) * scale,
+                                 (uint32_t)history->faces.size(), (uint32_t)history->corners.size() };
+            history->collapses.push_back(r);
+        }
+
+        // One round of at most want collapses. Returns how many were made.
+        size_t round(size_t want) {
+            size_t nv = pos.size() / 3, nf = ids.size() / 3;
+
+            std::vector<uint32_t> offsets(nv + 1, 0), faces(3 * nf);
+            for(size_t i = 0; i < 3 * nf; ++i) {
+                offsets[ids[i] + 1]++;
+            }
+            for(size_t v = 0; v < nv; ++v) {
+                offsets[v + 1] += offsets[v];
+            }
+            {
+                std::vector<uint32_t> at(offsets.begin(), offsets.end() - 1);
+                for(size_t i = 0; i < 3 * nf; ++i) {
+                    faces[at[ids[i]]++] = i / 3;
+                }
+            }
+
+            // The cheaper direction of every edge
+            std::vector<uint64_t> keys(3 * nf);
+            for(size_t f = 0; f < nf; ++f) {
+                for(int k = 0; k < 3; ++k) {
+                    keys[3 * f + k] = edgeKey(ids[3 * f + k], ids[3 * f + (k + 1) % 3]);
+                }
+            }
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+            std::vector<Collapse> collapses(keys.size());
+            for(size_t i = 0; i < keys.size(); ++i) {
+                uint32_t a = keys[i] >> 32, b = (uint32_t)keys[i];
+                Quadric q = quadrics[a];
+                q.add(quadrics[b]);
+                float ea = q.error(&pos[3 * a]), eb = q.error(&pos[3 * b]);
+                Collapse c = { ea <= eb ? b : a, ea <= eb ? a : b, std::min(ea, eb) };
+                collapses[i] = c;
+            }
+            std::vector<uint64_t>().swap(keys);
+            std::sort(collapses.begin(), collapses.end(), [](const Collapse &a, const Collapse &b) {
+                return a.cost < b.cost;
+            });
+
+            std::vector<uint32_t> remap(nv);
+            std::vector<char> locked(nv, 0);
+            for(size_t v = 0; v < nv; ++v) {
+                remap[v] = v;
+            }
+            size_t made = 0;
+            for(size_t i = 0; i < collapses.size() && made < want; ++i) {
+                const Collapse &c = collapses[i];
+                if(locked[c.from] || locked[c.to] || flips(c, offsets, faces)) {
+                    continue;
+                }
+                remap[c.from] = c.to;
+                quadrics[c.to].add(quadrics[c.from]);
+                worst = std::max(worst, c.cost);
+                if(history != NULL) {
+                    note(c, offsets, faces);
+                }
+                for(uint32_t j = offsets[c.from]; j < offsets[c.from + 1]; ++j) {
+                    for(int k = 0; k < 3; ++k) {
+                        locked[ids[3 * (size_t)faces[j] + k]] = 1;
+                    }
+                }
+                made++;
+            }
+            if(made > 0) {
+                removeFaces(remap);
+            }
+            return made;
+        }
+
+        // Renames the corners through remap and drops the faces that lost
+        // an edge, moving the submesh ranges along
+        void removeFaces(const std::vector<uint32_t> &remap) {
+            size_t nf = ids.size() / 3, kept = 0;
+            std::vector<int> starts(nf + 1);
+            for(size_t f = 0; f < nf; ++f) {
+                starts[f] = kept;
+                uint32_t a = remap[ids[3 * f]], b = remap[ids[3 * f + 1]], c = remap[ids[3 * f + 2]];
+                if(a != b && b != c && a != c) {
+                    ids[3 * kept]     = a;
+                    ids[3 * kept + 1] = b;
+                    ids[3 * kept + 2] = c;
+                    if(!faceOrigin.empty()) {
+                        faceOrigin[kept] = faceOrigin[f];
+                    }
+                    kept++;
+                }
+            }
+            starts[nf] = kept;
+            ids.resize(3 * kept);
+            if(!faceOrigin.empty()) {
+                faceOrigin.resize(kept);
+            }
+            for(Submesh &sm : submeshes) {
+                int first = starts[sm.first];
+                sm.count = starts[sm.first + sm.count] - first;
+                sm.first = first;
+            }
+        }
+
+        // Drops the vertices no face uses any more
+        void compact() {
+            size_t nv = pos.size() / 3, kept = 0;
+            std::vector<uint32_t> rename(nv, UINT32_MAX);
+            for(uint32_t v : ids) {
+                rename[v] = 0;
+            }
+            for(size_t v = 0; v < nv; ++v) {
+                if(rename[v] == 0) {
+                    rename[v] = kept;
+                    origin[kept] = origin[v];
+                    memmove(&pos[3 * kept], &pos[3 * v], 3 * sizeof(float));
+                    quadrics[kept] = quadrics[v];
+                    kept++;
+                }
+            }
+            for(uint32_t &v : ids) {
+                v = rename[v];
+            }
+            origin.resize(kept);
+            pos.resize(3 * kept);
+            quadrics.resize(kept);
+        }
+
+    public:
+
+        MeshSimplifier(const Trimesh *mesh) : mesh(mesh) {
+            size_t nv = mesh->numVerts(), nf = mesh->numFaces();
+            const float *bounds = mesh->getBounds();
+            scale = 0.0f;
+            for(int k = 0; k < 3; ++k) {
+                lo[k] = bounds[k];
+                scale = std::max(scale, bounds[k + 3] - bounds[k]);
+            }
+            if(!(scale > 0.0f)) {
+                scale = 1.0f;
+            }
+            const float *p = mesh->getPositions();
+            origin.resize(nv);
+            pos.resize(3 * nv);
+            for(size_t v = 0; v < nv; ++v) {
+                origin[v] = v;
+                for(int k = 0; k < 3; ++k) {
+                    pos[3 * v + k] = (p[3 * v + k] - lo[k]) / scale;
+                }
+            }
+            ids.assign(mesh->getIndices(), mesh->getIndices() + 3 * nf);
+            submeshes = mesh->getSubmeshes();
+            buildQuadrics();
+        }
+
+        size_t numFaces() const { return ids.size() / 3; }
+
+        // Records every collapse from here on in h, which must outlive the
+        // simplifier. Call before the first simplify().
+        void record(CollapseHistory *h) {
+            history = h;
+            faceOrigin.resize(numFaces());
+            for(size_t f = 0; f < faceOrigin.size(); ++f) {
+                faceOrigin[f] = f;
+            }
+        }
+
+        // The vertex and face of the full mesh each vertex and face of the
+        // current mesh is. Faces are only known while recording.
+        const std::vector<uint32_t> &vertexOrigins() const { return origin; }
+
+        const std::vector<uint32_t> &faceOrigins() const { return faceOrigin; }
+
+        // How far the current mesh strays from the full mesh, in the units
+        // of its positions: the root mean square distance, over the area
+        // around it, of the worst collapse so far to the planes of the
+        // faces it replaced. Never shrinks.
+        float error() const {
+            return sqrtf(worst) * scale;
+        }
+
+        // Collapses edges until at most target faces are left or no
+        // collapse is possible. Returns whether any face went.
+        bool simplify(size_t target) {
+            size_t before = numFaces();
+            while(numFaces() > target) {
+                // Most collapses take two faces
+                size_t want = std::max((numFaces() - target) / 2, (size_t)1);
+                if(round(want) == 0) {
+                    break;
+                }
+            }
+            compact();
+            return numFaces() < before;
+        }
+
+        // The current mesh as a Trimesh of its own
+        Trimesh *build() const {
+            const float *p = mesh->getPositions();
+            const std::vector<float> &uv = mesh->getTexcoords();
+            Trimesh *m = new Trimesh();
+            m->reserve(origin.size(), numFaces());
+            for(uint32_t v : origin) {
+                m->addVertex(&p[3 * (size_t)v]);
+                if(!uv.empty()) {
+                    m->addTexcoord(&uv[2 * (size_t)v]);
+                }
+            }
+            m->addFaces(reinterpret_cast<const int*>(ids.data()), numFaces());
+            for(const Material &mat : mesh->getMaterials()) {
+                m->addMaterial(mat);
+            }
+            for(const Submesh &sm : submeshes) {
+                m->addSubmesh(sm.name, sm.material, sm.first, sm.count);
+            }
+            return m;
+        }
+};
+
+#endif
@@ -0,0 +1,166 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __STLLOADER_H__
+#define __STLLOADER_H__
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "geom.h"
+#include "loader.h"
+#include "mapfile.h"
+#include "objscan.h"
+#include "weld.h"
+
+#define STL_HEADER_SIZE 84
+#define STL_RECORD_SIZE 50
+
+// Triangles read between progress reports and cancellation checks
+#define STL_PROGRESS_TRIS (1 << 16)
+
+// Faces handed to the mesh at a time
+#define STL_FACE_BLOCK 1024
+
+// Loads binary and ASCII STL files. STL stores three positions per triangle
+// and no connectivity, so corners with bit-identical positions are welded
+// into shared vertices by MeshWelder. The stored facet normals are ignored,
+// normals are computed from the welded mesh like for OBJ files.
+class StlLoader {
+
+    private:
+
+        LoadProgress *progress;
+
+        const char *base = NULL;
+
+        // Three positions per triangle, as stored in the file
+        std::vector<float> corners;
+
+        bool report(const char *at) {
+            if(progress == NULL) {
+                return true;
+            }
+            progress->bytes = at - base;
+            progress->tris  = corners.size() / 9;
+            return !progress->cancel;
+        }
+
+        static bool isBinary(const char *data, size_t size) {
+            if(size < STL_HEADER_SIZE) {
+                return false;
+            }
+            uint32_t n;
+            memcpy(&n, data + 80, 4);
+            return STL_HEADER_SIZE + (uint64_t)n * STL_RECORD_SIZE == size;
+        }
+
+        bool loadBinary(const char *data) {
+            uint32_t n;
+            memcpy(&n, data + 80, 4);
+            corners.resize(9 * (size_t)n);
+            const char *p = data + STL_HEADER_SIZE;
+            for(uint32_t i = 0; i < n; ++i, p += STL_RECORD_SIZE) {
+                memcpy(&corners[9 * (size_t)i], p + 12, 36);
+                if(i % STL_PROGRESS_TRIS == 0 && !report(p)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Skips whitespace and returns the end of the token at p
+        static const char *token(const char *&p, const char *end) {
+            while(p < end && (ObjScanner::isSep(*p) || *p == '\n')) p++;
+            const char *e = p;
+            while(e < end && !ObjScanner::isSep(*e) && *e != '\n') e++;
+            return e;
+        }
+
+        static bool tokenIs(const char *p, const char *e, const char *word) {
+            size_t n = strlen(word);
+            return (size_t)(e - p) == n && memcmp(p, word, n) == 0;
+        }
+
+        // Reads "vertex x y z" records, fanning each loop into triangles.
+        // Everything else (solid, facet normal, endloop...) only matters
+        // as a loop boundary.
+        bool loadASCII(const char *data, size_t size) {
+            const char *p = data;
+            const char *end = data + size;
+            std::vector<float> loop;
+            for(size_t lines = 1; p < end; ++lines) {
+                const char *e = token(p, end);
+                if(tokenIs(p, e, "vertex")) {
+                    p = e;
+                    float v[3];
+                    for(int k = 0; k < 3; ++k) {
+                        e = token(p, end);
+                        if(e == p || ObjScanner::decodeFloat(p, e, v[k]) != e) {
+                            return false;
+                        }
+                        p = e;
+                    }
+                    loop.insert(loop.end(), v, v + 3);
+                    continue;
+                }
+                if(tokenIs(p, e, "endloop") || tokenIs(p, e, "endfacet")) {
+                    for(size_t i = 6; i + 3 <= loop.size(); i += 3) {
+                        corners.insert(corners.end(), loop.begin(), loop.begin() + 3);
+                        corners.insert(corners.end(), loop.begin() + i - 3, loop.begin() + i + 3);
+                    }
+                    loop.clear();
+                }
+                p = e;
+                if(lines % PROGRESS_LINES == 0 && !report(p)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    public:
+
+        StlLoader(LoadProgress *progress = NULL) : progress(progress) {}
+
+        // Binary files are recognised by their size, since their 80 byte
+        // header may start with "solid" just like an ASCII file
+        static bool isSTL(const char *data, size_t size) {
+            return isBinary(data, size) ||
+                   (size >= 6 && memcmp(data, "solid", 5) == 0 && (ObjScanner::isSep(data[5]) || data[5] == '\n'));
+        }
+
+        bool loadSTL(const char *stlfile, Trimesh *pmesh) {
+            MappedFile file(stlfile);
+            if(!file.isOpen()) return false;
+            if(progress) progress->total = file.size();
+
+            base = file.data();
+            corners.clear();
+            bool ok = isBinary(file.data(), file.size()) ? loadBinary(file.data())
+                                                          : loadASCII(file.data(), file.size());
+            if(!ok) return false;
+
+            // Every corner its own vertex, then the welder merges the ones
+            // at the same position and drops the faces that collapsed
+            size_t n = corners.size() / 3;
+            pmesh->reserve(n, n / 3);
+            pmesh->addVertices(corners.data(), n);
+            corners = std::vector<float>();
+            int ids[3 * STL_FACE_BLOCK];
+            for(size_t f = 0; f < n / 3; f += STL_FACE_BLOCK) {
+                size_t count = std::min((size_t)STL_FACE_BLOCK, n / 3 - f);
+                for(size_t i = 0; i < 3 * count; ++i) {
+                    ids[i] = 3 * f + i;
+                }
+                pmesh->addFaces(ids, count);
+            }
+            MeshWelder(0.0f).weld(pmesh);
+            report(base + file.size());
+            return true;
+        }
+};
+
+#endif
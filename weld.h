@@ -0,0 +1,313 @@
+// Christian Dinh
+// eid: ctd487
+
+#ifndef __WELD_H__
+#define __WELD_H__
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "geom.h"
+
+// Least vertices worth another thread when welding
+#define WELD_MIN_WORK 65536
+
+// What a weld did to a mesh. Bytes count the stored arrays: positions,
+// indices, texture coordinates and file normals.
+struct WeldStats {
+    size_t vertsBefore = 0, vertsAfter = 0;
+    size_t facesBefore = 0, facesAfter = 0;
+    size_t bytesBefore = 0, bytesAfter = 0;
+};
+
+// Merges vertices closer than eps, remaps the faces onto the merged
+// vertices and drops faces that lost an edge. With eps 0 only vertices at
+// bit-identical positions (0 and -0 alike) are merged.
+//
+// Vertices are binned into a grid of 4 eps wide cells, hashed into buckets
+// of an index list built by counting sort, so the pass is linear. A vertex
+// only has to look at its own cell, and at the neighbors on the axes where
+// it is within eps of the edge, to find every vertex within eps. With eps 0
+// a single pass over a hash table of exact positions does instead; it is
+// about twice as fast on one thread and never uses more.
+//
+// Each vertex is merged into the lowest numbered vertex within eps, and
+// that one in turn into its own, so every link in a chain is shorter than
+// eps. The result does not depend on the number of threads; with several,
+// each takes a range of buckets, that is a set of cells.
+//
+// Merged vertices keep the position and texture coordinate of the lowest
+// numbered one and the kept vertices stay in order. Normals read from the
+// file belong to the corners that were merged away, so they are dropped
+// once anything merges and derived again from the welded faces.
+class MeshWelder {
+
+    private:
+
+        // A vertex in bucket order
+        struct Entry {
+            float p[3];
+            uint32_t v;
+        };
+
+        float eps;
+        int nthreads;
+
+        static uint32_t bitsOf(float f) {
+            // -0 and 0 are the same position
+            if(f == 0.0f) {
+                return 0;
+            }
+            uint32_t u;
+            memcpy(&u, &f, 4);
+            return u;
+        }
+
+        static uint64_t hashCell(int64_t x, int64_t y, int64_t z) {
+            uint64_t h = ((uint64_t)x * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)y * 0xc2b2ae3d27d4eb4fULL) ^
+                         ((uint64_t)z * 0x165667b19e3779f9ULL);
+            return h ^ (h >> 29);
+        }
+
+        // Grid cell of one coordinate, and which neighbor cell along that
+        // axis may hold a point within eps: -1, 1, or 0 for none. Far out or
+        // non-finite coordinates share the outermost cells, which only
+        // costs time.
+        int64_t cellOf(float f, int &side) const {
+            side = 0;
+            double c = (double)f / (4.0 * eps);
+            double fl = std::floor(c);
+            // A little more than eps from either edge, for rounding
+            if(c - fl < 0.3) side = -1;
+            if(c - fl > 0.7) side = 1;
+            if(!(fl > -4e18)) return (int64_t)-4e18;
+            if(!(fl <  4e18)) return (int64_t) 4e18;
+            return (int64_t)fl;
+        }
+
+        bool close(const float *a, const float *b) const {
+            if(eps == 0.0f) {
+                return bitsOf(a[0]) == bitsOf(b[0]) && bitsOf(a[1]) == bitsOf(b[1]) && bitsOf(a[2]) == bitsOf(b[2]);
+            }
+            float dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+            return dx * dx + dy * dy + dz * dz <= eps * eps;
+        }
+
+        static size_t bytesOf(const Trimesh *mesh) {
+            return mesh->nverts * (mesh->fileNormals ? 24 : 12) + mesh->nfaces * 12 + mesh->texcoords.size() * 4;
+        }
+
+        // First vertex at the same position as each vertex, through an open
+        // addressing table of vertex numbers
+        void findExact(const Trimesh *mesh, std::vector<uint32_t> &merge) const {
+            const float *pos = mesh->positions;
+            size_t n = mesh->nverts;
+            size_t cap = 16;
+            while(cap < 2 * n) cap <<= 1;
+            std::vector<uint32_t> table(cap, UINT32_MAX);
+            merge.resize(n);
+            for(size_t v = 0; v < n; ++v) {
+                const float *p = &pos[3 * v];
+                size_t slot = hashCell(bitsOf(p[0]), bitsOf(p[1]), bitsOf(p[2])) & (cap - 1);
+                for(;; slot = (slot + 1) & (cap - 1)) {
+                    uint32_t id = table[slot];
+                    if(id == UINT32_MAX) {
+                        table[slot] = v;
+                        merge[v] = v;
+                        break;
+                    }
+                    if(close(p, &pos[3 * (size_t)id])) {
+                        merge[v] = id;
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Lowest numbered vertex within eps of each vertex, the vertex
+        // itself if there is none before it
+        void findMerges(const Trimesh *mesh, std::vector<uint32_t> &merge) const {
+            if(eps == 0.0f) {
+                findExact(mesh, merge);
+                return;
+            }
+            const float *pos = mesh->positions;
+            size_t n = mesh->nverts;
+            size_t cap = 16;
+            while(cap < n) cap <<= 1;
+            size_t nt = std::max((size_t)1, std::min(n / WELD_MIN_WORK, (size_t)std::max(nthreads, 1)));
+
+            // Bucket of every vertex, then the vertices of each bucket in
+            // ascending order with a copy of their positions, so a bucket
+            // is read front to back
+            std::vector<uint32_t> bucket(n);
+            Trimesh::forRanges(nt, n, [&](size_t, size_t first, size_t last) {
+                int side;
+                for(size_t v = first; v < last; ++v) {
+                    const float *p = &pos[3 * v];
+                    bucket[v] = hashCell(cellOf(p[0], side), cellOf(p[1], side), cellOf(p[2], side)) & (cap - 1);
+                }
+            });
+            std::vector<uint32_t> start(cap + 1, 0);
+            for(size_t v = 0; v < n; ++v) {
+                start[bucket[v] + 1]++;
+            }
+            for(size_t b = 0; b < cap; ++b) {
+                start[b + 1] += start[b];
+            }
+            std::vector<Entry> sorted(n);
+            {
+                std::vector<uint32_t> at(start.begin(), start.end() - 1);
+                for(size_t v = 0; v < n; ++v) {
+                    Entry &e = sorted[at[bucket[v]]++];
+                    memcpy(e.p, &pos[3 * v], 3 * sizeof(float));
+                    e.v = v;
+                }
+            }
+            std::vector<uint32_t>().swap(bucket);
+
+            // Cells are 4 eps wide, so everything within eps of a vertex is
+            // in its own cell, or in the neighbor on an axis where it is near
+            // the edge: 1 cell for most vertices, at most 8
+            merge.resize(n);
+            Trimesh::forRanges(nt, cap, [&](size_t, size_t first, size_t last) {
+                for(size_t b = first; b < last; ++b) {
+                    for(uint32_t i = start[b]; i < start[b + 1]; ++i) {
+                        uint32_t v = sorted[i].v, best = v;
+                        const float *p = sorted[i].p;
+                        int d[3];
+                        int64_t c[3] = { cellOf(p[0], d[0]), cellOf(p[1], d[1]), cellOf(p[2], d[2]) };
+                        for(int k = 0; k < 8; ++k) {
+                            if(((k & 1) && !d[0]) || ((k & 2) && !d[1]) || ((k & 4) && !d[2])) {
+                                continue;
+                            }
+                            size_t nb = hashCell(c[0] + (k & 1 ? d[0] : 0), c[1] + (k & 2 ? d[1] : 0),
+                                                 c[2] + (k & 4 ? d[2] : 0)) & (cap - 1);
+                            // Ascending, so nothing past best can win
+                            for(uint32_t j = start[nb]; j < start[nb + 1] && sorted[j].v < best; ++j) {
+                                if(close(p, sorted[j].p)) {
+                                    best = sorted[j].v;
+                                }
+                            }
+                        }
+                        merge[v] = best;
+                    }
+                }
+            });
+        }
+
+    public:
+
+        MeshWelder(float eps = 0.0f, int nthreads = 1) : eps(eps > 0.0f ? eps : 0.0f), nthreads(nthreads) {}
+
+        // Welds the mesh in place and shrinks its arrays to fit. Returns
+        // whether anything changed.
+        bool weld(Trimesh *mesh, WeldStats *stats = NULL) {
+            WeldStats s;
+            s.vertsBefore = mesh->nverts;
+            s.facesBefore = mesh->nfaces;
+            s.bytesBefore = bytesOf(mesh);
+
+            // Follow each vertex to the end of its chain. Merges always go
+            // to a lower number, so in ascending order the target is final
+            // by the time it is needed. Then number the kept vertices.
+            std::vector<uint32_t> merge;
+            findMerges(mesh, merge);
+            size_t kept = 0;
+            for(size_t v = 0; v < merge.size(); ++v) {
+                merge[v] = merge[v] == v ? kept++ : merge[merge[v]];
+            }
+
+            // Nothing is written when no vertex merges and no face is
+            // degenerate, so adopted arrays stay where they are
+            bool degenerate = false;
+            for(size_t f = 0; kept == mesh->nverts && !degenerate && f < mesh->nfaces; ++f) {
+                const uint32_t *t = &mesh->indices[3 * f];
+                degenerate = t[0] == t[1] || t[1] == t[2] || t[0] == t[2];
+            }
+            if(kept == mesh->nverts && !degenerate) {
+                s.vertsAfter = s.vertsBefore;
+                s.facesAfter = s.facesBefore;
+                s.bytesAfter = s.bytesBefore;
+                if(stats != NULL) {
+                    *stats = s;
+                }
+                return false;
+            }
+            mesh->own();
+
+            // Kept vertices only move down, so they are compacted in place
+            float *pos = mesh->positions;
+            float *uv  = mesh->texcoords.empty() ? NULL : mesh->texcoords.data();
+            for(size_t v = 0, next = 0; v < merge.size(); ++v) {
+                if(merge[v] == next) {
+                    memmove(&pos[3 * next], &pos[3 * v], 3 * sizeof(float));
+                    if(uv != NULL) {
+                        uv[2 * next]     = uv[2 * v];
+                        uv[2 * next + 1] = uv[2 * v + 1];
+                    }
+                    next++;
+                }
+            }
+
+            // Remap the faces and drop the degenerate ones, moving the
+            // submesh ranges along
+            uint32_t *ids = mesh->indices;
+            std::vector<Submesh> &subs = mesh->submeshes;
+            std::vector<int> ends(2 * subs.size());
+            size_t faces = 0, at = 0;
+            for(size_t f = 0; f <= mesh->nfaces; ++f) {
+                for(; at < ends.size(); ++at) {
+                    const Submesh &sm = subs[at / 2];
+                    if((size_t)(at % 2 ? sm.first + sm.count : sm.first) != f) break;
+                    ends[at] = faces;
+                }
+                if(f == mesh->nfaces) break;
+                uint32_t a = merge[ids[3 * f]], b = merge[ids[3 * f + 1]], c = merge[ids[3 * f + 2]];
+                if(a != b && b != c && a != c) {
+                    ids[3 * faces]     = a;
+                    ids[3 * faces + 1] = b;
+                    ids[3 * faces + 2] = c;
+                    faces++;
+                }
+            }
+            for(; at < ends.size(); ++at) {
+                ends[at] = faces;
+            }
+            for(size_t i = 0; i < subs.size(); ++i) {
+                subs[i].first = ends[2 * i];
+                subs[i].count = ends[2 * i + 1] - ends[2 * i];
+            }
+
+            bool changed = kept != mesh->nverts || faces != mesh->nfaces;
+            if(mesh->fileNormals && kept != mesh->nverts) {
+                mesh->setFileNormals(false);
+            }
+            mesh->nverts = kept;
+            mesh->nfaces = faces;
+            if(mesh->texcoords.size() > 2 * kept) {
+                mesh->texcoords.resize(2 * kept);
+                mesh->texcoords.shrink_to_fit();
+            }
+            if(mesh->fileNormals) {
+                mesh->normals.resize(3 * kept);
+            }
+            if(changed) {
+                mesh->grow(kept, faces);
+                mesh->invalidate(Trimesh::VERT_EDIT | Trimesh::FACE_EDIT);
+            }
+
+            s.vertsAfter = mesh->nverts;
+            s.facesAfter = mesh->nfaces;
+            s.bytesAfter = bytesOf(mesh);
+            if(stats != NULL) {
+                *stats = s;
+            }
+            return changed;
+        }
+};
+
+#endif